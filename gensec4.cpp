@@ -75,6 +75,35 @@ Copyright 1989 James T. Perkins
 #include <sstream>
 #include <iomanip>
 #include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <cstdarg>
+#include <cmath>
+#include <climits>
+#include <vector>
+#include <unordered_set>
+#include <queue>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <map>
+#include <list>
+#include <set>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <dirent.h>
+#include <zlib.h>
 //#include <ctime>
 using namespace std;
 
@@ -82,6 +111,118 @@ using namespace std;
 /* Maximum number of systems in a sector */
 #define MAX_SYS 1280
 
+/* Size of a sector in hexes */
+#define SECTOR_COLS 32
+#define SECTOR_ROWS 40
+#define SUBSECTOR_COLS 8
+#define SUBSECTOR_ROWS 10
+
+/* SVG maps: hex size, from centre to corner, and the space around the map */
+#define SVG_HEX_RADIUS 32.0
+#define SVG_MARGIN 12.0
+
+/* ASCII maps: rows a hex slants over, width of its top, and the size
+   of a subsector drawn with them */
+#define MAP_SLANT 2
+#define MAP_TOP 10
+#define MAP_PITCH (MAP_SLANT + MAP_TOP)
+#define MAP_WIDTH (SUBSECTOR_COLS * MAP_PITCH + MAP_SLANT)
+#define MAP_HEIGHT (SUBSECTOR_ROWS * 2 * MAP_SLANT + MAP_SLANT + 1)
+
+/* Heatmaps: what each one shows, and pixels in a strip */
+#define HEAT_DENSITY 0
+#define HEAT_POPULATION 1
+#define HEAT_TECH 2
+#define HEAT_KINDS 3
+#define HEAT_STRIP_PIXELS 65536
+
+/* Polity growth: jump range, growth cost an empire can spend, and the
+   most polities a region can hold */
+#define POLITY_JUMP 2
+#define POLITY_REACH 24
+#define MAX_POLITIES 4096
+#define NO_LABEL 0x7fffffff
+
+/* X-boat routes: jump range of the network, and no link found yet */
+#define XBOAT_JUMP 4
+#define NO_EDGE 0x7fffffffffffffffLL
+
+/* Name generator: end of name plus 26 letters, states of two symbols */
+#define NAME_SYMBOLS 27
+#define NAME_STATES (NAME_SYMBOLS * NAME_SYMBOLS)
+#define NAME_MAX_LENGTH 25
+
+/* Random number streams, each hex has one for its system and its name */
+#define SEED_WORLD 0
+#define SEED_NAME 1
+#define SEED_POLITY 2
+#define SEED_EVOLVE 3
+
+/* Digits a world filter can limit: siz atm hyd pop gov law tl belts giants */
+#define FILTER_DIGITS 9
+#define FILTER_BELTS 7
+
+/* Bitmask words, of 64 worlds each, scanned per work item of a query */
+#define QUERY_SLICE 1024
+
+/* Evolution: jump range tech spreads over, and worlds per work item of a step */
+#define EVOLVE_JUMP 2
+#define EVOLVE_SLICE 4096
+
+/* Lines of a sector file formatted per work item */
+#define WRITE_CHUNK 128
+
+/* Formatted sectors waiting for the writer thread, at most */
+#define WRITE_QUEUE 4
+
+/* Sector pack: magic at the start and end, and bytes of the footer */
+#define PACK_MAGIC "GSPACK01"
+#define PACK_FOOTER 24
+
+/* Version of the checkpoint file of a region run */
+#define CHECKPOINT_VERSION "#gensec4 checkpoint 1"
+
+
+/* Worlds per block of a region archive, a multiple of 64 */
+#define ARCHIVE_BLOCK 65536
+#define ARCHIVE_MAGIC "GSARCH01"
+
+/* Columns of a region archive */
+#define ARC_NAME 0
+#define ARC_HEX 1
+#define ARC_X 2
+#define ARC_Y 3
+#define ARC_PORT 4
+#define ARC_DIGIT 5			/* FILTER_DIGITS columns, size to gas giants */
+#define ARC_MUL (ARC_DIGIT + FILTER_DIGITS)
+#define ARC_BASE (ARC_MUL + 1)
+#define ARC_ZONE (ARC_MUL + 2)
+#define ARC_CODES (ARC_MUL + 3)
+#define ARC_ALLEGIANCE (ARC_MUL + 4)
+#define ARC_COLUMNS (ARC_MUL + 5)
+
+/* Archive column encodings, other than 1, 2 or 4 bytes a value */
+#define ARC_RLE 5			/* Runs of 2 byte length - 1, 1 byte value */
+#define ARC_TEXT 6			/* 1 byte length, then the text */
+
+/* Trade classification bits, in the order generateSystem writes them */
+#define TC_HI 0x0001
+#define TC_LO 0x0002
+#define TC_BA 0x0004
+#define TC_AG 0x0008
+#define TC_NA 0x0010
+#define TC_IN 0x0020
+#define TC_NI 0x0040
+#define TC_RI 0x0080
+#define TC_PO 0x0100
+#define TC_DE 0x0200
+#define TC_WA 0x0400
+#define TC_AS 0x0800
+#define TC_VA 0x1000
+#define TC_FL 0x2000
+#define TC_IC 0x4000
+#define NUM_TRADE_CODES 15
+
 /* Local macros */
 #define D2 nDiceRoll(2, 6)
 #define D1 diceRoll(6)
@@ -100,6 +241,46 @@ struct optionValues
 	string namesFilePath;
 	int outputFormat;
 	string outputPath;
+	string rulesFilePath;
+	int regionCols;
+	int regionRows;
+	int polities;
+	int threads;
+	string route;
+	int jump;
+	int tradeJump;
+	bool xboat;
+	string nameCorpusPath;
+	unsigned long long seed;
+	bool seedGiven;
+	string hex;
+	bool galaxy;
+	int cacheMB;
+	string constraints;
+	string query;
+	bool archive;
+	string scanPath;
+	bool compress;
+	string manifestPath;
+	string cacheDir;
+	int cacheDirMB;
+	bool resume;
+	int checkpointSeconds;
+	bool checkpointGiven;
+	bool pack;
+	string unpackPath;
+	string entry;
+	bool update;
+	bool watch;
+	string diffOld;
+	string diffNew;
+	string svg;
+	string heatmap;
+	int heatmapCell;
+	bool ppm;
+	bool asciiMap;
+	int years;
+	int yearStep;
 };
 /* For storing the location of systems read from the hex/names file */
 struct starSystem
@@ -108,6 +289,7 @@ struct starSystem
 	string starName;
 	int xHex;
 	int yHex;
+	string allegiance;
 };
 /* For storing the generated systems */
 struct generatedSystem
@@ -123,24 +305,484 @@ struct generatedSystem
 	string stellar;
 	string satellite;
 	string gasGiant;
+	int regionX;		/* Hex position within the region */
+	int regionY;
+	bool canon;		/* Allegiance was given by the names file */
+};
+/* For storing the sectors of a region */
+struct sectorData
+{
+	string name;		/* Used for the names file and the output file */
+	string outputPath;
+	int secX;		/* Sector position within the region */
+	int secY;
+	int first;		/* First system of the sector in regionSys */
+	int count;		/* Number of systems in the sector */
+};
+/* For storing the jump routes between the systems of a region */
+struct jumpGraph
+{
+	int jump;			/* Jump range the graph was built for */
+	vector<int> start;		/* Routes of system i are start[i] to start[i + 1] - 1 */
+	vector<int> dest;		/* System at the far end of each route */
+	vector<unsigned char> dist;	/* Length of each route in parsecs */
+};
+/* For building a jump graph one sector at a time */
+struct jumpGraphBuild
+{
+	jumpGraph *graph;
+	bool fill;		/* Counting routes, or filling them in */
+	vector<int> dx[2];	/* Hex offsets within jump range, for even and odd columns */
+	vector<int> dy[2];
+	vector<int> dist[2];
+	int width;		/* Size of the region hex grid */
+	int height;
+};
+/* For growing polities one sector at a time */
+struct polityGrowth
+{
+	jumpGraph graph;
+	vector<int> label;	/* Growth cost * MAX_POLITIES + polity, or NO_LABEL */
+	vector<int> prev;	/* Labels as of the previous round */
+	vector<int> entryCost;	/* Extra cost of growing into each system */
+	vector<char> changed;	/* Sectors whose labels changed this round */
+};
+/* For the parts of a world that change as the years pass */
+struct evolveWorld
+{
+	char port;
+	unsigned char pop;
+	unsigned char gov;
+	unsigned char law;
+	unsigned char tl;
+	char zone;
+};
+/* For running the region forward in time, a step at a time */
+struct evolveWork
+{
+	jumpGraph graph;
+	vector<evolveWorld> state[2];	/* Each step reads one and writes the other */
+	int read;			/* Which one this step reads */
+	int step;
+	int years;			/* Years in this step */
+};
+/* For planning routes, kept between queries so buffers are reused */
+struct routeSearch
+{
+	jumpGraph graph;
+	vector<char> refuel;		/* Fuel is available at the system */
+	vector<int> axialQ;		/* Axial hex coordinates of each system */
+	vector<int> axialR;
+	vector<long long> cost;		/* Best cost found to each (system, fuel) state */
+	vector<int> from;		/* State before it on that route */
+	vector<unsigned> visited;	/* Search that last reached each state */
+	unsigned searchNum;
+	vector<pair<long long, int> > open;	/* Heap of states to expand */
+};
+/* For storing a trade route between two systems */
+struct tradeRoute
+{
+	int from;
+	int to;
+	int dist;		/* Parsecs */
+	int btn;		/* Bilateral Trade Number, in half steps */
+};
+/* For working out trade one sector at a time */
+struct tradeWork
+{
+	jumpGraph graph;
+	vector<int> wtn;			/* World Trade Number, in half steps */
+	vector<int> mask;			/* Trade classification bits */
+	vector<vector<tradeRoute> > routes;	/* Routes found in each sector */
+	vector<double> volume;			/* Credits a year through each system */
+};
+/* For building the X-boat network in parallel */
+struct xboatWork
+{
+	jumpGraph *graph;
+	vector<char> important;			/* System is on the network */
+	vector<vector<tradeRoute> > tileEdges;	/* Links found in each sector */
+	vector<tradeRoute> edges;		/* All links, in sector order */
+	vector<int> parent;			/* Union-find of the networks */
+	vector<int> comp;			/* Network of each system this round */
+	atomic<long long> *cheapest;		/* Shortest link out of each network */
+	int numSlices;				/* Slices of the edge list to search */
+};
+/* For storing a sector of the endless galaxy */
+struct galaxySector
+{
+	int secX;
+	int secY;
+	vector<generatedSystem> systems;
+	size_t bytes;		/* Rough memory use, counted against the cache budget */
+};
+/* For keeping recently used galaxy sectors, and generating their neighbours ahead of time */
+struct galaxyCache
+{
+	list<shared_ptr<const galaxySector> > lru;	/* Most recently used first */
+	map<long long, list<shared_ptr<const galaxySector> >::iterator> index;
+	set<long long> pending;		/* Sectors being generated right now */
+	deque<long long> prefetch;	/* Sectors for the prefetch thread to generate */
+	size_t used;			/* Bytes of the cached sectors */
+	size_t budget;
+	bool stop;
+	mutex lock;
+	condition_variable ready;	/* A sector was added to the cache */
+	condition_variable wake;	/* Work for the prefetch thread */
+	thread worker;
+};
+/* For one outcome of the physical or social UWP digits, and its odds */
+struct uwpOutcome
+{
+	int a, b, c;		/* Size, atmosphere, hydrographics or population, government, law */
+	double odds;
+};
+/* For outcomes that any constraint treats alike */
+struct uwpGroup
+{
+	int a, b, c;			/* One of the members, standing in for all of them */
+	int dm;				/* Tech level DM, the same for every member */
+	double odds;
+	vector<uwpOutcome> members;
+	vector<double> cumulative;	/* Running odds of the members */
+};
+/* For describing the worlds a constraint or query allows */
+struct worldFilter
+{
+	string ports;			/* Allowed letters, empty for any */
+	string bases;
+	string zones;
+	int low[FILTER_DIGITS];		/* Allowed UWP digits, then belts and gas giants */
+	int high[FILTER_DIGITS];
+	int needCodes;			/* Trade classification bits required */
+	int banCodes;			/* and ruled out */
+};
+/* For formatting a sector file in chunks, on all the threads */
+struct sectorFormat
+{
+	const generatedSystem *systems;
+	int count;
+	int outFormat;
+	bool lastNewline;		/* End the last line, to run on into the next sector */
+	vector<string> chunks;		/* The version line, then each chunk of lines */
+};
+/* For a sector file waiting for the writer thread */
+struct queuedFile
+{
+	int secX;
+	int secY;
+	string path;
+	string cacheKey;		/* Where it goes in the sector cache, if anywhere */
+	vector<string> chunks;
+};
+/* For handing formatted sector files to the writer thread */
+struct writeQueue
+{
+	deque<queuedFile> files;
+	bool done;					/* No more files are coming */
+	mutex lock;
+	condition_variable changed;
+};
+/* For carrying the settings of a job over to the threads working on it */
+struct jobSettings
+{
+	optionValues options;
+	int density;
+	int maturity;
+	ostream *report;
+};
+/* For one worker's share of the jobs of a manifest */
+struct jobDeque
+{
+	deque<int> jobs;		/* Line numbers, the owner works from the back */
+	mutex lock;
+};
+/* For running the jobs of a manifest */
+struct jobBatch
+{
+	vector<string> lines;		/* Command line of each job */
+	vector<int> lineNumbers;
+	vector<shared_ptr<jobDeque> > queues;	/* One per worker thread */
+	int finished;
+	int failed;
+	mutex reportLock;
+	ostream *report;
+};
+/* For the on-disk cache of sector files, shared by every run that uses it */
+struct sectorCache
+{
+	string dir;
+	long long budget;		/* Bytes the cache may hold */
+	atomic<int> hits;
+	atomic<int> stored;
+};
+/* For one sector file in a sector pack */
+struct packEntry
+{
+	int secX;
+	int secY;
+	long long offset;		/* Place of the file in the pack */
+	long long length;
+	int outFormat;
+	bool compressed;
+	string name;			/* File name it would have had on its own */
+};
+/* For writing the sector files of a run into one pack */
+struct sectorPack
+{
+	string path;
+	string temp;			/* Written here, renamed to path when complete */
+	int fd;				/* -1 when not packing */
+	long long offset;		/* End of the last file written */
+	vector<packEntry> index;
+	mutex lock;
+};
+/* For reading a sector pack, mapped into memory */
+struct packReader
+{
+	const char *base;
+	size_t size;
+	vector<packEntry> index;
+};
+/* For one sector of a file being compared */
+struct diffSector
+{
+	int secX;
+	int secY;
+	string name;		/* Empty for a sector file on its own */
+	int outFormat;
+	vector<generatedSystem> systems;
+};
+/* For the hex geometry of one kind of SVG map, worked out once */
+struct svgGrid
+{
+	int firstCol;		/* Sector column and row of the top left hex */
+	int firstRow;
+	int cols;
+	int rows;
+	double width;
+	double height;
+	vector<double> x;	/* Centre of each column */
+	vector<double> y[2];	/* Centre of each row, in odd and even columns */
+	string background;	/* Hex outlines and numbers, the same for every sector */
+};
+/* For writing the SVG maps of a region side by side */
+struct svgWork
+{
+	vector<svgGrid> grids;		/* The sector, then subsectors A to P */
+	vector<pair<int, int> > maps;	/* Sector and grid of each map */
+	atomic<int> failed;
+};
+/* For drawing the ASCII subsector maps of a region */
+struct asciiMapWork
+{
+	vector<char> blank;	/* Hex outlines of a subsector, MAP_HEIGHT rows of MAP_WIDTH */
+	int only;		/* Subsector given by -L, or -1 for all of them */
+	atomic<int> failed;
+};
+/* For drawing a heatmap of the region a strip of rows at a time */
+struct heatmapWork
+{
+	int kind;			/* HEAT_DENSITY, HEAT_POPULATION or HEAT_TECH */
+	bool png;			/* Or PPM */
+	int cell;			/* Hexes across and down each pixel */
+	int width;			/* Size of the image in pixels */
+	int height;
+	int stripRows;			/* Pixel rows in each strip */
+	int numStrips;
+	int window;			/* Strips that may be held at once */
+	unsigned char palette[256][3];
+	vector<string> strips;		/* Each strip, ready for the file, until it is written */
+	vector<unsigned long> checks;	/* Adler-32 of the rows of each strip, for PNG */
+	vector<char> ready;
+	int written;			/* Strips written so far */
+	unsigned long adler;		/* Adler-32 of the rows written so far */
+	int fd;
+	string path;
+	bool ok;
+	mutex lock;
+	condition_variable changed;
+};
+/* For the checkpoint of a long region run */
+struct runCheckpoint
+{
+	string path;			/* Empty when not checkpointing */
+	string runKey;			/* Hash of the options the files depend on */
+	set<pair<int, int> > done;	/* Sectors whose files are written */
+	time_t lastWrite;
+	mutex lock;
+};
+/* For a query over the generated worlds */
+struct worldQuery
+{
+	worldFilter is;
+	vector<int> nearJump;		/* Within this many parsecs of ... */
+	vector<worldQuery> near;	/* ... a world matching the inner query */
+};
+/* For scanning the worlds of a region, one column per field */
+struct worldColumns
+{
+	int count;
+	vector<unsigned char> digit[FILTER_DIGITS];	/* UWP digits, belts and gas giants */
+	vector<unsigned char> port;
+	vector<unsigned char> base;
+	vector<unsigned char> zone;
+	vector<unsigned short> codes;			/* Trade classification bits */
+	vector<int> x;					/* Hex position within the region */
+	vector<int> y;
+	const struct archiveIndex *archive;		/* Block statistics, if read from an archive */
+};
+/* For scanning the columns one slice at a time */
+struct queryScan
+{
+	const worldColumns *cols;
+	const worldQuery *query;
+	vector<unsigned long long> *match;
+	vector<vector<unsigned long long> > near;	/* Matches of each inner query */
+	vector<vector<char> > nearHex;			/* Region hexes holding those matches */
+	bool ports[256];				/* Letters the query allows */
+	bool bases[256];
+	bool zones[256];
+};
+/* For reading and writing a columnar region archive */
+struct archiveIndex
+{
+	long long count;		/* Worlds in the archive */
+	int numBlocks;
+	int regionCols;
+	int regionRows;
+	string sectorName;
+	vector<string> dict[2];		/* Trade codes and allegiances, by number */
+	vector<long long> offset[ARC_COLUMNS];	/* Place of each block of each column */
+	vector<int> length[ARC_COLUMNS];
+	vector<int> low[ARC_COLUMNS];		/* Smallest and largest value in each block */
+	vector<int> high[ARC_COLUMNS];
+	ifstream in;
+};
+/* For fetching the worlds a query found in an archive, a block at a time */
+struct archiveRows
+{
+	archiveIndex *arc;
+	int block;			/* Block held in rows, or -1 */
+	vector<generatedSystem> rows;
+};
+/* For generating a world that meets a referee's constraint */
+struct worldConstraint
+{
+	string text;
+	int secX;
+	int secY;
+	int hex;
+	worldFilter is;
+
+	/* Filled in by compileConstraint() */
+	vector<char> classes;		/* Starport classes allowed */
+	vector<double> classOdds;
+	vector<uwpGroup> phys;
+	vector<uwpGroup> soc;
+	vector<int> pick;		/* Starport, physical and social group of each combination */
+	vector<double> cumulative;	/* Running odds of the combinations */
+};
+/* For the rolls of a constrained world */
+struct worldRoll
+{
+	char cla;
+	int siz, atm, hyd, pop, gov, law, tl;
+	char zon;
+	bool nav, sco, mil;
+};
+/* For generating names, trained from a corpus */
+struct nameModel
+{
+	unsigned cumulative[NAME_STATES][NAME_SYMBOLS];	/* Running count of each next symbol */
+	unordered_set<string> corpus;			/* Names learnt from, never given out */
+	unordered_set<string> used;			/* Names already given out in the region */
+};
+
+/* For storing the generation tables, compiled from the ruleset file */
+struct ruleSet
+{
+	char starport[5][11];	/* Starport class by maturity, indexed by 2D-2 */
+	int giants[11];		/* Gas giants present, indexed by 2D-2 */
+	int belts[11];		/* Planetoid belts present, indexed by 2D-2 */
+	int hydAtmDM[16];	/* Hydrographics DM by atmosphere */
+	int scoutDM[26];	/* Scout base DM by starport class */
+	int tlPortDM[26];	/* Tech level DM by starport class */
+	int tlSizDM[11];	/* Tech level DM by size */
+	int tlAtmDM[16];	/* Tech level DM by atmosphere */
+	int tlHydDM[11];	/* Tech level DM by hydrographics */
+	int tlPopDM[11];	/* Tech level DM by population */
+	int tlGovDM[16];	/* Tech level DM by government */
+
+	/* Precomputed DM sums, filled in by compileRuleset() */
+	int tlPhysDM[11][16][11];	/* by size, atmosphere, hydrographics */
+	int tlSocDM[11][16];		/* by population, government */
 };
 
 /** STRUCTURE DECLARATIONS **/
 /* Declare structure for command line options */
-struct optionValues options;
+/* Per thread, so the jobs of a manifest can run side by side */
+thread_local struct optionValues options;
 
 /* Declare structure to store hex numbers and system names for pre-existing names file */
-struct starSystem systemData[MAX_SYS];
+thread_local struct starSystem systemData[MAX_SYS];
 struct starSystem *star_ptr = &systemData[0];
 
 /* Declare structure for storing generated systems */
-struct generatedSystem sys[MAX_SYS];
+thread_local struct generatedSystem sys[MAX_SYS];
 struct generatedSystem *genSys_ptr = &sys[0];
 
+/* Declare structure for the generation tables in use */
+struct ruleSet rules;
+
+/* Declare structures for the systems and sectors of the whole region */
+vector<generatedSystem> regionSys;
+vector<sectorData> regionSectors;
+
+/* Hex grid of the region, holding the regionSys index of each system or -1 */
+vector<int> regionHex;
+
+/* Declare structure for the name generator */
+struct nameModel nameGen;
+
+/* Declare structure for the referee's world constraints */
+vector<worldConstraint> constraints;
+
+/* Declare structure for the galaxy sector cache */
+struct galaxyCache galaxy;
+
+/* Declare structure for the on-disk sector cache */
+struct sectorCache diskCache;
+
+/* Declare structure for the sector pack being written */
+struct sectorPack pack;
+
+/* Declare structure for the checkpoint of a region run */
+struct runCheckpoint checkpoint;
+
+/* Names files read from standard input with -p -, by sector name */
+map<string, string> namesInput;
+
+/* Where progress messages go. Standard error when the sector files
+   go to standard output, so they don't end up in the data */
+thread_local ostream *report = &cout;
+
+/* Digits a world filter can limit, and their largest values */
+const char *filterDigitNames[FILTER_DIGITS] = {"siz", "atm", "hyd", "pop", "gov", "law", "tl", "belts", "giants"};
+const int filterDigitMax[FILTER_DIGITS] = {10, 15, 10, 10, 15, 20, 16, 3, 4};
+
+/* Encoding of each archive column */
+const int archiveEncoding[ARC_COLUMNS] = {ARC_TEXT, 2, 4, 4, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+	ARC_RLE, ARC_RLE, 2, 2};
+
+/* Trade classifications, one per TC_ bit */
+const char *tradeCodeNames[NUM_TRADE_CODES] = {"Hi", "Lo", "Ba", "Ag", "Na", "In", "Ni",
+	"Ri", "Po", "De", "Wa", "As", "Va", "Fl", "Ic"};
+
 /** VARIABLE DECLARATIONS **/
 /* Variables for controlling generation procedure */
-int maturity = 3;	/* Determines how well travelled sector is */
-int density = 50;	/* Stellar density for system presence */
+thread_local int maturity = 3;	/* Determines how well travelled sector is */
+thread_local int density = 50;	/* Stellar density for system presence */
 
 string homePath = getenv("HOME");
 string defaultSectorName = "Unnamed";   /* Name of the sector */
@@ -149,47 +791,393 @@ string defaultOutputPath = homePath + "/";        /* Path of the output file*/
 int defaultOutputFormat = 5;            /* Default output style */
 string defaultAllegience = "Im";        /* Default allegience */
 
-/* To keep count of where you are in the generatedSystems array */
-int sdn = 1;
+/* To keep count of where you are in the generatedSystems array.
+   Per thread, like sys[], so sectors can be generated in the background */
+thread_local int sdn = 1;
 
 /* To count the number of generated systems */
-int secDataLine = 1;
+thread_local int secDataLine = 1;
+
+/* Random number state. Every hex is rolled from a seed of its own, so
+   any hex can be generated without the rest of its sector */
+thread_local unsigned long long rngState;
 
 
 /** FORWARD DECLARATIONS **/
-void getOptions( int argc, char* argv[] );
-int readNamesFile();
-void hexIterate(int fileExists);
-void generateSystem(int x, int y, string ali, string hexName);
-void writeSectorFile(int outFormat);
+bool getOptions( int argc, char* argv[], string &error );
+int readNamesFile(const string &secName);
+void generateSector(int secX, int secY);
+void placeSector(int secX, int secY, sectorData &sec);
+int generateSectorSystems(int secX, int secY, const string &secName, vector<generatedSystem> &systems);
+void loadRuleset();
+void setDefaultRuleset();
+void parseRulesetFile(const string &rulesFile);
+void parseDMList(const string &key, const string &value, int *table, int size, bool byClass);
+void compileRuleset();
+void hexIterate(int fileExists, int secX, int secY);
+bool rollHex(int secX, int secY, int x, int y, const string &hexName, const string &ali);
+bool generateHex(int secX, int secY, int x, int y, const string &hexName, const string &ali, generatedSystem &world);
+void printHex();
+bool parseSectorName(const string &secName, int &secX, int &secY);
+bool parseHexLabel(const string &label, string &secName, int &secX, int &secY, int &hex);
+void generateSystem(int x, int y, string ali, string hexName, const worldConstraint *want);
+void loadConstraints();
+bool parseConstraint(const string &text, worldConstraint &want);
+void clearWorldFilter(worldFilter &is);
+bool parseWorldTerm(const string &term, worldFilter &is);
+void compileConstraint(worldConstraint &want);
+void addOutcome(vector<uwpGroup> &groups, map<long long, int> &index, long long key, int dm, const uwpOutcome &outcome);
+const worldConstraint *findConstraint(int secX, int secY, int hex);
+void rollConstrainedWorld(const worldConstraint &want, worldRoll &roll);
+int techLevelRolls(const worldConstraint &want, char cla, int dm, bool ok[6]);
+double baseRolls(const worldConstraint &want, char cla, int atm, int hyd, int pop, int gov, double odds[8]);
+double zoneRolls(const worldConstraint &want, char cla, double odds[3]);
+bool allows(const string &letters, char c);
+bool writeSectorFile(int outFormat, const sectorData &sec);
+const char *formatVersion(int outFormat);
+void writeSystemLine(ostream &out, int outFormat, const generatedSystem &s);
+void formatSectorFile(int outFormat, const sectorData &sec, const generatedSystem *systems, vector<string> &chunks);
+void formatSectorChunk(int chunk, void *arg);
+void queueSectorFile(writeQueue &queue, int outFormat, const sectorData &sec, const string &cacheKey);
+void sectorWriter(writeQueue *queue, jobSettings settings);
+bool writeChunks(const string &path, const vector<string> &chunks);
+bool writeChunksTo(int fd, const string &path, const vector<string> &chunks);
+void readNamesInput();
+bool writeOutputFile(const string &path, const vector<string> &chunks);
+bool writeCompressedChunks(const string &path, const vector<string> &chunks);
+bool readSectorFile(const string &path, int &outFormat, vector<generatedSystem> &systems);
+void parseSectorText(const string &text, int &outFormat, vector<generatedSystem> &systems);
+bool gunzipBytes(const char *bytes, size_t length, string &out);
+bool parseSystemLine(const string &line, int outFormat, generatedSystem &s);
+void buildRegionHex();
+void buildJumpGraphTile(int tile, void *arg);
+void buildJumpGraph(jumpGraph &graph, int jump);
+void jumpOffsets(int jump, vector<int> dx[2], vector<int> dy[2], vector<int> dist[2]);
+void generateAllegiances();
+int polityLabel(int capital, int polity);
+void growPolityTile(int tile, void *arg);
+void evolveRegion();
+void evolveSlice(int slice, void *arg);
+bool evolveChance(double perDecade, int years);
+void planRoutes();
+void initRouteSearch(routeSearch &search, int jump);
+int findRoute(routeSearch &search, int start, int goal, vector<int> &path);
+long long routeHeuristic(const routeSearch &search, int from, int goal);
+int findSystem(const string &hex);
+string systemLabel(int i);
+void generateTrade();
+void generateTradeTile(int tile, void *arg);
+bool tradeRouteOrder(const tradeRoute &a, const tradeRoute &b);
+void writeTradeFile(const vector<tradeRoute> &routes, const vector<double> &volume);
+string regionFilePath(const string &ext);
+void generateXboatRoutes();
+void collectXboatEdges(int tile, void *arg);
+void findCheapestXboatEdges(int slice, void *arg);
+int findNetwork(vector<int> &parent, int i);
+bool xboatRouteOrder(const tradeRoute &a, const tradeRoute &b);
+void writeXboatFile(const vector<tradeRoute> &routes);
+void runQuery();
+bool parseQuery(const string &text, worldQuery &query);
+void buildWorldColumns(worldColumns &cols);
+void buildWorldColumnsTile(int tile, void *arg);
+void scanQuery(const worldColumns &cols, const worldQuery &query, vector<unsigned long long> &match);
+void scanQueryTile(int slice, void *arg);
+void scanRange(const unsigned char *col, int count, int low, int high, unsigned long long *match, int firstWord, int lastWord);
+void scanLetters(const unsigned char *col, int count, const bool allowed[256], unsigned long long *match, int firstWord, int lastWord);
+void scanCodes(const unsigned short *col, int count, int need, int ban, unsigned long long *match, int firstWord, int lastWord);
+void scanNear(const worldColumns &cols, int jump, const vector<char> &nearHex, unsigned long long *match, int firstWord, int lastWord);
+void writeQueryFile(const vector<unsigned long long> &match, const generatedSystem &(*fetch)(int i, void *arg), void *arg);
+const generatedSystem &regionRow(int i, void *arg);
+void writeArchive();
+bool openArchive(const string &path, archiveIndex &arc);
+void readArchiveColumn(archiveIndex &arc, int col, int block, vector<int> &values, vector<string> *names);
+void readArchiveRows(archiveIndex &arc, int block, vector<generatedSystem> &rows);
+void scanArchive();
+void markArchiveBlocks(const archiveIndex &arc, const worldQuery &query, bool placed, vector<vector<char> > &blocks);
+bool archiveBlockMatches(const archiveIndex &arc, const worldFilter &is, int block);
+const generatedSystem &archiveRow(int i, void *arg);
+string readArchiveBytes(archiveIndex &arc, long long offset, long long length);
+void putArchiveInt(string &bytes, long long value, int size);
+long long getArchiveInt(const char *&p, int size);
+void loadNameModel(const string &corpusFile);
+string generateName(int maxLength, unordered_set<string> &used);
+int nameWidth(int outFormat);
+void nameUnnamedSystems();
+void runGalaxy();
+void startGalaxyCache(size_t budget);
+void stopGalaxyCache();
+shared_ptr<const galaxySector> getGalaxySector(int secX, int secY);
+void prefetchGalaxySectors(int secX, int secY);
+void galaxyPrefetchWorker(jobSettings settings);
+shared_ptr<const galaxySector> buildGalaxySector(int secX, int secY);
+void insertGalaxySector(long long key, shared_ptr<const galaxySector> sector);
+long long galaxyKey(int secX, int secY);
+int tradeMask(const string &codes);
+int tradeBits(int siz, int atm, int hyd, int pop, int gov, int law);
+char baseCode(bool nav, bool sco, bool mil, bool dep, bool way);
+int hexDistance(int x1, int y1, int x2, int y2);
+void parallelFor(int numItems, void (*work)(int item, void *arg), void *arg);
+void parallelWorker(atomic<int> *next, int numItems, void (*work)(int item, void *arg), void *arg);
+void parallelThread(jobSettings settings, atomic<int> *next, int numItems, void (*work)(int item, void *arg), void *arg);
+void saveJobSettings(jobSettings &settings);
+void loadJobSettings(const jobSettings &settings);
+int runManifest(const string &manifestFile);
+void manifestWorker(jobBatch *batch, int self);
+bool runJob(const string &line, string &result);
+bool splitCommandLine(const string &line, vector<string> &args);
+string sectorCacheKey(const sectorData &sec);
+string sectorCachePath(const string &key);
+bool fetchCachedSector(const string &key, const string &outPath);
+void storeCachedSector(const string &key, const string &outPath);
+void trimSectorCache();
+void startPack();
+bool packSectorFile(int secX, int secY, const string &path, const vector<string> &chunks);
+bool finishPack();
+bool gzipChunks(const vector<string> &chunks, string &out);
+bool openPack(const string &path, packReader &reader);
+bool readPackIndex(packReader &reader);
+void unpackSectors();
+void updateSectors();
+bool updateSector(int secX, int secY);
+void namedHexes(map<int, starSystem> &named);
+void watchNamesFiles();
+int runDiff();
+bool readDiffInput(const string &path, vector<diffSector> &sectors, bool &packed);
+void diffSectors(const diffSector *a, const diffSector *b, int counts[3]);
+string diffFields(const generatedSystem &a, int aFormat, const generatedSystem &b, int bFormat);
+void writeSvgMaps();
+void buildSvgGrid(svgGrid &grid, int firstCol, int firstRow, int cols, int rows);
+void writeSvgMap(int item, void *arg);
+void drawSvgWorld(string &svg, const svgGrid &grid, const generatedSystem &s, bool uwp);
+void svgPrintf(string &svg, const char *format, ...);
+string xmlText(const string &text);
+string sectorFilePath(const sectorData &sec, const string &ext);
+void writeAsciiMaps();
+void writeAsciiMap(int item, void *arg);
+void drawAsciiWorld(char *grid, const generatedSystem &s);
+void putMapText(char *grid, int x, int y, const string &text);
+void writeHeatmaps();
+bool writeHeatmap(int kind);
+void drawHeatmapStrip(int strip, void *arg);
+void writeHeatmapStrips(heatmapWork &work);
+int heatmapValue(int kind, int px, int py, int cell);
+void appendPngChunk(string &out, const char *type, const string &data);
+void putPngInt(string &out, unsigned long value);
+void startCheckpoint();
+string runKey();
+bool sectorDone(int secX, int secY);
+void markSectorDone(int secX, int secY);
+bool writeCheckpoint();
+void finishCheckpoint();
+bool copyFile(const string &from, const string &to);
+unsigned long long hashText(unsigned long long h, const string &text);
 char hexChar(int i);
+int hexValue(char c);
+void seedHex(int secX, int secY, int hex, int stream);
+unsigned long long mixBits(unsigned long long z);
+unsigned long long nextRandom();
 int diceRoll(int nsides);
 int nDiceRoll(int ndice, int nsides);
+double twoDiceOver(int n);
+int sampleIndex(const vector<double> &cumulative);
 
 /** MAIN PROGRAM **/
 int
 main( int argc, char* argv[] )
 {
-	srand((unsigned)time(NULL));
+	string error;
+	if (!getOptions( argc, argv, error )){
+		cerr << error << "\n";
+		exit(1);
+	}
 
-	getOptions( argc, argv );
+	loadRuleset();
 
-	int fileExists = readNamesFile();
+	diskCache.dir = options.cacheDir;
+	diskCache.budget = (long long)options.cacheDirMB << 20;
+	diskCache.hits = 0;
+	diskCache.stored = 0;
 
-	if (fileExists == 0){
-        hexIterate(fileExists);
-	}else{
-        hexIterate(fileExists);
+	/* A manifest is a batch of jobs, each with a command line of its own */
+	if (!options.manifestPath.empty())
+		return runManifest(options.manifestPath);
+
+	if (!options.constraints.empty())
+		loadConstraints();
+
+	if (!options.nameCorpusPath.empty())
+		loadNameModel(options.nameCorpusPath);
+
+	/* Names files piped in are read all at once, before anything else */
+	if (options.namesFilePath == "-"){
+		if (options.galaxy){
+			cerr << "The galaxy reads its requests from standard input, the names can't come from there too\n";
+			exit(1);
+		}
+		readNamesInput();
+	}
+
+	/* A single hex is rolled on its own, without the sector around it */
+	if (!options.hex.empty()){
+		printHex();
+		return 0;
+	}
+
+	/* Two runs are compared instead of generating anything */
+	if (!options.diffOld.empty())
+		return runDiff();
+
+	/* A pack is read instead of generating anything */
+	if (!options.unpackPath.empty()){
+		unpackSectors();
+		return 0;
+	}
+
+	/* An archive is scanned instead of generating anything */
+	if (!options.scanPath.empty()){
+		scanArchive();
+		return 0;
+	}
+
+	/* The galaxy has no edge, sectors are generated as they are asked for */
+	if (options.galaxy){
+		runGalaxy();
+		return 0;
+	}
+
+	/* Before the seed is printed, as a resumed run takes the seed of the checkpoint */
+	startCheckpoint();
+
+	pack.fd = -1;
+	if (options.pack)
+		startPack();
+
+	*report << "Seed: " << options.seed << "\n";
+
+	/* Written sector files are patched where their names changed */
+	if (options.update){
+		updateSectors();
+		if (options.watch)
+			watchNamesFiles();
+		return 0;
+	}
+
+	/* Unless a later pass changes the systems, each sector is handed to
+	   the writer thread as soon as it is generated, so writing one
+	   sector overlaps generating the next */
+	bool pipelined = (options.nameCorpusPath.empty() && options.polities < 0 && options.years == 0);
+	writeQueue queue;
+	thread writer;
+
+	if (pipelined){
+		queue.done = false;
+		jobSettings settings;
+		saveJobSettings(settings);
+		writer = thread(sectorWriter, &queue, settings);
+	}
+
+	/* When nothing after generation needs the systems, a sector whose
+	   file is already written need not be generated at all, and a
+	   sector file made by an earlier run with the same inputs is
+	   copied instead of generated */
+	bool standalone = (pipelined && options.route.empty() && options.tradeJump == 0 &&
+		!options.xboat && options.query.empty() && !options.archive && options.svg.empty() && options.heatmap.empty() && !options.asciiMap);
+	bool cached = (standalone && !diskCache.dir.empty() && options.outputPath != "-" && !options.pack);
+
+	/* Generate each sector of the region, a single sector by default */
+	for (int secY = 0; secY < options.regionRows; secY++)
+	{
+		for (int secX = 0; secX < options.regionCols; secX++)
+		{
+			string key;
+			bool done = sectorDone(secX, secY);
+
+			if (done && standalone)
+				continue;
+
+			if (cached && !done){
+				sectorData sec;
+				placeSector(secX, secY, sec);
+				key = sectorCacheKey(sec);
+				if (fetchCachedSector(key, sec.outputPath)){
+					markSectorDone(secX, secY);
+					continue;
+				}
+			}
+
+			generateSector(secX, secY);
+			if (pipelined && !done)
+				queueSectorFile(queue, options.outputFormat, regionSectors.back(), key);
+		}
+	}
+
+	if (pipelined){
+		lock_guard<mutex> hold(queue.lock);
+		queue.done = true;
+		queue.changed.notify_all();
 	}
 
-	writeSectorFile(options.outputFormat);
+	if (!options.nameCorpusPath.empty())
+		nameUnnamedSystems();
+
+	if (options.polities >= 0)
+		generateAllegiances();
+
+	if (options.years > 0)
+		evolveRegion();
+
+	if (!options.route.empty())
+		planRoutes();
+
+	if (options.tradeJump > 0)
+		generateTrade();
+
+	if (options.xboat)
+		generateXboatRoutes();
+
+	if (!options.query.empty())
+		runQuery();
+
+	if (options.archive)
+		writeArchive();
+
+	if (!options.svg.empty())
+		writeSvgMaps();
+
+	if (options.asciiMap)
+		writeAsciiMaps();
+
+	if (!options.heatmap.empty())
+		writeHeatmaps();
+
+	if (pipelined)
+		writer.join();
+	else
+		for (size_t i = 0; i < regionSectors.size(); i++)
+		{
+			const sectorData &sec = regionSectors[i];
+			if (!sectorDone(sec.secX, sec.secY) && writeSectorFile(options.outputFormat, sec))
+				markSectorDone(sec.secX, sec.secY);
+		}
+
+	finishCheckpoint();
+
+	if (options.pack && !finishPack())
+		return 1;
+
+	if (cached)
+		trimSectorCache();
 
 	return 0;
 }
 
 /* GETS THE COMMAND LINE ARGUMENTS */
-void
-getOptions( int argc, char* argv[] )
+/*
+	Returns false with the reason in error if an option has a value it
+	can't take, so a manifest job can fail on its own.
+*/
+bool
+getOptions( int argc, char* argv[], string &error )
 {
 
 	/* 1. CREATE AN OBJECT */
@@ -204,15 +1192,51 @@ getOptions( int argc, char* argv[] )
 	opt->addUsage( "" );
 	opt->addUsage( "Usage: " );
 	opt->addUsage( "" );
+	opt->addUsage( "     diff OLD NEW    Compare two sector files or packs, any format, world by world " );
 	opt->addUsage( " -h  --help          Print usage " );
 	opt->addUsage( " -L  --subsecLet     Letter of Subsector (A-P) to generate, if omitted will generate entire sector " );
 	opt->addUsage( " -d  --density       %|zero|rift|sparse|scattered|dense " );
 	opt->addUsage( " -m  --maturity      Tech level, backwater|frontier|mature|cluster " );
 	opt->addUsage( " -a  --ac            Two-letter system alignment code " );
 	opt->addUsage( " -s  --secName       Name of sector. For default output file name and sectorName_names.txt file" );
-	opt->addUsage( " -p  --path          Path to sectorName_names.txt file " );
+	opt->addUsage( " -p  --path          Path to sectorName_names.txt file, - to read them from standard input " );
 	opt->addUsage( " -o  --outFormat     1|2|3|4|5|6 : v1.0, v2.0, v2.1 v2.1b, v2.2, v2.5 " );
-	opt->addUsage( " -u  --outPath       Path and name of output file " );
+	opt->addUsage( " -u  --outPath       Path and name of output file, or output directory for a region, - for standard output " );
+	opt->addUsage( " -r  --rules         Path to ruleset file of generation tables and DMs " );
+	opt->addUsage( " -R  --region        COLSxROWS block of sectors to generate, named sectorName_x_y " );
+	opt->addUsage( " -P  --polities      Grow this many random polities, plus any capitals in the names file " );
+	opt->addUsage( " -j  --threads       Number of worker threads, defaults to the number of cores " );
+	opt->addUsage( " -t  --route         \"XXYY XXYY ...\" hexes to plan a route through, as sectorName/XXYY in a region " );
+	opt->addUsage( " -J  --jump          Jump rating for --route, 1-6, default 2 " );
+	opt->addUsage( " -T  --trade         Jump range of trade, 1-6, writes main and major trade routes " );
+	opt->addUsage( "     --xboat         Write X-boat routes linking A/B starports and high population systems " );
+	opt->addUsage( " -n  --nameCorpus    File of names to learn from, to name systems not in the names file " );
+	opt->addUsage( " -S  --seed          Random seed, the same seed and options give the same sector " );
+	opt->addUsage( " -x  --hex           Print only the system at [sectorName/]XXYY " );
+	opt->addUsage( " -C  --constrain     \"[sectorName/]XXYY:port=A,tl=C-,Hi,In;...\" worlds the referee needs " );
+	opt->addUsage( " -Q  --query         \"Ri,base=ABDN,jump2(port=A)\" writes the matching worlds " );
+	opt->addUsage( "     --archive       Also write the region as a columnar archive, sectorName.gsa " );
+	opt->addUsage( "     --scan          Archive to answer --query from, instead of generating " );
+	opt->addUsage( "     --compress      Write sector files gzipped, as .sec.gz " );
+	opt->addUsage( "     --galaxy        Read \"x y [XXYY]\" lines and print sector x,y of an endless galaxy " );
+	opt->addUsage( "     --cacheMB       Memory for galaxy sectors kept in the cache, default 64 " );
+	opt->addUsage( "     --manifest      File of jobs, one command line per line, run side by side on --threads " );
+	opt->addUsage( "     --cacheDir      Directory of sector files kept from earlier runs, to copy instead of generating " );
+	opt->addUsage( "     --cacheDirMB    Size the cache directory is trimmed back to, default 1024 " );
+	opt->addUsage( "     --checkpoint    Seconds between checkpoints of a region run, sectorName.ckpt, default 60 " );
+	opt->addUsage( "     --resume        Carry on from the checkpoint of an interrupted region run, with its seed " );
+	opt->addUsage( "     --pack          Write the sector files into one pack, sectorName.gsp, indexed by sector " );
+	opt->addUsage( "     --unpack        Pack to list, or to take --entry from " );
+	opt->addUsage( "     --entry         x,y or name of the sector to write from --unpack, all for every sector into --outPath " );
+	opt->addUsage( "     --update        Bring written sector files up to date with their names files, rolling only changed hexes " );
+	opt->addUsage( "     --watch         Update, then update again whenever a names file is saved " );
+	opt->addUsage( "     --years         Run the region forward this many years before writing it " );
+	opt->addUsage( "     --yearStep      Years in each step of --years, default 10 " );
+	opt->addUsage( "     --map           Also draw ASCII maps of the 16 subsectors, or the -L one, into sectorName.map " );
+	opt->addUsage( "     --heatmap       density,population,tl : Also draw heatmaps of the region, sectorName_density.png ... " );
+	opt->addUsage( "     --heatmapCell   Hexes across and down each pixel of a heatmap, default 1 " );
+	opt->addUsage( "     --ppm           Write heatmaps as PPM instead of PNG " );
+	opt->addUsage( "     --svg           sector|subsector|all : Also draw SVG maps, sectorName.svg and sectorName_A.svg to _P.svg " );
 	opt->addUsage( "" );
 
 	/* 4. SET THE OPTION STRINGS/CHARACTERS */
@@ -225,15 +1249,59 @@ getOptions( int argc, char* argv[] )
 	opt->setCommandOption( "path", 'p');
 	opt->setCommandOption( "outFormat", 'o');
 	opt->setCommandOption( "outPath", 'u');
+	opt->setCommandOption( "rules", 'r');
+	opt->setCommandOption( "region", 'R');
+	opt->setCommandOption( "polities", 'P');
+	opt->setCommandOption( "threads", 'j');
+	opt->setCommandOption( "route", 't');
+	opt->setCommandOption( "jump", 'J');
+	opt->setCommandOption( "trade", 'T');
+	opt->setCommandFlag( "xboat" );
+	opt->setCommandOption( "nameCorpus", 'n');
+	opt->setCommandOption( "seed", 'S');
+	opt->setCommandOption( "hex", 'x');
+	opt->setCommandOption( "constrain", 'C');
+	opt->setCommandOption( "query", 'Q');
+	opt->setCommandFlag( "archive" );
+	opt->setCommandOption( "scan" );
+	opt->setCommandFlag( "compress" );
+	opt->setCommandFlag( "galaxy" );
+	opt->setCommandOption( "cacheMB" );
+	opt->setCommandOption( "manifest" );
+	opt->setCommandOption( "cacheDir" );
+	opt->setCommandOption( "cacheDirMB" );
+	opt->setCommandOption( "checkpoint" );
+	opt->setCommandFlag( "resume" );
+	opt->setCommandFlag( "pack" );
+	opt->setCommandOption( "unpack" );
+	opt->setCommandOption( "entry" );
+	opt->setCommandFlag( "update" );
+	opt->setCommandFlag( "watch" );
+	opt->setCommandOption( "svg" );
+	opt->setCommandOption( "heatmap" );
+	opt->setCommandOption( "heatmapCell" );
+	opt->setCommandFlag( "ppm" );
+	opt->setCommandFlag( "map" );
+	opt->setCommandOption( "years" );
+	opt->setCommandOption( "yearStep" );
 
 	/* 5. PROCESS THE COMMANDLINE AND RESOURCE FILE */
 	/* go through the command line and get the options  */
+	/* "gensec4 diff OLD NEW" compares two runs instead of generating,
+	   the options after it read as any others */
+	if( argc >= 4 && strcmp(argv[1], "diff") == 0 ){
+		options.diffOld = argv[2];
+		options.diffNew = argv[3];
+		argc -= 3;
+		argv += 3;
+	}
+
 	opt->processCommandArgs( argc, argv );
 
-	if( ! opt->hasOptions()) { /* print usage if no options */
+	if( ! opt->hasOptions() && options.diffOld.empty() ) { /* print usage if no options */
 		opt->printUsage();
 		delete opt;
-		return;
+		return true;
 	}
 
 	/* 6. GET THE VALUES */
@@ -275,18 +1343,184 @@ getOptions( int argc, char* argv[] )
 	    options.outputFormat = defaultOutputFormat;
 	}
 
-    if( opt->getValue( 'u' ) != NULL  || opt->getValue( "outPath" ) != NULL  ){
+	options.regionCols = options.regionRows = 1;
+	if( opt->getValue( 'R' ) != NULL  || opt->getValue( "region" ) != NULL  ){
+		char sep;
+		istringstream region(opt->getValue( 'R'));
+		if (!(region >> options.regionCols >> sep >> options.regionRows) || sep != 'x' ||
+		    options.regionCols < 1 || options.regionRows < 1){
+			options.regionCols = options.regionRows = 1;
+		}
+	}
+
+	if( opt->getValue( 'P' ) != NULL  || opt->getValue( "polities" ) != NULL  ){
+		options.polities = limit(atoi(opt->getValue( 'P')), 0, MAX_POLITIES);
+	}else{
+		options.polities = -1;
+	}
+
+	options.threads = thread::hardware_concurrency();
+	if( opt->getValue( 'j' ) != NULL  || opt->getValue( "threads" ) != NULL  )
+		options.threads = atoi(opt->getValue( 'j'));
+	if (options.threads < 1)
+		options.threads = 1;
+
+	if( opt->getValue( 't' ) != NULL  || opt->getValue( "route" ) != NULL  )
+		options.route = opt->getValue( 't');
+
+	if( opt->getValue( 'J' ) != NULL  || opt->getValue( "jump" ) != NULL  ){
+		options.jump = limit(atoi(opt->getValue( 'J')), 1, 6);
+	}else{
+		options.jump = 2;
+	}
+
+	if( opt->getValue( 'T' ) != NULL  || opt->getValue( "trade" ) != NULL  ){
+		options.tradeJump = limit(atoi(opt->getValue( 'T')), 1, 6);
+	}else{
+		options.tradeJump = 0;
+	}
+
+	options.xboat = opt->getFlag( "xboat" );
+
+	if( opt->getValue( 'n' ) != NULL  || opt->getValue( "nameCorpus" ) != NULL  )
+		options.nameCorpusPath = opt->getValue( 'n');
+
+	options.seedGiven = ( opt->getValue( 'S' ) != NULL  || opt->getValue( "seed" ) != NULL  );
+	if( options.seedGiven ){
+		options.seed = strtoull(opt->getValue( 'S'), NULL, 10);
+	}else{
+		options.seed = (unsigned long long)time(NULL);
+	}
+
+	if( opt->getValue( 'x' ) != NULL  || opt->getValue( "hex" ) != NULL  )
+		options.hex = opt->getValue( 'x');
+
+	if( opt->getValue( 'C' ) != NULL  || opt->getValue( "constrain" ) != NULL  )
+		options.constraints = opt->getValue( 'C');
+
+	if( opt->getValue( 'Q' ) != NULL  || opt->getValue( "query" ) != NULL  )
+		options.query = opt->getValue( 'Q');
+
+	options.archive = opt->getFlag( "archive" );
+
+	if( opt->getValue( "scan" ) != NULL  )
+		options.scanPath = opt->getValue( "scan" );
+
+	if( opt->getValue( "manifest" ) != NULL  )
+		options.manifestPath = opt->getValue( "manifest" );
+
+	if( opt->getValue( "cacheDir" ) != NULL  )
+		options.cacheDir = opt->getValue( "cacheDir" );
+
+	options.cacheDirMB = 1024;
+	if( opt->getValue( "cacheDirMB" ) != NULL  )
+		options.cacheDirMB = atoi(opt->getValue( "cacheDirMB" ));
+	if (options.cacheDirMB < 1)
+		options.cacheDirMB = 1;
+
+	options.checkpointSeconds = 60;
+	options.checkpointGiven = ( opt->getValue( "checkpoint" ) != NULL  );
+	if( options.checkpointGiven )
+		options.checkpointSeconds = max(0, atoi(opt->getValue( "checkpoint" )));
+
+	options.resume = opt->getFlag( "resume" );
+
+	options.pack = opt->getFlag( "pack" );
+
+	if( opt->getValue( "unpack" ) != NULL  )
+		options.unpackPath = opt->getValue( "unpack" );
+
+	if( opt->getValue( "entry" ) != NULL  )
+		options.entry = opt->getValue( "entry" );
+
+	options.watch = opt->getFlag( "watch" );
+	options.update = ( opt->getFlag( "update" ) || options.watch );
+
+	if( opt->getValue( "svg" ) != NULL  ){
+		options.svg = opt->getValue( "svg" );
+		if (options.svg != "sector" && options.svg != "subsector" && options.svg != "all"){
+			error = "--svg takes sector, subsector or all";
+			delete opt;
+			return false;
+		}
+	}
+
+	if( opt->getValue( "heatmap" ) != NULL  ){
+		options.heatmap = opt->getValue( "heatmap" );
+		string kind;
+		istringstream kinds(options.heatmap);
+		while (getline (kinds, kind, ','))
+		{
+			if (kind != "density" && kind != "population" && kind != "tl"){
+				error = "--heatmap takes density, population or tl, or a list of them";
+				delete opt;
+				return false;
+			}
+		}
+	}
+
+	options.heatmapCell = 1;
+	if( opt->getValue( "heatmapCell" ) != NULL  )
+		options.heatmapCell = max(1, atoi(opt->getValue( "heatmapCell" )));
+
+	options.ppm = opt->getFlag( "ppm" );
+
+	options.asciiMap = opt->getFlag( "map" );
+
+	options.years = 0;
+	if( opt->getValue( "years" ) != NULL  )
+		options.years = max(0, atoi(opt->getValue( "years" )));
+
+	options.yearStep = 10;
+	if( opt->getValue( "yearStep" ) != NULL  )
+		options.yearStep = max(1, atoi(opt->getValue( "yearStep" )));
+
+	options.compress = opt->getFlag( "compress" );
+
+	options.galaxy = opt->getFlag( "galaxy" );
+
+	options.cacheMB = 64;
+	if( opt->getValue( "cacheMB" ) != NULL  )
+		options.cacheMB = atoi(opt->getValue( "cacheMB" ));
+	if (options.cacheMB < 1)
+		options.cacheMB = 1;
+
+    if (options.regionCols > 1 || options.regionRows > 1){
+        /* Each sector of a region gets its own file in the output directory */
+        if( opt->getValue( 'u' ) != NULL  || opt->getValue( "outPath" ) != NULL  ){
+            options.outputPath = opt->getValue( 'u');
+            if (options.outputPath != "-" && options.outputPath[options.outputPath.size() - 1] != '/')
+                options.outputPath += "/";
+        }else{
+            options.outputPath = defaultOutputPath;
+        }
+    }else if( opt->getValue( 'u' ) != NULL  || opt->getValue( "outPath" ) != NULL  ){
         options.outputPath = opt->getValue( 'u');
-    }else{
+    }else if (!options.scanPath.empty()){
+        /* Query results go next to the archive */
+        options.outputPath = options.scanPath;
+    }else if (!options.unpackPath.empty() || !options.diffOld.empty()){
+        /* An entry taken from a pack, or the differences, go to standard output */
+        options.outputPath = "-";
+    }else if (!options.hex.empty()){
+        /* A single hex is printed on standard output, no file is written */
+    }else if (!options.galaxy && options.manifestPath.empty()){
         if (options.outputFormat < 7){
             options.outputPath = defaultOutputPath + options.sectorName + ".sec";
-            cout << "outputPath: " << options.outputPath << "\n";
+            *report << "outputPath: " << options.outputPath << "\n";
         }else{
             options.outputPath = defaultOutputPath + options.sectorName + ".xml";
-            cout << "outputPath: " << options.outputPath << "\n";
+            *report << "outputPath: " << options.outputPath << "\n";
         }
     }
 
+	/* The sector files go to standard output, so everything else goes to standard error */
+	if (options.outputPath == "-")
+		report = &cerr;
+
+	if( opt->getValue( 'r' ) != NULL  || opt->getValue( "rules" ) != NULL  )
+		options.rulesFilePath = opt->getValue( 'r');
+
 	/* Set Density */
 	if (options.density.compare("dense") == 0){
 		density = 66;
@@ -321,453 +1555,6183 @@ getOptions( int argc, char* argv[] )
 	/* 8. DONE */
 	delete opt;
 
+	return true;
 }
 
 /* READ THE NAMES/HEXES FOR PREDEFINED SYSTEMS, IF ANY */
 int
-readNamesFile()
+readNamesFile(const string &secName)
 {
 	string line;
 	stringstream fileName;
 
-	fileName << options.namesFilePath << options.sectorName << "_names.txt";
+	/* Clear anything left over from the previous sector */
+	for (int i = 0; i < MAX_SYS && systemData[i].starHex != 0; i++)
+		systemData[i] = starSystem();
+
+	fileName << options.namesFilePath << secName << "_names.txt";
 	//cout << fileName.str().c_str() << "\n";
 
 	ifstream inputFile;
-	inputFile.open(fileName.str().c_str());
+	istringstream piped;
+	istream *in = &inputFile;
 
-	if (!inputFile){
+	/* Names from standard input were read before generating anything */
+	if (options.namesFilePath == "-"){
+		map<string, string>::const_iterator found = namesInput.find(secName);
+		if (found == namesInput.end())
+			return(0);
+		piped.str(found->second);
+		in = &piped;
+	}else{
+		inputFile.open(fileName.str().c_str());
+	}
+
+	if (!*in){
 		return(0);
 	}
 
-	if (inputFile.is_open())
-	{
-		int count = 0;
+	int count = 0;
 
-		/* Read in the sectorname_names.txt file and populate the starSystem structure */
-		while (getline (inputFile, line))
-		{
-			istringstream system(line);
-			system >> systemData[count].starName >> systemData[count].starHex;
+	/* Read in the sectorname_names.txt file and populate the starSystem structure */
+	/* An optional third column gives the allegiance of the system */
+	while (getline (*in, line) && count < MAX_SYS)
+	{
+		istringstream system(line);
+		system >> systemData[count].starName >> systemData[count].starHex >> systemData[count].allegiance;
 
-			/* Take the full hex number and break it into separate X and Y values*/
-			systemData[count].xHex = systemData[count].starHex / 100;
-			systemData[count].yHex = systemData[count].starHex % 100;
-			count = count + 1;
-		}
-		inputFile.close();
-		return(1);
+		/* Take the full hex number and break it into separate X and Y values*/
+		systemData[count].xHex = systemData[count].starHex / 100;
+		systemData[count].yHex = systemData[count].starHex % 100;
+		count = count + 1;
 	}
 	return(1);
 }
 
-/* WALK THROUGH THE HEXES AND RANDOMLY CALL SYSTEM GENERATION */
+/* READ THE NAMES FILES PIPED IN ON STANDARD INPUT */
+/*
+	Standard input is read in large blocks straight from the descriptor.
+	For a region, "#Sector: sectorName_x_y" starts the names of each
+	sector; names before any such line belong to sectorName itself, so
+	a single sector's names file can be piped in as it is.
+*/
 void
-hexIterate(int fileExists)
+readNamesInput()
 {
-	int x, y;
-	int x_start = 1, x_end = 32;
-	int y_start = 1, y_end = 40;
+	string text;
+	vector<char> buffer(1 << 20);
+	ssize_t got;
 
-	string hexName = "Unnamed";
+	while ((got = read(STDIN_FILENO, buffer.data(), buffer.size())) != 0)
+	{
+		if (got < 0){
+			if (errno == EINTR)
+				continue;
+			cerr << "Unable to read standard input: " << strerror(errno) << "\n";
+			exit(1);
+		}
+		text.append(buffer.data(), got);
+	}
 
-	int lineNum = 0; /* Keep track of the line in the sectornames_names.txt file that we are on */
+	string secName = options.sectorName;
+	size_t start = 0;
 
-	/* Count through each hex and randomly (or not) generate a system */
-	for (x = x_start; x <= x_end; x++)
+	while (start < text.size())
+	{
+		size_t end = text.find('\n', start);
+		if (end == string::npos)
+			end = text.size();
+
+		if (text.compare(start, 9, "#Sector: ") == 0){
+			secName = text.substr(start + 9, end - start - 9);
+			secName.erase(secName.find_last_not_of(" \t\r") + 1);
+			namesInput[secName];
+		}else{
+			namesInput[secName].append(text, start, end + 1 - start);
+		}
+		start = end + 1;
+	}
+}
+
+/* LOAD THE GENERATION TABLES */
+void
+loadRuleset()
+{
+	/* The built-in tables are the published ones; a ruleset file only
+	   needs to list the tables it changes. */
+	setDefaultRuleset();
+
+	if (!options.rulesFilePath.empty())
+		parseRulesetFile(options.rulesFilePath);
+
+	compileRuleset();
+}
+
+/* SET THE BUILT-IN GENERATION TABLES */
+void
+setDefaultRuleset()
+{
+	static int giants[] = {1, 1, 2, 2, 3, 3, 4, 4, 4, 5, 5};
+	static int belts[] = {1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2};
+	int i;
+
+	memset(&rules, 0, sizeof(rules));
+
+	memcpy(rules.starport[0], "AAABBCCDEEE", 11); /* Default is mature */
+	memcpy(rules.starport[1], "AABBCCCDEEX", 11); /* backwater */
+	memcpy(rules.starport[2], "AAABBCCDEEX", 11); /* frontier (standard) */
+	memcpy(rules.starport[3], "AAABBCCDEEE", 11); /* mature */
+	memcpy(rules.starport[4], "AAAABBCCDEX", 11); /* cluster */
+
+	memcpy(rules.giants, giants, sizeof(giants));
+	memcpy(rules.belts, belts, sizeof(belts));
+
+	rules.hydAtmDM[0] = rules.hydAtmDM[1] = -4;
+	for (i = 10; i < 16; i++)
+		rules.hydAtmDM[i] = -4;
+
+	rules.scoutDM['A' - 'A'] = -3;
+	rules.scoutDM['B' - 'A'] = -2;
+	rules.scoutDM['C' - 'A'] = -1;
+
+	rules.tlPortDM['A' - 'A'] = 6;
+	rules.tlPortDM['B' - 'A'] = 4;
+	rules.tlPortDM['C' - 'A'] = 2;
+	rules.tlPortDM['X' - 'A'] = -4;
+
+	rules.tlSizDM[0] = rules.tlSizDM[1] = 2;
+	rules.tlSizDM[2] = rules.tlSizDM[3] = rules.tlSizDM[4] = 1;
+
+	for (i = 0; i < 4; i++)
+		rules.tlAtmDM[i] = 1;
+	for (i = 10; i < 15; i++)
+		rules.tlAtmDM[i] = 1;
+
+	rules.tlHydDM[8] = 1;
+	rules.tlHydDM[9] = 2;
+
+	for (i = 1; i < 6; i++)
+		rules.tlPopDM[i] = 1;
+	rules.tlPopDM[9] = 2;
+	rules.tlPopDM[10] = 4;
+
+	rules.tlGovDM[0] = rules.tlGovDM[5] = 1;
+	rules.tlGovDM[13] = -2;
+}
+
+/* READ A RULESET FILE OVER THE BUILT-IN TABLES */
+/*
+	The ruleset file follows the AnyOption resource file layout, one
+	"key : value" pair per line, with '#' starting a comment:
+
+		# Starport class for 2D-2 = 0..10
+		starport.backwater : AABBCCCDEEX
+		starport.frontier  : AAABBCCDEEX
+		starport.mature    : AAABBCCDEEE
+		starport.cluster   : AAAABBCCDEX
+		# Count for 2D-2 = 0..10
+		giants : 1 1 2 2 3 3 4 4 4 5 5
+		belts  : 1 1 1 1 1 1 2 2 2 2 2
+		# DM lists are code=dm pairs, codes not listed have a DM of 0
+		hydro.atmosphere : 0=-4 1=-4 A=-4 B=-4 C=-4 D=-4 E=-4 F=-4
+		scout.starport   : A=-3 B=-2 C=-1
+		tl.starport      : A=6 B=4 C=2 X=-4
+		tl.size          : 0=2 1=2 2=1 3=1 4=1
+		tl.atmosphere    : 0=1 1=1 2=1 3=1 A=1 B=1 C=1 D=1 E=1
+		tl.hydrographics : 8=1 9=2
+		tl.population    : 1=1 2=1 3=1 4=1 5=1 9=2 A=4
+		tl.government    : 0=1 5=1 D=-2
+
+	UWP codes are hex digits, starports are class letters. A DM list
+	replaces the whole built-in table for its key.
+*/
+void
+parseRulesetFile(const string &rulesFile)
+{
+	static const char *maturityNames[] = {"", "backwater", "frontier", "mature", "cluster"};
+	string line;
+	int lineNum = 0;
+
+	ifstream inputFile(rulesFile.c_str());
+
+	if (!inputFile){
+		cerr << "Unable to open ruleset file: " << rulesFile << "\n";
+		exit(1);
+	}
+
+	while (getline (inputFile, line))
+	{
+		lineNum++;
+
+		/* Strip the comment and split into key and value */
+		size_t pos = line.find('#');
+		if (pos != string::npos)
+			line.erase(pos);
+
+		pos = line.find(':');
+		if (pos == string::npos){
+			if (line.find_first_not_of(" \t\r") != string::npos){
+				cerr << rulesFile << ":" << lineNum << ": expected \"key : value\"\n";
+				exit(1);
+			}
+			continue;
+		}
+
+		string key;
+		string value = line.substr(pos + 1);
+		istringstream keyStream(line.substr(0, pos));
+		keyStream >> key;
+
+		if (key.compare(0, 9, "starport.") == 0){
+			int m;
+			for (m = 1; m < 5; m++){
+				if (key.compare(9, string::npos, maturityNames[m]) == 0)
+					break;
+			}
+
+			string classes;
+			for (size_t i = 0; i < value.size(); i++){
+				if (value[i] >= 'A' && value[i] <= 'Z')
+					classes += value[i];
+			}
+
+			if (m == 5 || classes.size() != 11){
+				cerr << rulesFile << ":" << lineNum << ": " << key << " needs 11 starport classes\n";
+				exit(1);
+			}
+			memcpy(rules.starport[m], classes.data(), 11);
+			if (m == 3)
+				memcpy(rules.starport[0], classes.data(), 11);
+		}else if (key == "giants" || key == "belts"){
+			int *table = ((key == "giants") ? rules.giants : rules.belts);
+			istringstream values(value);
+			int i;
+			for (i = 0; i < 11 && (values >> table[i]); i++)
+				;
+			if (i != 11){
+				cerr << rulesFile << ":" << lineNum << ": " << key << " needs 11 values\n";
+				exit(1);
+			}
+		}else if (key == "hydro.atmosphere"){
+			parseDMList(key, value, rules.hydAtmDM, 16, false);
+		}else if (key == "scout.starport"){
+			parseDMList(key, value, rules.scoutDM, 26, true);
+		}else if (key == "tl.starport"){
+			parseDMList(key, value, rules.tlPortDM, 26, true);
+		}else if (key == "tl.size"){
+			parseDMList(key, value, rules.tlSizDM, 11, false);
+		}else if (key == "tl.atmosphere"){
+			parseDMList(key, value, rules.tlAtmDM, 16, false);
+		}else if (key == "tl.hydrographics"){
+			parseDMList(key, value, rules.tlHydDM, 11, false);
+		}else if (key == "tl.population"){
+			parseDMList(key, value, rules.tlPopDM, 11, false);
+		}else if (key == "tl.government"){
+			parseDMList(key, value, rules.tlGovDM, 16, false);
+		}else{
+			cerr << rulesFile << ":" << lineNum << ": unknown key " << key << "\n";
+			exit(1);
+		}
+	}
+	inputFile.close();
+}
+
+/* PARSE A LIST OF code=dm PAIRS INTO A DM TABLE */
+void
+parseDMList(const string &key, const string &value, int *table, int size, bool byClass)
+{
+	string item;
+	istringstream items(value);
+
+	memset(table, 0, size * sizeof(int));
+
+	while (items >> item)
+	{
+		int code = -1;
+
+		if (item.size() > 2 && item[1] == '='){
+			char c = toupper(item[0]);
+			if (byClass)
+				code = ((c >= 'A' && c <= 'Z') ? c - 'A' : -1);
+			else
+				code = hexValue(c);
+		}
+
+		if (code < 0 || code >= size){
+			cerr << "Ruleset " << key << ": bad entry " << item << "\n";
+			exit(1);
+		}
+		table[code] = atoi(item.c_str() + 2);
+	}
+}
+
+/* PRECOMPUTE THE TECH LEVEL DM SUMS */
+void
+compileRuleset()
+{
+	int siz, atm, hyd, pop, gov;
+
+	for (siz = 0; siz < 11; siz++)
+		for (atm = 0; atm < 16; atm++)
+			for (hyd = 0; hyd < 11; hyd++)
+				rules.tlPhysDM[siz][atm][hyd] = rules.tlSizDM[siz] +
+					rules.tlAtmDM[atm] + rules.tlHydDM[hyd];
+
+	for (pop = 0; pop < 11; pop++)
+		for (gov = 0; gov < 16; gov++)
+			rules.tlSocDM[pop][gov] = rules.tlPopDM[pop] + rules.tlGovDM[gov];
+}
+
+/* GENERATE ONE SECTOR OF THE REGION */
+void
+generateSector(int secX, int secY)
+{
+	struct sectorData sec;
+
+	placeSector(secX, secY, sec);
+
+	/* Move the systems into the region */
+	sec.first = regionSys.size();
+	sec.count = generateSectorSystems(secX, secY, sec.name, regionSys);
+	*report << "# of Systems: " << secDataLine << "\n";
+
+	regionSectors.push_back(sec);
+}
+
+/* NAME A SECTOR OF THE REGION AND ITS OUTPUT FILE */
+void
+placeSector(int secX, int secY, sectorData &sec)
+{
+	sec.secX = secX;
+	sec.secY = secY;
+
+	if (options.regionCols == 1 && options.regionRows == 1){
+		sec.name = options.sectorName;
+		sec.outputPath = options.outputPath;
+	}else{
+		stringstream name;
+		name << options.sectorName << "_" << secX << "_" << secY;
+		sec.name = name.str();
+		sec.outputPath = options.outputPath + sec.name + ((options.outputFormat < 7) ? ".sec" : ".xml");
+	}
+	if (options.outputPath == "-")
+		sec.outputPath = "-";
+	else if (options.compress)
+		sec.outputPath += ".gz";
+}
+
+/* GENERATE THE SYSTEMS OF ONE SECTOR, ADDING THEM TO THE END OF A LIST */
+int
+generateSectorSystems(int secX, int secY, const string &secName, vector<generatedSystem> &systems)
+{
+	/* Start the sector with an empty system list */
+	sdn = 1;
+	secDataLine = 1;
+
+	int fileExists = readNamesFile(secName);
+
+	hexIterate(fileExists, secX, secY);
+
+	/* Place the systems on the region hex grid */
+	for (int i = 1; i < sdn; i++){
+		sys[i].regionX = secX * SECTOR_COLS + sys[i].hex / 100 - 1;
+		sys[i].regionY = secY * SECTOR_ROWS + sys[i].hex % 100 - 1;
+		systems.push_back(sys[i]);
+	}
+	return sdn - 1;
+}
+
+/* WALK THROUGH THE HEXES AND RANDOMLY CALL SYSTEM GENERATION */
+void
+hexIterate(int fileExists, int secX, int secY)
+{
+	int x, y;
+	int x_start = 1, x_end = 32;
+	int y_start = 1, y_end = 40;
+
+	int lineNum = 0; /* Keep track of the line in the sectornames_names.txt file that we are on */
+
+	/* Count through each hex and randomly (or not) generate a system */
+	for (x = x_start; x <= x_end; x++)
 	{
 		for (y = y_start; y <= y_end; y++)
 		{
-			switch(fileExists){
-			case 1:
-				/* Check if the X value of the hex matches */
-				if (systemData[lineNum].xHex == x)
-				{
-					/* Check if the Y value of the hex matches*/
-					if (systemData[lineNum].yHex == y)
-					{
-						/* Grab the system name for the matched hex*/
-						hexName.assign(systemData[lineNum].starName);
-						/* Call system gen and pass the pre-defined system name */
-						generateSystem (x, y, options.allegience, hexName);
-						lineNum++;
-						secDataLine++;
-					}
-					else
-					{
-						/* Y Hex didn't match, randomly generate a system */
-						if (diceRoll(100) <= density)
-						{
-							hexName.assign("Unnamed");
-							generateSystem (x, y, options.allegience, hexName);
-							secDataLine++;
-						}
-					}
-				}
-				else
-				{
-					/* X Hex didn't match, randomly generate a system */
-					if (diceRoll(100) <= density)
-					{
-					 	hexName.assign("Unnamed");
-						generateSystem (x, y, options.allegience, hexName);
-						secDataLine++;
-					}
-				}
-				break;
-			default:
-                /* No names file, generate all systems randomly */
-				if (diceRoll(100) <= density)
-				{
-					hexName.assign("Unnamed");
-					generateSystem (x, y, options.allegience, hexName);
-					secDataLine++;
+			/* Check if the hex is the next one in the names file */
+			if (fileExists == 1 && systemData[lineNum].xHex == x && systemData[lineNum].yHex == y)
+			{
+				/* Call system gen and pass the pre-defined system name */
+				if (systemData[lineNum].allegiance.empty()){
+					rollHex(secX, secY, x, y, systemData[lineNum].starName, options.allegience);
+				}else{
+					rollHex(secX, secY, x, y, systemData[lineNum].starName, systemData[lineNum].allegiance);
+					sys[sdn - 1].canon = true;
+				}
+				lineNum++;
+				secDataLine++;
+			}
+			else if (rollHex(secX, secY, x, y, "", options.allegience))
+			{
+				/* Not in the names file, randomly generated a system */
+				secDataLine++;
+			}
+		}
+	}
+}
+
+/* ROLL FOR A SYSTEM AT ONE HEX, GENERATING IT INTO sys[sdn] IF PRESENT */
+bool
+rollHex(int secX, int secY, int x, int y, const string &hexName, const string &ali)
+{
+	/* Named hexes always have a system, but still make the presence
+	   roll, so naming a hex does not change the system rolled there */
+	seedHex(secX, secY, (x*100) + y, SEED_WORLD);
+
+	int presence = diceRoll(100);
+
+	/* A constrained hex always has a system too */
+	const worldConstraint *want = (constraints.empty() ? NULL : findConstraint(secX, secY, (x*100) + y));
+
+	if (hexName.empty() && want == NULL && presence > density)
+		return false;
+
+	generateSystem (x, y, ali, (hexName.empty() ? "Unnamed" : hexName), want);
+	return true;
+}
+
+/* GENERATE THE SYSTEM AT ONE HEX, WITHOUT THE REST OF ITS SECTOR */
+/*
+	Makes the same rolls hexIterate does for the hex, so the system is
+	the one a full run of the sector would produce. hexName is the name
+	from the names file, empty if the hex is not listed. Returns false
+	if there is no system at the hex.
+*/
+bool
+generateHex(int secX, int secY, int x, int y, const string &hexName, const string &ali, generatedSystem &world)
+{
+	/* sys[0] is never part of a sector, so use it as scratch */
+	int saveSdn = sdn;
+	sdn = 0;
+
+	bool present = rollHex(secX, secY, x, y, hexName, ali);
+	if (present)
+		world = sys[0];
+
+	sdn = saveSdn;
+	return present;
+}
+
+/* PRINT THE SYSTEM AT THE HEX GIVEN ON THE COMMAND LINE */
+void
+printHex()
+{
+	int secX, secY, hex;
+	string secName;
+
+	if (!parseHexLabel(options.hex, secName, secX, secY, hex)){
+		cerr << "Not a hex: " << options.hex << "\n";
+		return;
+	}
+
+	/* The names file says whether the hex is named */
+	string hexName;
+	string ali = options.allegience;
+	if (readNamesFile(secName) == 1){
+		for (int i = 0; i < MAX_SYS && systemData[i].starHex != 0; i++)
+		{
+			if (!options.nameCorpusPath.empty())
+				nameGen.used.insert(systemData[i].starName);
+			if (systemData[i].starHex == hex){
+				hexName = systemData[i].starName;
+				if (!systemData[i].allegiance.empty())
+					ali = systemData[i].allegiance;
+			}
+		}
+	}
+
+	generatedSystem world;
+	if (!generateHex(secX, secY, hex / 100, hex % 100, hexName, ali, world)){
+		cout << "No system at " << options.hex << "\n";
+		return;
+	}
+
+	if (!options.nameCorpusPath.empty() && world.name == "Unnamed"){
+		seedHex(secX, secY, hex, SEED_NAME);
+		world.name = generateName(nameWidth(options.outputFormat), nameGen.used);
+	}
+
+	cout << formatVersion(options.outputFormat);
+	writeSystemLine(cout, options.outputFormat, world);
+	cout << "\n";
+}
+
+/* FIND THE POSITION OF A SECTOR FROM ITS NAME, sectorName OR sectorName_x_y */
+bool
+parseSectorName(const string &secName, int &secX, int &secY)
+{
+	string prefix = options.sectorName + "_";
+	char sep;
+
+	if (secName == options.sectorName){
+		secX = secY = 0;
+		return true;
+	}
+
+	if (secName.compare(0, prefix.size(), prefix) != 0)
+		return false;
+
+	istringstream coords(secName.substr(prefix.size()));
+	return ((coords >> secX >> sep >> secY) && sep == '_' && coords.peek() == EOF);
+}
+
+/* FIND THE SECTOR AND HEX OF A [sectorName/]XXYY LABEL */
+bool
+parseHexLabel(const string &label, string &secName, int &secX, int &secY, int &hex)
+{
+	string hexNum = label;
+	size_t slash = label.rfind('/');
+
+	secName = options.sectorName;
+	if (slash != string::npos){
+		secName = label.substr(0, slash);
+		hexNum = label.substr(slash + 1);
+	}
+
+	hex = atoi(hexNum.c_str());
+	return (parseSectorName(secName, secX, secY) && hexNum.size() == 4 &&
+	    hexNum.find_first_not_of("0123456789") == string::npos &&
+	    hex / 100 >= 1 && hex / 100 <= SECTOR_COLS && hex % 100 >= 1 && hex % 100 <= SECTOR_ROWS);
+}
+
+/* GENERATE A SYSTEM, MEETING A CONSTRAINT IF want IS NOT NULL */
+void
+generateSystem(int x, int y, string ali, string hexName, const worldConstraint *want)
+{
+	string tra;
+    char cla, bas, zon;
+    int siz, atm, hyd, pop, gov, law, tl, gas, pla, mul;
+    bool sco, nav, dep, mil, way;
+
+    if (want != NULL){
+        /* Every digit is drawn given the constraint, with no rerolls */
+        worldRoll roll;
+        rollConstrainedWorld(*want, roll);
+        cla = roll.cla;
+        siz = roll.siz;
+        atm = roll.atm;
+        hyd = roll.hyd;
+        pop = roll.pop;
+        gov = roll.gov;
+        law = roll.law;
+        tl = roll.tl;
+        zon = roll.zon;
+        nav = roll.nav;
+        sco = roll.sco;
+        mil = roll.mil;
+    }else{
+        /* Starport class */
+        int roll = D2 - 2;
+
+        cla = rules.starport[maturity][roll];
+
+        /* Physical characteristics */
+        siz = D2 - 2;
+        atm = ((siz == 0) ? 0 : (D2 - 7 + siz));
+        atm = limit(atm, 0, 15);
+        hyd = D2 - 7 + siz + rules.hydAtmDM[atm];
+        hyd = ((siz < 2) ? 0 : hyd);
+        hyd = limit(hyd, 0, 10);
+
+        /* Demographics */
+        pop = D2 - 2;
+        gov = D2 - 7 + pop;
+        gov = limit(gov, 0, 15);
+        law = D2 - 7 + gov;
+        law = limit(law, 0, 20);
+
+        /* Technological Level */
+        tl = D1 + rules.tlPortDM[cla - 'A'] + rules.tlPhysDM[siz][atm][hyd] +
+            rules.tlSocDM[pop][gov];
+        tl = limit(tl, 0, 16);
+    }
+
+    /* System characteristics (PBG) */
+    mul = diceRoll(5) + ((D1 > 3) ? -1 : 4);/* population multiplier */
+    pla = ((D2 < 8) ? 0 : rules.belts[D2 - 2]);	/* planetoid belts */
+    gas = ((D2 < 5) ? 0 : rules.giants[D2 - 2]);	/* gas giants */
+
+    if (want == NULL){
+        /* Travel advisories */
+        zon = ((cla == 'X') ? 'R' : ((D2 > 11) ? 'A' : ' '));
+
+        /* Bases */
+        nav = (cla < 'C' && D2 > 7);
+        sco = (cla < 'E' && (D2 + rules.scoutDM[cla - 'A']) > 6) ;
+        mil = (cla < 'D' && (D2 + DM(pop > 8, -1) + DM((atm > 1 && atm < 6 && hyd < 4), -20)) > 11);
+    }
+    dep = (cla < 'B' && gov > 9);
+    way = (cla < 'B' && (hyd > 4));
+    bas = baseCode(nav, sco, mil, dep, way);
+
+    /* Trade classifications */
+    int codes = tradeBits(siz, atm, hyd, pop, gov, law);
+    for (int i = 0; i < NUM_TRADE_CODES; i++)
+        if (codes & (1 << i))
+            tra = tra + tradeCodeNames[i] + " ";
+
+    /* Store the system */
+	sys[sdn].name = hexName;
+	sys[sdn].hex = (x*100) + y;
+
+	sys[sdn].UWP = cla;
+	sys[sdn].UWP = sys[sdn].UWP + hexChar(siz);
+	sys[sdn].UWP = sys[sdn].UWP + hexChar(atm);
+	sys[sdn].UWP = sys[sdn].UWP + hexChar(hyd);
+	sys[sdn].UWP = sys[sdn].UWP + hexChar(pop);
+	sys[sdn].UWP = sys[sdn].UWP + hexChar(gov);
+	sys[sdn].UWP = sys[sdn].UWP + hexChar(law);
+	sys[sdn].UWP = sys[sdn].UWP + "-";
+	sys[sdn].UWP = sys[sdn].UWP + hexChar(tl);
+
+	sys[sdn].base = bas;
+	sys[sdn].codes = tra;
+	sys[sdn].PBG = (mul*100) + (pla*10) + gas;
+	sys[sdn].allegiance = ali;
+	sys[sdn].zone = zon;
+
+	sys[sdn].stellar = "";
+	sys[sdn].satellite = "";
+	sys[sdn].gasGiant = "";
+	sys[sdn].canon = false;
+
+	sdn++;
+
+}
+
+/* READ THE WORLD CONSTRAINTS GIVEN ON THE COMMAND LINE */
+/*
+	Each constraint is "[sectorName/]XXYY:term,term,..." and constraints
+	are separated by ';'. The terms are those of parseWorldTerm(), other
+	than belts and giants. A constrained hex always has a system, as a
+	named hex does.
+*/
+void
+loadConstraints()
+{
+	istringstream list(options.constraints);
+	string text;
+
+	while (getline (list, text, ';'))
+	{
+		if (text.find_first_not_of(" ") == string::npos)
+			continue;
+
+		worldConstraint want;
+		if (!parseConstraint(text, want)){
+			cerr << "Bad constraint: " << text << "\n";
+			exit(1);
+		}
+
+		compileConstraint(want);
+		if (want.cumulative.empty()){
+			cerr << "No world can meet the constraint: " << text << "\n";
+			exit(1);
+		}
+		constraints.push_back(want);
+	}
+}
+
+/* PARSE ONE CONSTRAINT */
+bool
+parseConstraint(const string &text, worldConstraint &want)
+{
+	size_t colon = text.find(':');
+	string secName, term;
+
+	if (colon == string::npos)
+		return false;
+
+	want.text = text;
+	if (!parseHexLabel(text.substr(0, colon), secName, want.secX, want.secY, want.hex))
+		return false;
+
+	clearWorldFilter(want.is);
+
+	istringstream terms(text.substr(colon + 1));
+	while (getline (terms, term, ','))
+	{
+		if (!parseWorldTerm(term, want.is))
+			return false;
+	}
+
+	/* Belts and gas giants are rolled the usual way */
+	for (int i = FILTER_BELTS; i < FILTER_DIGITS; i++)
+		if (want.is.low[i] != 0 || want.is.high[i] != filterDigitMax[i])
+			return false;
+	return true;
+}
+
+/* SET A WORLD FILTER TO ALLOW EVERY WORLD */
+void
+clearWorldFilter(worldFilter &is)
+{
+	is.ports = is.bases = is.zones = "";
+	for (int i = 0; i < FILTER_DIGITS; i++)
+	{
+		is.low[i] = 0;
+		is.high[i] = filterDigitMax[i];
+	}
+	is.needCodes = is.banCodes = 0;
+}
+
+/* PARSE ONE TERM OF A CONSTRAINT OR QUERY INTO A WORLD FILTER */
+/*
+	port=AB		starport is one of the classes listed
+	siz=N ... tl=N	UWP digit is N, or in the range N-M, N- or -M
+	belts=N		planetoid belts and gas giants, the same way
+	giants=N
+	base=NS-	base code is one of those listed, '-' for no base
+	zone=AR-	travel zone is one of those listed, '-' for none
+	Hi, !Ba		trade classification is required, or ruled out
+*/
+bool
+parseWorldTerm(const string &text, worldFilter &is)
+{
+	string term = text;
+
+	term.erase(0, term.find_first_not_of(" "));
+	term.erase(term.find_last_not_of(" ") + 1);
+	if (term.empty())
+		return true;
+
+	size_t equals = term.find('=');
+	if (equals == string::npos){
+		/* A trade classification, ! to rule it out */
+		bool ban = (term[0] == '!');
+		int code = tradeMask(term.substr(ban ? 1 : 0));
+		if (code == 0 || term.size() != (ban ? 3u : 2u))
+			return false;
+		if (ban)
+			is.banCodes |= code;
+		else
+			is.needCodes |= code;
+		return true;
+	}
+
+	string key = term.substr(0, equals);
+	string value = term.substr(equals + 1);
+
+	if (key == "port"){
+		is.ports = value;
+	}else if (key == "base"){
+		is.bases = value;
+	}else if (key == "zone"){
+		is.zones = value;
+	}else{
+		int i;
+		for (i = 0; i < FILTER_DIGITS && key != filterDigitNames[i]; i++)
+			;
+		if (i == FILTER_DIGITS || value.empty())
+			return false;
+
+		/* N, N-M, N- or -M, in eHex digits */
+		size_t dash = value.find('-');
+		string from = value.substr(0, dash);
+		string to = ((dash == string::npos) ? from : value.substr(dash + 1));
+		if (from.size() > 1 || to.size() > 1 || (from.empty() && to.empty()))
+			return false;
+		if (!from.empty())
+			is.low[i] = hexValue(from[0]);
+		if (!to.empty())
+			is.high[i] = hexValue(to[0]);
+		if (is.low[i] < 0 || is.high[i] < 0)
+			return false;
+	}
+	return true;
+}
+
+/* WORK OUT THE ODDS OF EVERY WORLD THAT MEETS A CONSTRAINT */
+/*
+	generateSystem rolls the physical digits (size, atmosphere,
+	hydrographics) and the social digits (population, government, law)
+	as two independent chains, so each chain is enumerated once with its
+	odds. The outcomes of a chain are grouped when they look the same to
+	everything that couples the two chains: the trade classifications,
+	the bases and the tech level DM. The odds of every (starport, physical
+	group, social group) that can meet the constraint then go into one
+	cumulative table, and sampling a world is a draw from that table
+	followed by draws within the groups, with no retries.
+*/
+void
+compileConstraint(worldConstraint &want)
+{
+	map<long long, int> physIndex, socIndex;
+	int ways[13] = {0, 0, 1, 2, 3, 4, 5, 6, 5, 4, 3, 2, 1};
+
+	/* Starport classes, by 2D roll */
+	for (int roll = 2; roll <= 12; roll++)
+	{
+		char cla = rules.starport[maturity][roll - 2];
+		if (!allows(want.is.ports, cla))
+			continue;
+
+		size_t c = find(want.classes.begin(), want.classes.end(), cla) - want.classes.begin();
+		if (c == want.classes.size()){
+			want.classes.push_back(cla);
+			want.classOdds.push_back(0);
+		}
+		want.classOdds[c] += ways[roll] / 36.0;
+	}
+
+	/* Physical chain, grouped by what the trade codes, bases and tech level see */
+	for (int sizRoll = 2; sizRoll <= 12; sizRoll++)
+	{
+		for (int atmRoll = 2; atmRoll <= 12; atmRoll++)
+		{
+			for (int hydRoll = 2; hydRoll <= 12; hydRoll++)
+			{
+				int siz = sizRoll - 2;
+				int atm = ((siz == 0) ? 0 : limit(atmRoll - 7 + siz, 0, 15));
+				int hyd = ((siz < 2) ? 0 : limit(hydRoll - 7 + siz + rules.hydAtmDM[atm], 0, 10));
+
+				if (siz < want.is.low[0] || siz > want.is.high[0] || atm < want.is.low[1] ||
+				    atm > want.is.high[1] || hyd < want.is.low[2] || hyd > want.is.high[2])
+					continue;
+
+				int sizClass = ((siz == 0) ? 0 : ((siz > 9) ? 2 : 1));
+				int hydClass = ((hyd == 0) ? 0 : ((hyd < 4) ? 1 : ((hyd == 4) ? 2 : ((hyd < 9) ? 3 : hyd - 5))));
+				int dm = rules.tlPhysDM[siz][atm][hyd];
+				long long key = (((long long)(sizClass * 16 + atm) * 6 + hydClass) << 16) + dm + 0x8000;
+
+				uwpOutcome outcome = {siz, atm, hyd, ways[sizRoll] * ways[atmRoll] * ways[hydRoll] / 46656.0};
+				addOutcome(want.phys, physIndex, key, dm, outcome);
+			}
+		}
+	}
+
+	/* Social chain, grouped the same way */
+	for (int popRoll = 2; popRoll <= 12; popRoll++)
+	{
+		for (int govRoll = 2; govRoll <= 12; govRoll++)
+		{
+			for (int lawRoll = 2; lawRoll <= 12; lawRoll++)
+			{
+				int pop = popRoll - 2;
+				int gov = limit(govRoll - 7 + pop, 0, 15);
+				int law = limit(lawRoll - 7 + gov, 0, 20);
+
+				if (pop < want.is.low[3] || pop > want.is.high[3] || gov < want.is.low[4] ||
+				    gov > want.is.high[4] || law < want.is.low[5] || law > want.is.high[5])
+					continue;
+
+				int govClass = ((gov == 0) ? 0 : ((gov < 4) ? 1 : ((gov < 10) ? 2 : 3)));
+				int dm = rules.tlSocDM[pop][gov];
+				long long key = (((long long)(pop * 4 + govClass) * 2 + (law == 0)) << 16) + dm + 0x8000;
+
+				uwpOutcome outcome = {pop, gov, law, ways[popRoll] * ways[govRoll] * ways[lawRoll] / 46656.0};
+				addOutcome(want.soc, socIndex, key, dm, outcome);
+			}
+		}
+	}
+
+	/* Odds of each combination meeting the rest of the constraint */
+	double total = 0;
+	int numPhys = want.phys.size(), numSoc = want.soc.size();
+
+	for (size_t c = 0; c < want.classes.size(); c++)
+	{
+		char cla = want.classes[c];
+
+		for (int p = 0; p < numPhys; p++)
+		{
+			const uwpGroup &phys = want.phys[p];
+
+			for (int s = 0; s < numSoc; s++)
+			{
+				const uwpGroup &soc = want.soc[s];
+				double baseOdds[8], zoneOdds[3];
+				bool tlOK[6];
+
+				int codes = tradeBits(phys.a, phys.b, phys.c, soc.a, soc.b, soc.c);
+				if ((codes & want.is.needCodes) != want.is.needCodes || (codes & want.is.banCodes) != 0)
+					continue;
+
+				double odds = want.classOdds[c] * phys.odds * soc.odds *
+					techLevelRolls(want, cla, phys.dm + soc.dm, tlOK) / 6.0 *
+					baseRolls(want, cla, phys.b, phys.c, soc.a, soc.b, baseOdds) *
+					zoneRolls(want, cla, zoneOdds);
+				if (odds <= 0)
+					continue;
+
+				total += odds;
+				want.cumulative.push_back(total);
+				want.pick.push_back(((int)c * numPhys + p) * numSoc + s);
+			}
+		}
+	}
+}
+
+/* ADD AN OUTCOME OF ONE CHAIN TO ITS GROUP */
+void
+addOutcome(vector<uwpGroup> &groups, map<long long, int> &index, long long key, int dm, const uwpOutcome &outcome)
+{
+	map<long long, int>::iterator found = index.find(key);
+
+	if (found == index.end()){
+		uwpGroup group;
+		group.a = outcome.a;
+		group.b = outcome.b;
+		group.c = outcome.c;
+		group.dm = dm;
+		group.odds = 0;
+		found = index.insert(make_pair(key, (int)groups.size())).first;
+		groups.push_back(group);
+	}
+
+	uwpGroup &group = groups[found->second];
+	group.odds += outcome.odds;
+	group.members.push_back(outcome);
+	group.cumulative.push_back(group.odds);
+}
+
+/* FIND THE CONSTRAINT ON A HEX, IF ANY */
+const worldConstraint *
+findConstraint(int secX, int secY, int hex)
+{
+	for (size_t i = 0; i < constraints.size(); i++)
+	{
+		if (constraints[i].hex == hex && constraints[i].secX == secX && constraints[i].secY == secY)
+			return &constraints[i];
+	}
+	return NULL;
+}
+
+/* ROLL A WORLD THAT MEETS A CONSTRAINT, DRAWING EACH PART GIVEN THE REST */
+void
+rollConstrainedWorld(const worldConstraint &want, worldRoll &roll)
+{
+	double baseOdds[8], zoneOdds[3];
+	bool tlOK[6];
+	int numPhys = want.phys.size(), numSoc = want.soc.size();
+
+	int pick = want.pick[sampleIndex(want.cumulative)];
+	const uwpGroup &phys = want.phys[(pick / numSoc) % numPhys];
+	const uwpGroup &soc = want.soc[pick % numSoc];
+	roll.cla = want.classes[pick / numSoc / numPhys];
+
+	/* Any member of a group will do, in proportion to its odds */
+	const uwpOutcome &physRoll = phys.members[sampleIndex(phys.cumulative)];
+	const uwpOutcome &socRoll = soc.members[sampleIndex(soc.cumulative)];
+	roll.siz = physRoll.a;
+	roll.atm = physRoll.b;
+	roll.hyd = physRoll.c;
+	roll.pop = socRoll.a;
+	roll.gov = socRoll.b;
+	roll.law = socRoll.c;
+
+	/* Tech level die, from those that give an allowed tech level */
+	int tlDM = rules.tlPortDM[roll.cla - 'A'] + rules.tlPhysDM[roll.siz][roll.atm][roll.hyd] +
+		rules.tlSocDM[roll.pop][roll.gov];
+	int numRolls = techLevelRolls(want, roll.cla, phys.dm + soc.dm, tlOK);
+	int die = nextRandom() % numRolls;
+	for (int d = 0; d < 6; d++)
+	{
+		if (tlOK[d] && die-- == 0){
+			roll.tl = limit(d + 1 + tlDM, 0, 16);
+			break;
+		}
+	}
+
+	/* Base rolls, from those that give an allowed base code */
+	baseRolls(want, roll.cla, roll.atm, roll.hyd, roll.pop, roll.gov, baseOdds);
+	vector<double> cumulative(8);
+	for (int b = 0; b < 8; b++)
+		cumulative[b] = baseOdds[b] + ((b > 0) ? cumulative[b - 1] : 0);
+	int bases = sampleIndex(cumulative);
+	roll.nav = (bases & 1);
+	roll.sco = (bases & 2);
+	roll.mil = (bases & 4);
+
+	/* Travel zone */
+	zoneRolls(want, roll.cla, zoneOdds);
+	cumulative.assign(zoneOdds, zoneOdds + 3);
+	cumulative[1] += cumulative[0];
+	cumulative[2] += cumulative[1];
+	roll.zon = " AR"[sampleIndex(cumulative)];
+}
+
+/* MARK THE TECH LEVEL DIE ROLLS THAT MEET A CONSTRAINT, AND COUNT THEM */
+int
+techLevelRolls(const worldConstraint &want, char cla, int dm, bool ok[6])
+{
+	int count = 0;
+
+	for (int d = 0; d < 6; d++)
+	{
+		int tl = limit(d + 1 + rules.tlPortDM[cla - 'A'] + dm, 0, 16);
+		ok[d] = (tl >= want.is.low[6] && tl <= want.is.high[6]);
+		count += ok[d];
+	}
+	return count;
+}
+
+/* ODDS OF EACH NAVAL, SCOUT AND MILITARY BASE ROLL THAT MEETS A CONSTRAINT */
+/*
+	odds[b] is for naval (b & 1), scout (b & 2) and military (b & 4)
+	bases, zero if the base code that makes is not allowed. Returns the
+	odds of meeting the constraint.
+*/
+double
+baseRolls(const worldConstraint &want, char cla, int atm, int hyd, int pop, int gov, double odds[8])
+{
+	double nav = ((cla < 'C') ? twoDiceOver(7) : 0);
+	double sco = ((cla < 'E') ? twoDiceOver(6 - rules.scoutDM[cla - 'A']) : 0);
+	double mil = ((cla < 'D') ? twoDiceOver(11 - DM(pop > 8, -1) - DM((atm > 1 && atm < 6 && hyd < 4), -20)) : 0);
+	bool dep = (cla < 'B' && gov > 9);
+	bool way = (cla < 'B' && (hyd > 4));
+	double total = 0;
+
+	for (int b = 0; b < 8; b++)
+	{
+		odds[b] = ((b & 1) ? nav : 1 - nav) * ((b & 2) ? sco : 1 - sco) * ((b & 4) ? mil : 1 - mil);
+		if (!allows(want.is.bases, baseCode(b & 1, b & 2, b & 4, dep, way)))
+			odds[b] = 0;
+		total += odds[b];
+	}
+	return total;
+}
+
+/* ODDS OF EACH TRAVEL ZONE (NONE, AMBER, RED) THAT MEETS A CONSTRAINT */
+double
+zoneRolls(const worldConstraint &want, char cla, double odds[3])
+{
+	odds[0] = ((cla == 'X') ? 0 : 1 - twoDiceOver(11));
+	odds[1] = ((cla == 'X') ? 0 : twoDiceOver(11));
+	odds[2] = ((cla == 'X') ? 1 : 0);
+
+	for (int z = 0; z < 3; z++)
+		if (!allows(want.is.zones, " AR"[z]))
+			odds[z] = 0;
+	return odds[0] + odds[1] + odds[2];
+}
+
+/* CHECK A CODE AGAINST A LIST OF ALLOWED LETTERS, '-' STANDING FOR BLANK */
+bool
+allows(const string &letters, char c)
+{
+	return (letters.empty() || letters.find((c == ' ') ? '-' : c) != string::npos);
+}
+
+/* WRITE THE SECTOR FILE */
+/*
+	The systems are cut into chunks of WRITE_CHUNK lines, each formatted
+	into its own buffer on a worker thread. The buffers, in order, are
+	then written to the file with one vectored write.
+*/
+bool
+writeSectorFile(int outFormat, const sectorData &sec)
+{
+	vector<string> chunks;
+
+	*report << "Output file: " << sec.outputPath << "\n";
+
+	formatSectorFile(outFormat, sec, regionSys.data() + sec.first, chunks);
+	if (pack.fd >= 0)
+		return packSectorFile(sec.secX, sec.secY, sec.outputPath, chunks);
+	return writeOutputFile(sec.outputPath, chunks);
+}
+
+/* FORMAT A SECTOR FILE INTO BUFFERS, READY TO WRITE */
+void
+formatSectorFile(int outFormat, const sectorData &sec, const generatedSystem *systems, vector<string> &chunks)
+{
+	sectorFormat work;
+
+	bool streamed = (sec.outputPath == "-" && (options.regionCols > 1 || options.regionRows > 1));
+
+	work.systems = systems;
+	work.count = sec.count;
+	work.outFormat = outFormat;
+	work.lastNewline = streamed;
+
+	/* The version line identifies the format, then one line per system */
+	work.chunks.resize(1 + (sec.count + WRITE_CHUNK - 1) / WRITE_CHUNK);
+	work.chunks[0] = formatVersion(outFormat);
+
+	/* The sectors of a region follow each other down standard output */
+	if (streamed)
+		work.chunks[0] = "#Sector: " + sec.name + "\n" + work.chunks[0];
+
+	parallelFor(work.chunks.size() - 1, formatSectorChunk, &work);
+
+	chunks.swap(work.chunks);
+}
+
+/* FORMAT ONE CHUNK OF THE LINES OF A SECTOR FILE */
+void
+formatSectorChunk(int chunk, void *arg)
+{
+	sectorFormat &work = *(sectorFormat *)arg;
+	ostringstream out;
+	int first = chunk * WRITE_CHUNK;
+	int last = min(first + WRITE_CHUNK, work.count);
+
+	for (int line = first; line < last; line++)
+	{
+		writeSystemLine(out, work.outFormat, work.systems[line]);
+
+		/* No newline after the last line of the file */
+		if ((line + 1) < work.count || work.lastNewline)
+			out << "\n";
+	}
+	work.chunks[chunk + 1] = out.str();
+}
+
+/* FORMAT A SECTOR FILE AND QUEUE IT FOR THE WRITER THREAD */
+void
+queueSectorFile(writeQueue &queue, int outFormat, const sectorData &sec, const string &cacheKey)
+{
+	vector<string> chunks;
+
+	*report << "Output file: " << sec.outputPath << "\n";
+
+	formatSectorFile(outFormat, sec, regionSys.data() + sec.first, chunks);
+
+	/* Wait while the writer is WRITE_QUEUE sectors behind */
+	unique_lock<mutex> hold(queue.lock);
+	while (queue.files.size() >= WRITE_QUEUE)
+		queue.changed.wait(hold);
+
+	queue.files.push_back(queuedFile());
+	queue.files.back().secX = sec.secX;
+	queue.files.back().secY = sec.secY;
+	queue.files.back().path = sec.outputPath;
+	queue.files.back().cacheKey = cacheKey;
+	queue.files.back().chunks.swap(chunks);
+	queue.changed.notify_all();
+}
+
+/* WRITE QUEUED SECTOR FILES UNTIL THE LAST ONE IS DONE */
+/*
+	Files are written with writev(), or compressed here on the writer
+	thread with --compress. io_uring would let the writes be
+	submitted without a system call each, but liburing is not something
+	we can count on being installed, and one writev() a file is already
+	few calls.
+*/
+void
+sectorWriter(writeQueue *queue, jobSettings settings)
+{
+	loadJobSettings(settings);
+
+	unique_lock<mutex> hold(queue->lock);
+
+	for (;;)
+	{
+		while (queue->files.empty() && !queue->done)
+			queue->changed.wait(hold);
+		if (queue->files.empty())
+			return;
+
+		queuedFile file;
+		file.secX = queue->files.front().secX;
+		file.secY = queue->files.front().secY;
+		file.path.swap(queue->files.front().path);
+		file.cacheKey.swap(queue->files.front().cacheKey);
+		file.chunks.swap(queue->files.front().chunks);
+		queue->files.pop_front();
+		queue->changed.notify_all();
+
+		hold.unlock();
+		if (pack.fd >= 0 ? packSectorFile(file.secX, file.secY, file.path, file.chunks) :
+		    writeOutputFile(file.path, file.chunks)){
+			markSectorDone(file.secX, file.secY);
+			if (!file.cacheKey.empty())
+				storeCachedSector(file.cacheKey, file.path);
+		}
+		hold.lock();
+	}
+}
+
+/* WRITE AN OUTPUT FILE FROM ITS BUFFERS, COMPRESSED IF ASKED FOR */
+/*
+	The file is written under a temporary name and renamed into place
+	once it is complete, so an interrupted run never leaves part of a
+	file behind under the real name.
+*/
+bool
+writeOutputFile(const string &path, const vector<string> &chunks)
+{
+	if (path == "-")
+		return (options.compress ? writeCompressedChunks(path, chunks) : writeChunks(path, chunks));
+
+	string temp = path + ".tmp";
+	bool ok = (options.compress ? writeCompressedChunks(temp, chunks) : writeChunks(temp, chunks));
+
+	if (ok && rename(temp.c_str(), path.c_str()) != 0){
+		cerr << "Unable to write " << path << ": " << strerror(errno) << "\n";
+		ok = false;
+	}
+	if (!ok)
+		unlink(temp.c_str());
+	return ok;
+}
+
+/* WRITE BUFFERS TO A FILE, IN ORDER, WITH AS FEW SYSTEM CALLS AS POSSIBLE */
+bool
+writeChunks(const string &path, const vector<string> &chunks)
+{
+	/* "-" is standard output, left open for the next sector */
+	bool piped = (path == "-");
+	int fd = (piped ? STDOUT_FILENO : open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666));
+	if (fd < 0){
+		cerr << "Unable to write " << path << ": " << strerror(errno) << "\n";
+		return false;
+	}
+
+	bool ok = writeChunksTo(fd, path, chunks);
+
+	if (!piped)
+		close(fd);
+	return ok;
+}
+
+/* WRITE BUFFERS TO AN OPEN FILE, CARRYING ON AFTER SHORT WRITES */
+bool
+writeChunksTo(int fd, const string &path, const vector<string> &chunks)
+{
+	vector<struct iovec> iov;
+	size_t first = 0;
+
+	for (size_t c = 0; c < chunks.size(); c++)
+	{
+		if (chunks[c].empty())
+			continue;
+		struct iovec v;
+		v.iov_base = (void *)chunks[c].data();
+		v.iov_len = chunks[c].size();
+		iov.push_back(v);
+	}
+
+	while (first < iov.size())
+	{
+		ssize_t written = writev(fd, &iov[first], min(iov.size() - first, (size_t)IOV_MAX));
+		if (written < 0){
+			if (errno == EINTR)
+				continue;
+			cerr << "Unable to write " << path << ": " << strerror(errno) << "\n";
+			return false;
+		}
+
+		/* Carry on from wherever a short write stopped */
+		while (first < iov.size() && (size_t)written >= iov[first].iov_len)
+		{
+			written -= iov[first].iov_len;
+			first++;
+		}
+		if (first < iov.size()){
+			iov[first].iov_base = (char *)iov[first].iov_base + written;
+			iov[first].iov_len -= written;
+		}
+	}
+	return true;
+}
+
+/* WRITE BUFFERS TO A GZIP FILE, COMPRESSING AS THEY GO */
+/*
+	To standard output each sector is a gzip member of its own, and
+	gunzip reads the members one after the other as one stream.
+*/
+bool
+writeCompressedChunks(const string &path, const vector<string> &chunks)
+{
+	gzFile out = ((path == "-") ? gzdopen(dup(STDOUT_FILENO), "wb") : gzopen(path.c_str(), "wb"));
+
+	if (out == NULL){
+		cerr << "Unable to write " << path << "\n";
+		return false;
+	}
+	gzbuffer(out, 256 * 1024);
+
+	for (size_t c = 0; c < chunks.size(); c++)
+	{
+		if (!chunks[c].empty() && gzwrite(out, chunks[c].data(), chunks[c].size()) == 0){
+			cerr << "Unable to write " << path << "\n";
+			gzclose(out);
+			return false;
+		}
+	}
+
+	return (gzclose(out) == Z_OK);
+}
+
+/* READ A SECTOR FILE, PLAIN OR GZIPPED, BACK INTO SYSTEMS */
+/*
+	The version line says which format the file is in, 0 if it has none.
+	Lines starting with '#' are skipped, as are lines with no UWP.
+*/
+bool
+readSectorFile(const string &path, int &outFormat, vector<generatedSystem> &systems)
+{
+	string text;
+	char buffer[64 * 1024];
+	int got;
+
+	/* gzread reads plain files as they are */
+	gzFile in = gzopen(path.c_str(), "rb");
+	if (in == NULL)
+		return false;
+	gzbuffer(in, 256 * 1024);
+	while ((got = gzread(in, buffer, sizeof(buffer))) > 0)
+		text.append(buffer, got);
+	gzclose(in);
+	if (got < 0)
+		return false;
+
+	parseSectorText(text, outFormat, systems);
+	return true;
+}
+
+/* READ THE TEXT OF A SECTOR FILE INTO SYSTEMS */
+void
+parseSectorText(const string &text, int &outFormat, vector<generatedSystem> &systems)
+{
+	outFormat = 0;
+	systems.clear();
+
+	istringstream lines(text);
+	string line;
+	while (getline (lines, line))
+	{
+		if (!line.empty() && line[line.size() - 1] == '\r')
+			line.erase(line.size() - 1);
+
+		if (line.compare(0, 10, "#Version: ") == 0){
+			for (int f = 1; f <= 6; f++)
+				if (line + "\n" == formatVersion(f))
+					outFormat = f;
+			continue;
+		}
+		if (line.empty() || line[0] == '#')
+			continue;
+
+		generatedSystem s;
+		if (parseSystemLine(line, outFormat, s))
+			systems.push_back(s);
+	}
+}
+
+/* GUNZIP BYTES HELD IN MEMORY */
+bool
+gunzipBytes(const char *bytes, size_t length, string &out)
+{
+	z_stream z;
+	char buffer[64 * 1024];
+	int status = Z_OK;
+
+	memset(&z, 0, sizeof(z));
+	/* 32 more window bits takes a gzip or zlib header */
+	if (inflateInit2(&z, 15 + 32) != Z_OK)
+		return false;
+
+	out.clear();
+	z.next_in = (Bytef *)bytes;
+	z.avail_in = length;
+	while (status == Z_OK)
+	{
+		z.next_out = (Bytef *)buffer;
+		z.avail_out = sizeof(buffer);
+		status = inflate(&z, Z_NO_FLUSH);
+		out.append(buffer, sizeof(buffer) - z.avail_out);
+	}
+
+	inflateEnd(&z);
+	return (status == Z_STREAM_END);
+}
+
+/* PARSE ONE LINE OF A SECTOR FILE, AS writeSystemLine() WROTE IT */
+/*
+	The formats are fixed-width, except that a long name, trade code
+	list or allegiance pushes the rest of the line along. So the line is
+	read from its UWP, and each field after the UWP from the end of the
+	one before: the trade codes as far as they go, the allegiance as one
+	word, the rest at their width.
+*/
+bool
+parseSystemLine(const string &line, int outFormat, generatedSystem &s)
+{
+	/* The fields after the UWP of each format, as the gap before the
+	   field, its width, and which field it is */
+	static const char layouts[7][7][3] = {
+		{{1, 1, 'b'}, {1, 25, 'c'}, {1, 1, 'z'}, {1, 3, 'p'}, {1, 2, 'a'}},			/* 2.5, the default */
+		{{2, 1, 'b'}, {1, 14, 'c'}, {1, 2, 'a'}, {1, 1, 'z'}},					/* 1.0 */
+		{{2, 1, 'b'}, {1, 14, 'c'}, {2, 1, 'z'}, {2, 3, 'p'}, {1, 2, 'a'}, {0, 16, 's'}},	/* 2.0 */
+		{{2, 1, 'b'}, {1, 14, 'c'}, {2, 1, 'z'}, {2, 3, 'p'}, {1, 2, 'a'}, {0, 16, 's'}},	/* 2.1 */
+		{{2, 12, 'c'}, {2, 3, 'p'}, {2, 1, 'b'}, {2, 2, 'a'}, {2, 1, 'z'}, {5, 20, 's'}},	/* 2.2 */
+		{{1, 1, 'b'}, {1, 15, 'c'}, {1, 3, 'p'}, {1, 2, 'a'}, {1, 1, 'z'}},			/* 2.3 */
+		{{1, 1, 'b'}, {1, 25, 'c'}, {1, 1, 'z'}, {1, 3, 'p'}, {1, 2, 'a'}}			/* 2.5 */
+	};
+	const char (*layout)[3] = layouts[(outFormat >= 1 && outFormat <= 6) ? outFormat : 0];
+
+	/* The UWP is the first "A123456-7" after a space, with any starport
+	   class a ruleset can give */
+	size_t uwp;
+	for (uwp = 1; uwp + 9 <= line.size(); uwp++)
+	{
+		if (line[uwp - 1] == ' ' && line[uwp] >= 'A' && line[uwp] <= 'Z' && line[uwp + 7] == '-'){
+			int d;
+			for (d = 1; d < 9 && (d == 7 || hexValue(line[uwp + d]) >= 0); d++)
+				;
+			if (d == 9)
+				break;
+		}
+	}
+	if (uwp + 9 > line.size())
+		return false;
+
+	s = generatedSystem();
+	s.UWP = line.substr(uwp, 9);
+	s.base = s.zone = ' ';
+	s.PBG = 0;
+	s.canon = false;
+	s.regionX = s.regionY = 0;
+
+	/* The hex comes first in 1.0 and 2.2, otherwise between the name and the UWP */
+	size_t hexAt = ((outFormat == 1 || outFormat == 4) ? 0 : uwp - 5);
+	if (uwp < 5 || line.size() < hexAt + 4 || line.substr(hexAt, 4).find_first_not_of("0123456789") != string::npos)
+		return false;
+	s.hex = atoi(line.substr(hexAt, 4).c_str());
+
+	if (outFormat == 4)
+		s.name = line.substr(6, uwp - 6);
+	else if (outFormat != 1)
+		s.name = line.substr(0, hexAt);
+	s.name.erase(s.name.find_last_not_of(" ") + 1);
+	s.name.erase(0, s.name.find_first_not_of(" "));
+
+	size_t pos = uwp + 9;
+	for (int f = 0; f < 7 && layout[f][1] != 0 && pos < line.size(); f++)
+	{
+		size_t start = pos + layout[f][0];
+		size_t width = layout[f][1];
+		size_t end = start;
+
+		if (start > line.size())
+			break;
+
+		if (layout[f][2] == 'c'){
+			/* Two letter codes, each with its space */
+			while (end + 3 <= line.size() && line[end + 2] == ' ' && tradeMask(line.substr(end, 2)) != 0)
+				end += 3;
+			s.codes = line.substr(start, end - start);
+		}else if (layout[f][2] == 'a'){
+			end = line.find(' ', start);
+			if (end == string::npos)
+				end = line.size();
+			s.allegiance = line.substr(start, end - start);
+		}else{
+			string field = line.substr(start, width);
+			if (layout[f][2] == 'b' && !field.empty())
+				s.base = field[0];
+			else if (layout[f][2] == 'z' && !field.empty())
+				s.zone = field[0];
+			else if (layout[f][2] == 'p')
+				s.PBG = atoi(field.c_str());
+			else if (layout[f][2] == 's'){
+				field.erase(field.find_last_not_of(" ") + 1);
+				s.stellar = field;
+			}
+		}
+		pos = max(start + width, end);
+	}
+	return true;
+}
+
+/* VERSION LINE THAT STARTS A SECTOR FILE OF THE GIVEN FORMAT */
+const char *
+formatVersion(int outFormat)
+{
+	switch(outFormat){
+	case 1:
+		return "#Version: 1.0\n";
+	case 2:
+		return "#Version: 2.0\n";
+	case 3:
+		return "#Version: 2.1\n";
+	case 4:
+		return "#Version: 2.2\n";
+	case 5:
+		return "#Version: 2.3\n";
+	case 6:
+		return "#Version: 2.5\n";
+	default:
+		/* default is set to 6 */
+		return "#Version: 2.5\n";
+	}
+}
+
+/* WRITE ONE SYSTEM AS A LINE OF THE GIVEN FORMAT, WITHOUT THE NEWLINE */
+void
+writeSystemLine(ostream &out, int outFormat, const generatedSystem &s)
+{
+	switch(outFormat){
+	case 1:
+		/* .sec v1.0: Original Standard UPP Format */
+		/* ----+----1----+----2----+----3----+----4----+----5----+----6----+----7----+----8 */
+		/* 0101 FAFAAZS-L b Ag Hi In Ri Wa Im z g r r                                       */
+		out << setw(4) << resetiosflags(ios::left) << setfill('0') << s.hex << " ";
+		out << setw(9) << setiosflags(ios::left) << s.UWP << "  ";
+		out << setw(1) << s.base << " ";
+		out << setw(14) << setfill(' ') << s.codes << " ";
+		out << setw(2) << s.allegiance << " ";
+		out << setw(1) << s.zone << " ";
+		out << setw(1) << resetiosflags(ios::left) << setfill('0') << s.PBG % 1 << " ";
+		break;
+	case 2:
+		/* .sec v2.0: New Standard UWP Format (GEnie)  */
+		/* ----+----1----+----2----+----3----+----4----+----5----+----6----+----7----+----8 */
+		/* systemname123 0101 FAFAAZS-L  b Ag Hi In Ri Wa  z  pbg Im stellardata12345       */
+		out << setw(13) << setiosflags(ios::left) << setfill(' ') << s.name << " ";
+		out << setw(4) << resetiosflags(ios::left) << setfill('0') << s.hex << " ";
+		out << setw(9) << setiosflags(ios::left) << s.UWP << "  ";
+		out << setw(1) << s.base << " ";
+		out << setw(14) << setfill(' ') << s.codes << "  ";
+		out << setw(1) << s.zone << "  ";
+		out << setw(3) << resetiosflags(ios::left) << setfill('0') << s.PBG << " ";
+		out << setw(2) << s.allegiance;
+		out << setw(16) << setiosflags(ios::left) << setfill(' ') << s.stellar;
+		break;
+	case 3:
+		/* .sec v2.1: Heaven & Earth/Galactic .sec*/
+		/* ----+----1----+----2----+----3----+----4----+----5----+----6----+----7----+----8 */
+		/* systemnamehere0101 FAFAAZS-L  b Ag Hi In Ri Wa  z  pbg Im stellardata12345       */
+		out << setw(14) << setiosflags(ios::left) << setfill(' ') << s.name;
+		out << setw(4) << resetiosflags(ios::left) << setfill('0') << s.hex << " ";
+		out << setw(9) << setiosflags(ios::left) << s.UWP << "  ";
+		out << setw(1) << s.base << " ";
+		out << setw(14) << setfill(' ') << s.codes << "  ";
+		out << setw(1) << s.zone << "  ";
+		out << setw(3) << resetiosflags(ios::left) << setfill('0') << s.PBG << " ";
+		out << setw(2) << s.allegiance;
+		out << setw(16) << setiosflags(ios::left) << setfill(' ') << s.stellar;
+		break;
+	case 4:
+		/* .sec v2.2: Heaven & Earth .hes*/
+		/* ----+----1----+----2----+----3----+----4----+----5----+----6----+----7----+----8----+ */
+		/* 0101  systemnamehere  FAFAAZS-L  Ag Hi In Ri   pbg  b  Im  z  s  stellardatagoeshere1 */
+		out << setw(4) << resetiosflags(ios::left) << setfill('0') << s.hex << "  ";
+		out << setw(14) << setiosflags(ios::left) << setfill(' ') << s.name << "  ";
+		out << setw(9) << setiosflags(ios::left) << s.UWP << "  ";
+		out << setw(12) << setfill(' ') << s.codes << "  ";
+		out << setw(3) << resetiosflags(ios::left) << setfill('0') << s.PBG << "  ";
+		out << setw(1) << s.base << "  ";
+		out << setw(2) << s.allegiance << "  ";
+		out << setw(1) << s.zone << "     ";
+		out << setw(20) << setiosflags(ios::left) << setfill(' ') << s.stellar;
+		break;
+	case 5:
+		/* .sec v2.3: gensec/mapsub v2) */
+		/* ----+----1----+----2----+----3----+----4----+----5----+----6----+----7----+----8 */
+		/* systemnamegoeshere 0101 FAFAAZS-L b Ag Hi In Ri Wa  pbg Im z                     */
+		out << setw(18) << setiosflags(ios::left) << setfill(' ') << s.name << " ";
+		out << setw(4) << resetiosflags(ios::left) << setfill('0') << s.hex << " ";
+		out << setw(9) << setiosflags(ios::left) << s.UWP << " ";
+		out << setw(1) << s.base << " ";
+		out << setw(15) << setfill(' ') << s.codes << " ";
+		out << setw(3) << resetiosflags(ios::left) << setfill('0') << s.PBG << " ";
+		out << setw(2) << s.allegiance << " ";
+		out << setw(1) << s.zone;
+		break;
+	case 6:
+		/* .sec v2.5: travellermap.com */
+		/* ----+----1----+----2----+----3----+----4----+----5----+----6----+----7----+----8 */
+		/* systemnameis25characters1 0101 FAFAAZS-L b Ag Hi In Ri Wa            z pbg Im    */
+		out << setw(25) << setiosflags(ios::left) << setfill(' ') << s.name << " ";
+		out << setw(4) << resetiosflags(ios::left) << setfill('0') << s.hex << " ";
+		out << setw(9) << setiosflags(ios::left) << s.UWP << " ";
+		out << setw(1) << s.base << " ";
+		out << setw(25) << setfill(' ') << s.codes << " ";
+		out << setw(1) << s.zone << " ";
+		out << setw(3) << resetiosflags(ios::left) << setfill('0') << s.PBG << " ";
+		out << setw(2) << s.allegiance;
+		break;
+	//case 7:
+		/* .sec v3.0: Sector XML */
+		/* Not Yet Implemented */
+        //cout << "XML format not yet implemented" << "\n";
+		//break;
+	default:
+		/* default is set to 6 */
+        /* .sec v2.5: travellermap.com */
+		/* ----+----1----+----2----+----3----+----4----+----5----+----6----+----7----+----8 */
+		/* systemnameis25characters1 0101 FAFAAZS-L b Ag Hi In Ri Wa            z pbg Im    */
+		out << setw(25) << setiosflags(ios::left) << setfill(' ') << s.name << " ";
+		out << setw(4) << resetiosflags(ios::left) << setfill('0') << s.hex << " ";
+		out << setw(9) << setiosflags(ios::left) << s.UWP << " ";
+		out << setw(1) << s.base << " ";
+		out << setw(25) << setfill(' ') << s.codes << " ";
+		out << setw(1) << s.zone << " ";
+		out << setw(3) << resetiosflags(ios::left) << setfill('0') << s.PBG << " ";
+		out << setw(2) << s.allegiance;
+		break;
+	}
+}
+
+/* TRAIN THE NAME GENERATOR ON A CORPUS OF NAMES */
+/*
+	The corpus is any file with a name at the start of each line, such
+	as a sectorName_names.txt file. Names are reduced to their letters
+	and counted as an order-2 Markov chain: the next letter, or the end
+	of the name, given the two before it. The counts are kept as
+	cumulative rows, so each letter is a single draw and a binary search.
+*/
+void
+loadNameModel(const string &corpusFile)
+{
+	string line;
+	int trained = 0;
+
+	ifstream inputFile(corpusFile.c_str());
+
+	if (!inputFile){
+		cerr << "Unable to open name corpus: " << corpusFile << "\n";
+		exit(1);
+	}
+
+	memset(nameGen.cumulative, 0, sizeof(nameGen.cumulative));
+
+	while (getline (inputFile, line))
+	{
+		string name;
+		istringstream words(line);
+		words >> name;
+
+		int prev2 = 0, prev1 = 0, letters = 0;
+		for (size_t i = 0; i < name.size(); i++)
+		{
+			if (!isalpha((unsigned char)name[i]))
+				continue;
+
+			int c = tolower(name[i]) - 'a' + 1;
+			nameGen.cumulative[prev2 * NAME_SYMBOLS + prev1][c]++;
+			prev2 = prev1;
+			prev1 = c;
+			letters++;
+		}
+
+		if (letters == 0)
+			continue;
+
+		nameGen.cumulative[prev2 * NAME_SYMBOLS + prev1][0]++;
+		nameGen.corpus.insert(name);
+		trained++;
+	}
+	inputFile.close();
+
+	if (trained == 0){
+		cerr << "Name corpus has no names: " << corpusFile << "\n";
+		exit(1);
+	}
+
+	for (int state = 0; state < NAME_STATES; state++)
+		for (int c = 1; c < NAME_SYMBOLS; c++)
+			nameGen.cumulative[state][c] += nameGen.cumulative[state][c - 1];
+}
+
+/* GENERATE A NEW NAME THAT FITS IN THE GIVEN WIDTH */
+string
+generateName(int maxLength, unordered_set<string> &used)
+{
+	char name[NAME_MAX_LENGTH + 1];
+
+	for (int tries = 0; tries < 100; tries++)
+	{
+		int prev2 = 0, prev1 = 0, length = 0;
+
+		for (;;)
+		{
+			const unsigned *row = nameGen.cumulative[prev2 * NAME_SYMBOLS + prev1];
+			unsigned total = row[NAME_SYMBOLS - 1];
+			if (total == 0)
+				break;
+
+			unsigned r = (unsigned)(nextRandom() % total);
+			int c = upper_bound(row, row + NAME_SYMBOLS, r) - row;
+			if (c == 0)
+				break;
+			if (length == maxLength){
+				length = maxLength + 1;	/* Too long, start again */
+				break;
+			}
+
+			name[length] = ((length == 0) ? 'A' : 'a') + c - 1;
+			length++;
+			prev2 = prev1;
+			prev1 = c;
+		}
+
+		if (length < 3 || length > maxLength)
+			continue;
+
+		string result(name, length);
+		if (nameGen.corpus.count(result) == 0 && used.insert(result).second)
+			return result;
+	}
+	return "Unnamed";
+}
+
+/* WIDEST NAME EACH OUTPUT FORMAT HAS ROOM FOR */
+int
+nameWidth(int outFormat)
+{
+	int width;
+
+	switch(outFormat){
+	case 2:
+		width = 13;
+		break;
+	case 3:
+	case 4:
+		width = 14;
+		break;
+	case 5:
+		width = 18;
+		break;
+	default:
+		width = 25;
+		break;
+	}
+	return min(width, NAME_MAX_LENGTH);
+}
+
+/* NAME EVERY SYSTEM THE NAMES FILE DID NOT COVER */
+void
+nameUnnamedSystems()
+{
+	int width = nameWidth(options.outputFormat);
+
+	/* Names already in the region are not reused */
+	for (size_t i = 0; i < regionSys.size(); i++)
+		nameGen.used.insert(regionSys[i].name);
+
+	/* Each name comes from its hex's own stream, so a hex generated on
+	   its own gets the same name unless it was taken first in a full run */
+	for (size_t i = 0; i < regionSys.size(); i++)
+	{
+		if (regionSys[i].name == "Unnamed"){
+			seedHex(regionSys[i].regionX / SECTOR_COLS, regionSys[i].regionY / SECTOR_ROWS,
+				regionSys[i].hex, SEED_NAME);
+			regionSys[i].name = generateName(width, nameGen.used);
+		}
+	}
+}
+
+/* RUN THE JOBS OF A MANIFEST FILE */
+/*
+	Each line of the manifest is the command line of one job, as it
+	would be typed after gensec4, "#" starting a comment. A job makes
+	one sector file; the passes over a whole region are left to runs of
+	their own. The jobs are shared out in runs of neighbouring lines
+	across the worker threads, and a thread that runs out takes jobs
+	from the far end of another thread's run. A job that fails is
+	reported and the rest carry on.
+*/
+int
+runManifest(const string &manifestFile)
+{
+	jobBatch batch;
+	string line;
+	int number = 0;
+
+	ifstream inputFile(manifestFile.c_str());
+
+	if (!inputFile){
+		cerr << "Unable to open manifest: " << manifestFile << "\n";
+		return 1;
+	}
+
+	while (getline (inputFile, line))
+	{
+		number++;
+		if (!line.empty() && line[line.size() - 1] == '\r')
+			line.erase(line.size() - 1);
+
+		size_t start = line.find_first_not_of(" \t");
+		if (start == string::npos || line[start] == '#')
+			continue;
+		batch.lines.push_back(line);
+		batch.lineNumbers.push_back(number);
+	}
+
+	int numJobs = batch.lines.size();
+	int numThreads = max(1, min(options.threads, numJobs));
+
+	for (int i = 0; i < numThreads; i++)
+		batch.queues.push_back(shared_ptr<jobDeque>(new jobDeque));
+	for (int j = 0; j < numJobs; j++)
+		batch.queues[(long long)j * numThreads / numJobs]->jobs.push_back(j);
+
+	batch.finished = 0;
+	batch.failed = 0;
+	batch.report = report;
+
+	/* This thread works on jobs too, and each job changes its settings */
+	jobSettings settings;
+	saveJobSettings(settings);
+
+	vector<thread> workers;
+	for (int i = 1; i < numThreads; i++)
+		workers.push_back(thread(manifestWorker, &batch, i));
+	manifestWorker(&batch, 0);
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i].join();
+
+	loadJobSettings(settings);
+
+	*report << "Manifest: " << numJobs << " jobs, " << batch.failed << " failed\n";
+
+	if (!diskCache.dir.empty())
+		trimSectorCache();
+
+	return (batch.failed > 0 ? 1 : 0);
+}
+
+/* RUN JOBS OF A MANIFEST UNTIL NONE ARE LEFT ANYWHERE */
+void
+manifestWorker(jobBatch *batch, int self)
+{
+	int numQueues = batch->queues.size();
+
+	for (;;)
+	{
+		int job = -1;
+
+		/* Our own jobs first, the latest queued first */
+		{
+			jobDeque &own = *batch->queues[self];
+			lock_guard<mutex> hold(own.lock);
+			if (!own.jobs.empty()){
+				job = own.jobs.back();
+				own.jobs.pop_back();
+			}
+		}
+
+		/* Then steal the oldest job of another worker */
+		for (int k = 1; k < numQueues && job < 0; k++)
+		{
+			jobDeque &other = *batch->queues[(self + k) % numQueues];
+			lock_guard<mutex> hold(other.lock);
+			if (!other.jobs.empty()){
+				job = other.jobs.front();
+				other.jobs.pop_front();
+			}
+		}
+
+		/* No jobs are added once the batch starts, so none anywhere means done */
+		if (job < 0)
+			return;
+
+		string result;
+		bool ok;
+		try {
+			ok = runJob(batch->lines[job], result);
+		} catch (const exception &e) {
+			ok = false;
+			result = e.what();
+		}
+
+		lock_guard<mutex> hold(batch->reportLock);
+		batch->finished++;
+		if (!ok)
+			batch->failed++;
+		*batch->report << "[" << batch->finished << "/" << batch->lines.size() << "] line " <<
+			batch->lineNumbers[job] << (ok ? ": " : " failed: ") << result << "\n" << flush;
+	}
+}
+
+/* RUN ONE JOB OF A MANIFEST ON THIS THREAD */
+bool
+runJob(const string &line, string &result)
+{
+	vector<string> args;
+	vector<char *> argv;
+	ostringstream log;
+	const char *unsupported = NULL;
+
+	if (!splitCommandLine(line, args)){
+		result = "unbalanced quotes";
+		return false;
+	}
+
+	argv.push_back((char *)"gensec4");
+	for (size_t i = 0; i < args.size(); i++)
+		argv.push_back(&args[i][0]);
+	argv.push_back(NULL);
+
+	/* Every job starts from the defaults, and keeps its messages to itself */
+	options = optionValues();
+	density = 50;
+	maturity = 3;
+	report = &log;
+	if (!getOptions(argv.size() - 1, argv.data(), result))
+		return false;
+
+	if (!options.diffOld.empty())
+		unsupported = "diff";
+	else if (options.sectorName.empty())
+		unsupported = "a job without options";
+	else if (options.regionCols > 1 || options.regionRows > 1)
+		unsupported = "--region";
+	else if (options.polities >= 0)
+		unsupported = "--polities";
+	else if (!options.route.empty())
+		unsupported = "--route";
+	else if (options.tradeJump > 0)
+		unsupported = "--trade";
+	else if (options.xboat)
+		unsupported = "--xboat";
+	else if (!options.nameCorpusPath.empty())
+		unsupported = "--nameCorpus";
+	else if (!options.hex.empty())
+		unsupported = "--hex";
+	else if (!options.constraints.empty())
+		unsupported = "--constrain";
+	else if (!options.query.empty())
+		unsupported = "--query";
+	else if (options.archive)
+		unsupported = "--archive";
+	else if (!options.svg.empty())
+		unsupported = "--svg";
+	else if (!options.heatmap.empty())
+		unsupported = "--heatmap";
+	else if (options.asciiMap)
+		unsupported = "--map";
+	else if (options.years > 0)
+		unsupported = "--years";
+	else if (!options.scanPath.empty())
+		unsupported = "--scan";
+	else if (options.galaxy)
+		unsupported = "--galaxy";
+	else if (options.resume)
+		unsupported = "--resume";
+	else if (options.checkpointGiven)
+		unsupported = "--checkpoint";
+	else if (options.pack)
+		unsupported = "--pack";
+	else if (!options.unpackPath.empty())
+		unsupported = "--unpack";
+	else if (!options.entry.empty())
+		unsupported = "--entry";
+	else if (options.watch)
+		unsupported = "--watch";
+	else if (options.update)
+		unsupported = "--update";
+	else if (!options.manifestPath.empty())
+		unsupported = "--manifest";
+	else if (!options.rulesFilePath.empty())
+		unsupported = "--rules, give it for the whole manifest";
+	else if (!options.cacheDir.empty())
+		unsupported = "--cacheDir, give it for the whole manifest";
+	else if (options.outputPath == "-" || options.namesFilePath == "-")
+		unsupported = "standard input or output";
+
+	if (unsupported != NULL){
+		result = string("not in a manifest job: ") + unsupported;
+		return false;
+	}
+
+	/* The manifest's worker threads are the parallelism */
+	options.threads = 1;
+
+	sectorData sec;
+	vector<generatedSystem> systems;
+	vector<string> chunks;
+
+	string key;
+	ostringstream done;
+
+	placeSector(0, 0, sec);
+	if (!diskCache.dir.empty()){
+		key = sectorCacheKey(sec);
+		if (fetchCachedSector(key, sec.outputPath)){
+			result = sec.name + ", from the cache, " + sec.outputPath;
+			return true;
+		}
+	}
+
+	sec.first = 0;
+	sec.count = generateSectorSystems(0, 0, sec.name, systems);
+
+	formatSectorFile(options.outputFormat, sec, systems.data(), chunks);
+	if (!writeOutputFile(sec.outputPath, chunks)){
+		result = "unable to write " + sec.outputPath;
+		return false;
+	}
+	if (!key.empty())
+		storeCachedSector(key, sec.outputPath);
+
+	done << sec.name << ", " << sec.count << " systems, seed " << options.seed << ", " << sec.outputPath;
+	result = done.str();
+	return true;
+}
+
+/* SPLIT A COMMAND LINE INTO WORDS, KEEPING "QUOTED WORDS" WHOLE */
+bool
+splitCommandLine(const string &line, vector<string> &args)
+{
+	string word;
+	bool quoted = false;
+	bool inWord = false;
+
+	for (size_t i = 0; i < line.size(); i++)
+	{
+		char c = line[i];
+
+		if (c == '"'){
+			quoted = !quoted;
+			inWord = true;
+		}else if (!quoted && (c == ' ' || c == '\t')){
+			if (inWord)
+				args.push_back(word);
+			word.clear();
+			inWord = false;
+		}else{
+			word += c;
+			inWord = true;
+		}
+	}
+	if (inWord)
+		args.push_back(word);
+
+	return !quoted;
+}
+
+/* KEY OF A SECTOR IN THE SECTOR CACHE */
+/*
+	A sector file depends on the seed, where the sector is, its name,
+	what is in its names file, the density, maturity, allegiance,
+	subsector, constraints, format and compression, and on the tables
+	of the ruleset. The key is a 128 bit hash of all of them, so a
+	change to any one makes a new entry rather than a stale hit.
+*/
+string
+sectorCacheKey(const sectorData &sec)
+{
+	ostringstream inputs;
+	string names = "<none>";
+
+	if (options.namesFilePath == "-"){
+		map<string, string>::const_iterator found = namesInput.find(sec.name);
+		if (found != namesInput.end())
+			names = found->second;
+	}else{
+		ifstream inputFile((options.namesFilePath + sec.name + "_names.txt").c_str());
+		if (inputFile){
+			ostringstream text;
+			text << inputFile.rdbuf();
+			names = text.str();
+		}
+	}
+
+	inputs << "gensec4 sector 1\n" << options.seed << "\n" << sec.secX << " " << sec.secY << "\n" <<
+		sec.name << "\n" << density << " " << maturity << "\n" << options.allegience << "\n" <<
+		options.subsecLetter << "\n" << options.constraints << "\n" << options.outputFormat << " " <<
+		options.compress << "\n";
+	inputs.write((const char *)&rules, sizeof(rules));
+	inputs << names;
+
+	string text = inputs.str();
+	char key[33];
+	snprintf(key, sizeof(key), "%016llx%016llx", hashText(0xcbf29ce484222325ULL, text),
+		hashText(0x84222325cbf29ce4ULL, text));
+	return key;
+}
+
+/* PATH OF A SECTOR FILE IN THE CACHE, UNDER THE FIRST TWO DIGITS OF ITS KEY */
+string
+sectorCachePath(const string &key)
+{
+	return diskCache.dir + "/" + key.substr(0, 2) + "/" + key + (options.compress ? ".sec.gz" : ".sec");
+}
+
+/* COPY A SECTOR FILE FROM THE CACHE, IF IT IS THERE */
+bool
+fetchCachedSector(const string &key, const string &outPath)
+{
+	string path = sectorCachePath(key);
+	string temp = outPath + ".tmp";
+
+	if (access(path.c_str(), R_OK) != 0)
+		return false;
+
+	/* Under a temporary name first, as writeOutputFile() does */
+	if (!copyFile(path, temp) || rename(temp.c_str(), outPath.c_str()) != 0){
+		unlink(temp.c_str());
+		return false;
+	}
+
+	/* Touch it, so the least recently used files are trimmed first */
+	utimensat(AT_FDCWD, path.c_str(), NULL, 0);
+
+	diskCache.hits++;
+	*report << "Output file: " << outPath << " (cached)\n";
+	return true;
+}
+
+/* KEEP A COPY OF A NEW SECTOR FILE IN THE CACHE */
+/*
+	The copy is made under a temporary name and renamed into place, so
+	other runs sharing the cache never see half a file.
+*/
+void
+storeCachedSector(const string &key, const string &outPath)
+{
+	string path = sectorCachePath(key);
+	ostringstream temp;
+
+	mkdir(diskCache.dir.c_str(), 0777);
+	mkdir(path.substr(0, path.rfind('/')).c_str(), 0777);
+
+	temp << path << ".tmp." << getpid() << "." << hash<thread::id>()(this_thread::get_id());
+	if (!copyFile(outPath, temp.str()) || rename(temp.str().c_str(), path.c_str()) != 0){
+		unlink(temp.str().c_str());
+		return;
+	}
+	diskCache.stored++;
+}
+
+/* TRIM THE CACHE BACK TO ITS BUDGET, LEAST RECENTLY USED FILES FIRST */
+void
+trimSectorCache()
+{
+	vector<pair<time_t, pair<long long, string> > > files;
+	long long total = 0;
+
+	DIR *top = opendir(diskCache.dir.c_str());
+	if (top == NULL)
+		return;
+
+	struct dirent *sub;
+	while ((sub = readdir(top)) != NULL)
+	{
+		if (sub->d_name[0] == '.')
+			continue;
+
+		string subPath = diskCache.dir + "/" + sub->d_name;
+		DIR *dir = opendir(subPath.c_str());
+		if (dir == NULL)
+			continue;
+
+		struct dirent *entry;
+		while ((entry = readdir(dir)) != NULL)
+		{
+			struct stat info;
+			string path = subPath + "/" + entry->d_name;
+
+			if (entry->d_name[0] == '.' || stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+				continue;
+			files.push_back(make_pair(info.st_mtime, make_pair((long long)info.st_size, path)));
+			total += info.st_size;
+		}
+		closedir(dir);
+	}
+	closedir(top);
+
+	sort(files.begin(), files.end());
+	for (size_t i = 0; i < files.size() && total > diskCache.budget; i++)
+	{
+		if (unlink(files[i].second.second.c_str()) == 0)
+			total -= files[i].second.first;
+	}
+
+	*report << "Cache: " << diskCache.hits << " copied, " << diskCache.stored << " stored, " <<
+		total / 1024 << "K in " << diskCache.dir << "\n";
+}
+
+/* COPY A FILE, SHARING ITS BLOCKS WHERE THE FILE SYSTEM CAN */
+/*
+	A reflink costs nothing on btrfs or XFS. Elsewhere copy_file_range()
+	copies inside the kernel, and a plain read and write loop is left
+	for when neither works.
+*/
+bool
+copyFile(const string &from, const string &to)
+{
+	int in = open(from.c_str(), O_RDONLY);
+	if (in < 0)
+		return false;
+
+	int out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out < 0){
+		cerr << "Unable to write " << to << ": " << strerror(errno) << "\n";
+		close(in);
+		return false;
+	}
+
+	bool ok = (ioctl(out, FICLONE, in) == 0);
+
+	if (!ok){
+		ssize_t got;
+		while ((got = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) > 0)
+			;
+		ok = (got == 0);
+	}
+
+	if (!ok && lseek(in, 0, SEEK_SET) == 0 && ftruncate(out, 0) == 0 && lseek(out, 0, SEEK_SET) == 0){
+		vector<char> buffer(1 << 20);
+		ssize_t got;
+
+		ok = true;
+		while (ok && (got = read(in, buffer.data(), buffer.size())) != 0)
+		{
+			if (got < 0){
+				ok = (errno == EINTR);
+				continue;
+			}
+			for (ssize_t done = 0; ok && done < got; )
+			{
+				ssize_t put = write(out, buffer.data() + done, got - done);
+				if (put > 0)
+					done += put;
+				else
+					ok = (put < 0 && errno == EINTR);
+			}
+		}
+	}
+
+	close(in);
+	if (close(out) != 0)
+		ok = false;
+	return ok;
+}
+
+/* HASH A STRING, FNV-1a FROM THE START GIVEN, THEN SCRAMBLED */
+unsigned long long
+hashText(unsigned long long h, const string &text)
+{
+	for (size_t i = 0; i < text.size(); i++)
+	{
+		h ^= (unsigned char)text[i];
+		h *= 0x100000001b3ULL;
+	}
+	return mixBits(h);
+}
+
+/* START WRITING THE SECTOR FILES OF THE RUN INTO ONE PACK */
+/*
+	A pack is PACK_MAGIC, then each sector file as it would have been
+	written on its own, gzipped with --compress, then the index. Each
+	index entry is the sector position, offset and length of its file,
+	format, whether it is gzipped, and its name. The last PACK_FOOTER
+	bytes are the offset and length of the index and PACK_MAGIC again,
+	so a reader maps the file, reads the footer and index, and finds
+	any sector without looking at the others.
+*/
+void
+startPack()
+{
+	if (options.outputPath == "-"){
+		cerr << "A pack is written to a file, not standard output\n";
+		exit(1);
+	}
+
+	if (options.regionCols > 1 || options.regionRows > 1)
+		pack.path = options.outputPath + options.sectorName + ".gsp";
+	else
+		pack.path = regionFilePath(".gsp");
+	pack.temp = pack.path + ".tmp";
+
+	pack.fd = open(pack.temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (pack.fd < 0){
+		cerr << "Unable to write " << pack.path << ": " << strerror(errno) << "\n";
+		exit(1);
+	}
+
+	vector<string> header(1, PACK_MAGIC);
+	writeChunksTo(pack.fd, pack.temp, header);
+	pack.offset = 8;
+
+	*report << "Pack file: " << pack.path << "\n";
+}
+
+/* ADD A SECTOR FILE TO THE END OF THE PACK */
+bool
+packSectorFile(int secX, int secY, const string &path, const vector<string> &chunks)
+{
+	packEntry entry;
+	vector<string> gzipped(1);
+	const vector<string> *bytes = &chunks;
+
+	if (options.compress){
+		if (!gzipChunks(chunks, gzipped[0]))
+			return false;
+		bytes = &gzipped;
+	}
+
+	entry.secX = secX;
+	entry.secY = secY;
+	entry.length = 0;
+	for (size_t c = 0; c < bytes->size(); c++)
+		entry.length += (*bytes)[c].size();
+	entry.outFormat = options.outputFormat;
+	entry.compressed = options.compress;
+	entry.name = path.substr(path.rfind('/') + 1);
+
+	lock_guard<mutex> hold(pack.lock);
+
+	if (!writeChunksTo(pack.fd, pack.temp, *bytes))
+		return false;
+	entry.offset = pack.offset;
+	pack.offset += entry.length;
+	pack.index.push_back(entry);
+	return true;
+}
+
+/* WRITE THE INDEX AT THE END OF THE PACK AND PUT IT IN PLACE */
+bool
+finishPack()
+{
+	string index;
+
+	putArchiveInt(index, pack.index.size(), 4);
+	for (size_t i = 0; i < pack.index.size(); i++)
+	{
+		const packEntry &entry = pack.index[i];
+
+		putArchiveInt(index, entry.secX, 4);
+		putArchiveInt(index, entry.secY, 4);
+		putArchiveInt(index, entry.offset, 8);
+		putArchiveInt(index, entry.length, 8);
+		putArchiveInt(index, entry.outFormat, 1);
+		putArchiveInt(index, entry.compressed, 1);
+		putArchiveInt(index, entry.name.size(), 2);
+		index += entry.name;
+	}
+	putArchiveInt(index, pack.offset, 8);
+	putArchiveInt(index, index.size() - 8, 8);
+	index += PACK_MAGIC;
+
+	vector<string> chunks(1, index);
+	bool ok = writeChunksTo(pack.fd, pack.temp, chunks);
+
+	if (close(pack.fd) != 0)
+		ok = false;
+	pack.fd = -1;
+
+	if (!ok || rename(pack.temp.c_str(), pack.path.c_str()) != 0){
+		cerr << "Unable to write " << pack.path << "\n";
+		unlink(pack.temp.c_str());
+		return false;
+	}
+	return true;
+}
+
+/* GZIP BUFFERS INTO ONE STRING, AS A .gz FILE OF THEM WOULD HOLD */
+bool
+gzipChunks(const vector<string> &chunks, string &out)
+{
+	z_stream z;
+	char buffer[64 * 1024];
+	int status = Z_OK;
+
+	memset(&z, 0, sizeof(z));
+	/* 16 more window bits asks for a gzip header and trailer */
+	if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return false;
+
+	out.clear();
+	for (size_t c = 0; c <= chunks.size() && status != Z_STREAM_END; c++)
+	{
+		bool last = (c == chunks.size());
+
+		z.next_in = (Bytef *)(last ? NULL : chunks[c].data());
+		z.avail_in = (last ? 0 : chunks[c].size());
+		do {
+			z.next_out = (Bytef *)buffer;
+			z.avail_out = sizeof(buffer);
+			status = deflate(&z, last ? Z_FINISH : Z_NO_FLUSH);
+			out.append(buffer, sizeof(buffer) - z.avail_out);
+		} while (z.avail_out == 0);
+	}
+
+	deflateEnd(&z);
+	return (status == Z_STREAM_END);
+}
+
+/* MAP A SECTOR PACK AND READ ITS INDEX */
+bool
+openPack(const string &path, packReader &reader)
+{
+	struct stat info;
+	int fd = open(path.c_str(), O_RDONLY);
+
+	if (fd < 0 || fstat(fd, &info) != 0 || info.st_size < 8 + PACK_FOOTER){
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+
+	reader.size = info.st_size;
+	void *mapped = mmap(NULL, reader.size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED)
+		return false;
+	reader.base = (const char *)mapped;
+
+	if (!readPackIndex(reader)){
+		munmap(mapped, reader.size);
+		return false;
+	}
+	return true;
+}
+
+/* CHECK THE FOOTER OF A MAPPED PACK AND READ ITS INDEX */
+/*
+	The entry names become file names for --entry all, so one that
+	could reach outside the --outPath directory makes it no pack.
+*/
+bool
+readPackIndex(packReader &reader)
+{
+	const char *p = reader.base + reader.size - PACK_FOOTER;
+	long long indexOffset = getArchiveInt(p, 8);
+	long long indexLength = getArchiveInt(p, 8);
+
+	if (memcmp(reader.base, PACK_MAGIC, 8) != 0 || memcmp(p, PACK_MAGIC, 8) != 0 ||
+	    indexOffset < 8 || indexLength < 4 || indexOffset + indexLength + 16 != (long long)reader.size - 8)
+		return false;
+
+	/* The index runs up to the footer */
+	p = reader.base + indexOffset;
+	const char *end = p + indexLength;
+	long long count = getArchiveInt(p, 4);
+
+	for (long long i = 0; i < count; i++)
+	{
+		packEntry entry;
+
+		if (end - p < 28)
+			return false;
+		entry.secX = getArchiveInt(p, 4);
+		entry.secY = getArchiveInt(p, 4);
+		entry.offset = getArchiveInt(p, 8);
+		entry.length = getArchiveInt(p, 8);
+		entry.outFormat = getArchiveInt(p, 1);
+		entry.compressed = (getArchiveInt(p, 1) != 0);
+
+		long long size = getArchiveInt(p, 2);
+		if (end - p < size || entry.offset < 8 || entry.length < 0 || entry.offset + entry.length > indexOffset)
+			return false;
+		entry.name.assign(p, size);
+		p += size;
+
+		if (entry.name.empty() || entry.name == "." || entry.name.find('/') != string::npos ||
+		    entry.name.find("..") != string::npos)
+			return false;
+
+		reader.index.push_back(entry);
+	}
+	return true;
+}
+
+/* LIST THE SECTORS OF A PACK, OR WRITE OUT THE ONES ASKED FOR */
+/*
+	--entry picks a sector by "x,y", by name with or without its
+	extension, or "all". One entry goes to standard output unless
+	--outPath names a file; all of them go into the --outPath directory
+	under their own names.
+*/
+void
+unpackSectors()
+{
+	packReader reader;
+
+	if (!openPack(options.unpackPath, reader)){
+		cerr << "Not a sector pack: " << options.unpackPath << "\n";
+		exit(1);
+	}
+
+	if (options.entry.empty()){
+		for (size_t i = 0; i < reader.index.size(); i++)
+		{
+			const packEntry &entry = reader.index[i];
+			cout << setw(4) << entry.secX << " " << setw(4) << entry.secY << "  " <<
+				setw(26) << setiosflags(ios::left) << entry.name << resetiosflags(ios::left) << " " <<
+				string(formatVersion(entry.outFormat)).substr(10, 3) << " " << setw(10) << entry.length << "\n";
+		}
+		munmap((void *)reader.base, reader.size);
+		return;
+	}
+
+	bool all = (options.entry == "all");
+	string dir = options.outputPath;
+	int found = 0;
+
+	if (all && (dir == "-" || dir.empty()))
+		dir = "./";
+	else if (all && dir[dir.size() - 1] != '/')
+		dir += "/";
+
+	for (size_t i = 0; i < reader.index.size(); i++)
+	{
+		const packEntry &entry = reader.index[i];
+		ostringstream position;
+		position << entry.secX << "," << entry.secY;
+
+		if (!all && options.entry != entry.name && options.entry != position.str() &&
+		    options.entry != entry.name.substr(0, entry.name.find('.')))
+			continue;
+
+		/* Straight from the mapping, one entry is a single read of the file */
+		vector<string> chunks(1, string(reader.base + entry.offset, entry.length));
+		string path = (all ? dir + entry.name : options.outputPath);
+		if (!(path == "-" ? writeChunks(path, chunks) : writeOutputFile(path, chunks))){
+			munmap((void *)reader.base, reader.size);
+			exit(1);
+		}
+		found++;
+	}
+	munmap((void *)reader.base, reader.size);
+
+	if (found == 0){
+		cerr << "No entry " << options.entry << " in " << options.unpackPath << "\n";
+		exit(1);
+	}
+}
+
+/* BRING THE WRITTEN SECTOR FILES UP TO DATE WITH THEIR NAMES FILES */
+/*
+	Every hex is rolled from the seed and its own position, so a names
+	file edit only changes the hexes it names or stops naming. Each
+	sector file is compared with its names file, and only those hexes
+	are rolled again. The files themselves record the previous names:
+	a hex named there but no longer in the names file lost its name.
+*/
+void
+updateSectors()
+{
+	if (!options.seedGiven){
+		cerr << "--update needs the --seed of the run that wrote the files\n";
+		exit(1);
+	}
+	if (options.outputPath == "-" || options.pack || options.compress || options.namesFilePath == "-"){
+		cerr << "--update patches plain sector files, with names files read from disk\n";
+		exit(1);
+	}
+	if (options.polities >= 0 || !options.nameCorpusPath.empty()){
+		cerr << "--update can't follow --polities or --nameCorpus, which change the names of other hexes\n";
+		exit(1);
+	}
+	if (options.years > 0){
+		cerr << "--update can't follow --years, which changes every world with its neighbours\n";
+		exit(1);
+	}
+
+	for (int secY = 0; secY < options.regionRows; secY++)
+		for (int secX = 0; secX < options.regionCols; secX++)
+			updateSector(secX, secY);
+}
+
+/* UPDATE ONE SECTOR FILE, IN PLACE IF NO LINE CHANGES LENGTH */
+/*
+	The formats are fixed width, so a changed name usually leaves its
+	line the same length and the new line is written over the old one.
+	A hex that gains or loses its system, or a name too long for its
+	column, means the file is written again, from the lines already
+	there and the ones rolled again. A missing file, or one in another
+	format, is generated whole.
+*/
+bool
+updateSector(int secX, int secY)
+{
+	sectorData sec;
+	string text;
+	vector<string> lines;
+	vector<long long> offsets;
+	map<int, int> lineOfHex;
+	map<int, starSystem> named;
+	int outFormat = -1;
+
+	placeSector(secX, secY, sec);
+	readNamesFile(sec.name);
+	namedHexes(named);
+
+	/* The file as written, a line at a time with where each starts */
+	int fd = open(sec.outputPath.c_str(), O_RDONLY);
+	if (fd >= 0){
+		char buffer[64 * 1024];
+		ssize_t got;
+		while ((got = read(fd, buffer, sizeof(buffer))) > 0)
+			text.append(buffer, got);
+		close(fd);
+	}
+
+	for (size_t start = 0; start < text.size(); )
+	{
+		size_t end = text.find('\n', start);
+		if (end == string::npos)
+			end = text.size();
+		lines.push_back(text.substr(start, end - start));
+		offsets.push_back(start);
+		start = end + 1;
+	}
+
+	if (!lines.empty())
+		for (int f = 1; f <= 6; f++)
+			if (lines[0] + "\n" == formatVersion(f))
+				outFormat = f;
+
+	if (outFormat != options.outputFormat){
+		/* Nothing to patch, so generate it all */
+		vector<generatedSystem> systems;
+		vector<string> chunks;
+
+		sec.first = 0;
+		sec.count = generateSectorSystems(secX, secY, sec.name, systems);
+		formatSectorFile(options.outputFormat, sec, systems.data(), chunks);
+		*report << "Output file: " << sec.outputPath << ", generated\n";
+		return writeOutputFile(sec.outputPath, chunks);
+	}
+
+	vector<int> hexOfLine(lines.size(), -1);
+	for (size_t i = 1; i < lines.size(); i++)
+	{
+		generatedSystem s;
+		if (parseSystemLine(lines[i], outFormat, s)){
+			lineOfHex[s.hex] = i;
+			hexOfLine[i] = s.hex;
+		}
+	}
+
+	/* The hexes named now, and those named before */
+	set<int> hexes;
+	for (map<int, starSystem>::const_iterator n = named.begin(); n != named.end(); n++)
+		hexes.insert(n->first);
+	for (map<int, int>::const_iterator l = lineOfHex.begin(); l != lineOfHex.end(); l++)
+	{
+		generatedSystem s;
+		parseSystemLine(lines[l->second], outFormat, s);
+		if (s.name != "Unnamed")
+			hexes.insert(l->first);
+	}
+
+	map<int, string> changed;	/* New line of each changed hex, empty if it has no system now */
+	bool inPlace = true;
+
+	for (set<int>::const_iterator h = hexes.begin(); h != hexes.end(); h++)
+	{
+		map<int, starSystem>::const_iterator n = named.find(*h);
+		map<int, int>::const_iterator l = lineOfHex.find(*h);
+		string hexName = ((n == named.end()) ? "" : n->second.starName);
+		string ali = ((n == named.end() || n->second.allegiance.empty()) ? options.allegience : n->second.allegiance);
+		generatedSystem world;
+		ostringstream line;
+
+		if (generateHex(secX, secY, *h / 100, *h % 100, hexName, ali, world))
+			writeSystemLine(line, outFormat, world);
+
+		string old = ((l == lineOfHex.end()) ? "" : lines[l->second]);
+		if (line.str() == old)
+			continue;
+
+		changed[*h] = line.str();
+		if (old.size() != line.str().size() || old.empty())
+			inPlace = false;
+	}
+
+	if (changed.empty()){
+		*report << "Output file: " << sec.outputPath << ", unchanged\n";
+		return true;
+	}
+
+	if (inPlace){
+		fd = open(sec.outputPath.c_str(), O_WRONLY);
+		bool ok = (fd >= 0);
+
+		for (map<int, string>::const_iterator c = changed.begin(); ok && c != changed.end(); c++)
+		{
+			long long at = offsets[lineOfHex[c->first]];
+			ok = (pwrite(fd, c->second.data(), c->second.size(), at) == (ssize_t)c->second.size());
+		}
+		if (fd >= 0 && close(fd) != 0)
+			ok = false;
+		if (!ok){
+			cerr << "Unable to write " << sec.outputPath << ": " << strerror(errno) << "\n";
+			return false;
+		}
+		*report << "Output file: " << sec.outputPath << ", " << changed.size() << " hexes changed in place\n";
+		return true;
+	}
+
+	/* Merge the new lines into the file in hex order. Every line that is
+	   not a system, or that could not be read as one, stays where it was */
+	map<int, string> added;
+	for (map<int, string>::const_iterator c = changed.begin(); c != changed.end(); c++)
+		if (lineOfHex.count(c->first) == 0)
+			added[c->first] = c->second;
+
+	vector<string> kept;
+	map<int, string>::const_iterator next = added.begin();
+	for (size_t i = 1; i < lines.size(); i++)
+	{
+		int hex = hexOfLine[i];
+
+		if (hex < 0 || lineOfHex[hex] != (int)i){
+			kept.push_back(lines[i]);
+			continue;
+		}
+		for (; next != added.end() && next->first < hex; next++)
+			kept.push_back(next->second);
+
+		map<int, string>::const_iterator c = changed.find(hex);
+		if (c == changed.end())
+			kept.push_back(lines[i]);
+		else if (!c->second.empty())
+			kept.push_back(c->second);
+	}
+	for (; next != added.end(); next++)
+		kept.push_back(next->second);
+
+	vector<string> chunks(1, formatVersion(outFormat));
+	for (size_t k = 0; k < kept.size(); k++)
+	{
+		if (k > 0)
+			chunks.back() += "\n";
+		chunks.push_back(kept[k]);
+	}
+
+	*report << "Output file: " << sec.outputPath << ", " << changed.size() << " hexes changed, rewritten\n";
+	return writeOutputFile(sec.outputPath, chunks);
+}
+
+/* THE NAMES FILE ENTRIES hexIterate() WOULD USE, BY HEX */
+/*
+	hexIterate() walks the hexes in order and takes the next line of the
+	names file when it reaches its hex, so entries out of order are
+	passed over here just as they are there.
+*/
+void
+namedHexes(map<int, starSystem> &named)
+{
+	int lineNum = 0;
+
+	named.clear();
+	for (int x = 1; x <= SECTOR_COLS; x++)
+	{
+		for (int y = 1; y <= SECTOR_ROWS; y++)
+		{
+			if (lineNum < MAX_SYS && systemData[lineNum].starHex != 0 &&
+			    systemData[lineNum].xHex == x && systemData[lineNum].yHex == y){
+				named[x * 100 + y] = systemData[lineNum];
+				lineNum++;
+			}
+		}
+	}
+}
+
+/* UPDATE A SECTOR FILE EACH TIME ITS NAMES FILE IS SAVED */
+/*
+	inotify reports files written and closed in the names directory, and
+	files renamed into it, which is how many editors save.
+*/
+void
+watchNamesFiles()
+{
+	string dir = (options.namesFilePath.empty() ? "." : options.namesFilePath);
+	int fd = inotify_init1(IN_CLOEXEC);
+
+	if (fd < 0 || inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0){
+		cerr << "Unable to watch " << dir << ": " << strerror(errno) << "\n";
+		exit(1);
+	}
+	*report << "Watching " << dir << " for names files\n" << flush;
+
+	vector<char> buffer(64 * 1024);
+	for (;;)
+	{
+		ssize_t got = read(fd, buffer.data(), buffer.size());
+		if (got < 0){
+			if (errno == EINTR)
+				continue;
+			cerr << "Unable to watch " << dir << ": " << strerror(errno) << "\n";
+			exit(1);
+		}
+
+		for (ssize_t at = 0; at < got; )
+		{
+			const struct inotify_event *event = (const struct inotify_event *)(buffer.data() + at);
+			string file = (event->len > 0 ? event->name : "");
+			string suffix = "_names.txt";
+			int secX, secY;
+
+			at += sizeof(struct inotify_event) + event->len;
+
+			if (file.size() <= suffix.size() || file.compare(file.size() - suffix.size(), suffix.size(), suffix) != 0)
+				continue;
+
+			string secName = file.substr(0, file.size() - suffix.size());
+			sectorData sec;
+			if (!parseSectorName(secName, secX, secY) || secX < 0 || secX >= options.regionCols ||
+			    secY < 0 || secY >= options.regionRows)
+				continue;
+			placeSector(secX, secY, sec);
+			if (sec.name == secName){
+				updateSector(secX, secY);
+				*report << flush;
+			}
+		}
+	}
+}
+
+/* COMPARE TWO RUNS, WORLD BY WORLD */
+/*
+	Each file, plain or gzipped in any format, or each sector of a pack,
+	is read into a table indexed by hex. The tables are then walked in
+	hex order together, so worlds line up however many come and go, and
+	the whole comparison is linear in the size of the files. Sectors of
+	two packs are paired by position. Like diff(1), exits 0 when there
+	are no differences, 1 when there are, and 2 on trouble.
+*/
+int
+runDiff()
+{
+	vector<diffSector> older, newer;
+	bool oldPacked, newPacked;
+	int counts[3] = {0, 0, 0};	/* Added, removed and changed */
+
+	if (!readDiffInput(options.diffOld, older, oldPacked) || !readDiffInput(options.diffNew, newer, newPacked))
+		return 2;
+	if (oldPacked != newPacked){
+		cerr << "Compare a pack with a pack, or a sector file with a sector file\n";
+		return 2;
+	}
+
+	if (!oldPacked){
+		diffSectors(&older[0], &newer[0], counts);
+	}else{
+		map<pair<int, int>, int> position;
+		for (size_t i = 0; i < newer.size(); i++)
+			position[make_pair(newer[i].secX, newer[i].secY)] = i;
+
+		for (size_t i = 0; i < older.size(); i++)
+		{
+			map<pair<int, int>, int>::iterator found = position.find(make_pair(older[i].secX, older[i].secY));
+			if (found == position.end()){
+				diffSectors(&older[i], NULL, counts);
+			}else{
+				diffSectors(&older[i], &newer[found->second], counts);
+				position.erase(found);
+			}
+		}
+		for (size_t i = 0; i < newer.size(); i++)
+			if (position.count(make_pair(newer[i].secX, newer[i].secY)) != 0)
+				diffSectors(NULL, &newer[i], counts);
+	}
+
+	cout << "#Diff: " << counts[0] << " added, " << counts[1] << " removed, " << counts[2] << " changed\n";
+	return ((counts[0] + counts[1] + counts[2]) > 0 ? 1 : 0);
+}
+
+/* READ A SECTOR FILE, OR EVERY SECTOR OF A PACK, TO COMPARE */
+bool
+readDiffInput(const string &path, vector<diffSector> &sectors, bool &packed)
+{
+	packReader reader;
+
+	packed = openPack(path, reader);
+	if (!packed){
+		sectors.resize(1);
+		sectors[0].secX = sectors[0].secY = 0;
+		sectors[0].name = "";
+		if (!readSectorFile(path, sectors[0].outFormat, sectors[0].systems)){
+			cerr << "Unable to read " << path << "\n";
+			return false;
+		}
+		return true;
+	}
+
+	sectors.resize(reader.index.size());
+	for (size_t i = 0; i < reader.index.size(); i++)
+	{
+		const packEntry &entry = reader.index[i];
+		string text;
+
+		if (!entry.compressed)
+			text.assign(reader.base + entry.offset, entry.length);
+		else if (!gunzipBytes(reader.base + entry.offset, entry.length, text)){
+			cerr << "Unable to read " << entry.name << " in " << path << "\n";
+			munmap((void *)reader.base, reader.size);
+			return false;
+		}
+
+		sectors[i].secX = entry.secX;
+		sectors[i].secY = entry.secY;
+		sectors[i].name = entry.name.substr(0, entry.name.find('.'));
+		parseSectorText(text, sectors[i].outFormat, sectors[i].systems);
+	}
+	munmap((void *)reader.base, reader.size);
+	return true;
+}
+
+/* REPORT THE WORLDS ADDED, REMOVED AND CHANGED BETWEEN TWO SECTORS */
+/*
+	Either sector may be missing, when a pack has a sector the other
+	does not. Added and removed worlds are written whole, in the format
+	of their own file; changed ones as the fields that changed.
+*/
+void
+diffSectors(const diffSector *a, const diffSector *b, int counts[3])
+{
+	const int numHexes = (SECTOR_COLS + 1) * 100;
+	vector<int> before(numHexes, -1), after(numHexes, -1);
+	bool named = false;
+
+	if (a != NULL)
+		for (size_t i = 0; i < a->systems.size(); i++)
+			if (a->systems[i].hex > 0 && a->systems[i].hex < numHexes)
+				before[a->systems[i].hex] = i;
+	if (b != NULL)
+		for (size_t i = 0; i < b->systems.size(); i++)
+			if (b->systems[i].hex > 0 && b->systems[i].hex < numHexes)
+				after[b->systems[i].hex] = i;
+
+	for (int hex = 0; hex < numHexes; hex++)
+	{
+		ostringstream out;
+
+		if (before[hex] < 0 && after[hex] < 0)
+			continue;
+
+		if (before[hex] < 0){
+			out << "+ ";
+			writeSystemLine(out, b->outFormat, b->systems[after[hex]]);
+			counts[0]++;
+		}else if (after[hex] < 0){
+			out << "- ";
+			writeSystemLine(out, a->outFormat, a->systems[before[hex]]);
+			counts[1]++;
+		}else{
+			string changes = diffFields(a->systems[before[hex]], a->outFormat, b->systems[after[hex]], b->outFormat);
+			if (changes.empty())
+				continue;
+			out << "~ " << setw(4) << setfill('0') << hex << setfill(' ') << " " << changes;
+			counts[2]++;
+		}
+
+		/* Sectors of a pack are named before their first difference */
+		if (!named && !(a != NULL ? a->name : b->name).empty())
+			cout << "#Sector: " << (a != NULL ? a->name : b->name) << (a == NULL ? ", new" : (b == NULL ? ", gone" : "")) << "\n";
+		named = true;
+
+		cout << out.str() << "\n";
+	}
+}
+
+/* THE FIELDS THAT DIFFER BETWEEN TWO WORLDS, AS "field old->new" */
+/*
+	Only the fields both formats carry are compared, so a 1.0 file has
+	no names or PBG to differ, and only 2.0 to 2.2 have stellar data.
+	A blank base or zone is shown as '-'.
+*/
+string
+diffFields(const generatedSystem &a, int aFormat, const generatedSystem &b, int bFormat)
+{
+	static const char *uwpFields[9] = {"port", "siz", "atm", "hyd", "pop", "gov", "law", "", "tl"};
+	bool named = (aFormat != 1 && bFormat != 1);
+	bool stellar = (aFormat >= 2 && aFormat <= 4 && bFormat >= 2 && bFormat <= 4);
+	ostringstream out;
+
+	if (named && a.name != b.name)
+		out << " name " << a.name << "->" << b.name;
+	for (int d = 0; d < 9 && d < (int)a.UWP.size() && d < (int)b.UWP.size(); d++)
+		if (a.UWP[d] != b.UWP[d])
+			out << " " << uwpFields[d] << " " << a.UWP[d] << "->" << b.UWP[d];
+	if (a.base != b.base)
+		out << " base " << (a.base == ' ' ? '-' : a.base) << "->" << (b.base == ' ' ? '-' : b.base);
+	if (a.codes != b.codes){
+		string from = a.codes, to = b.codes;
+		from.erase(from.find_last_not_of(" ") + 1);
+		to.erase(to.find_last_not_of(" ") + 1);
+		if (from != to)
+			out << " codes \"" << from << "\"->\"" << to << "\"";
+	}
+	if (a.zone != b.zone)
+		out << " zone " << (a.zone == ' ' ? '-' : a.zone) << "->" << (b.zone == ' ' ? '-' : b.zone);
+	if (named && a.PBG != b.PBG)
+		out << " pbg " << setw(3) << setfill('0') << a.PBG << "->" << setw(3) << b.PBG << setfill(' ');
+	if (a.allegiance != b.allegiance)
+		out << " allegiance " << a.allegiance << "->" << b.allegiance;
+	if (stellar && a.stellar != b.stellar)
+		out << " stellar \"" << a.stellar << "\"->\"" << b.stellar << "\"";
+
+	string changes = out.str();
+	return (changes.empty() ? changes : changes.substr(1));
+}
+
+/* DRAW SVG MAPS OF EACH SECTOR, AND OF ITS SUBSECTORS */
+/*
+	The hex outlines and numbers of each kind of map are the same for
+	every sector, so they are worked out once, and each map copies them
+	before writing its worlds straight into the text of the file, with
+	nothing built up in between. Subsectors come out as sectorName_A.svg
+	to sectorName_P.svg, just the one given by -L if there is one. The
+	maps of a region are drawn side by side, one to a thread.
+*/
+void
+writeSvgMaps()
+{
+	svgWork work;
+	int only = -1;
+
+	if (options.subsecLetter.size() == 1 && toupper(options.subsecLetter[0]) >= 'A' && toupper(options.subsecLetter[0]) <= 'P')
+		only = toupper(options.subsecLetter[0]) - 'A';
+
+	work.grids.resize(17);
+	buildSvgGrid(work.grids[0], 1, 1, SECTOR_COLS, SECTOR_ROWS);
+	for (int sub = 0; sub < 16; sub++)
+		buildSvgGrid(work.grids[sub + 1], (sub % 4) * SUBSECTOR_COLS + 1, (sub / 4) * SUBSECTOR_ROWS + 1, SUBSECTOR_COLS, SUBSECTOR_ROWS);
+
+	for (size_t i = 0; i < regionSectors.size(); i++)
+	{
+		if (options.svg != "subsector")
+			work.maps.push_back(make_pair(i, 0));
+		if (options.svg != "sector")
+			for (int sub = 0; sub < 16; sub++)
+				if (only < 0 || only == sub)
+					work.maps.push_back(make_pair(i, sub + 1));
+	}
+
+	work.failed = 0;
+	parallelFor(work.maps.size(), writeSvgMap, &work);
+
+	*report << "SVG maps: " << work.maps.size() - work.failed << "\n";
+}
+
+/* WORK OUT THE HEX CENTRES, OUTLINES AND NUMBERS OF A MAP */
+/*
+	Hexes have flat tops, and the even columns sit half a hex lower
+	than the odd ones, as on the printed maps.
+*/
+void
+buildSvgGrid(svgGrid &grid, int firstCol, int firstRow, int cols, int rows)
+{
+	const double r = SVG_HEX_RADIUS;
+	const double h = r * sqrt(3.0);
+
+	grid.firstCol = firstCol;
+	grid.firstRow = firstRow;
+	grid.cols = cols;
+	grid.rows = rows;
+	grid.width = 2 * SVG_MARGIN + r * (1.5 * cols + 0.5);
+	grid.height = 2 * SVG_MARGIN + h * (rows + 0.5);
+
+	grid.x.resize(cols);
+	for (int c = 0; c < cols; c++)
+		grid.x[c] = SVG_MARGIN + r + 1.5 * r * c;
+	for (int odd = 0; odd < 2; odd++)
+	{
+		grid.y[odd].resize(rows);
+		for (int row = 0; row < rows; row++)
+			grid.y[odd][row] = SVG_MARGIN + h / 2 + h * row + (odd ? 0 : h / 2);
+	}
+
+	grid.background.clear();
+	svgPrintf(grid.background, "<path class=\"grid\" d=\"");
+	for (int c = 0; c < cols; c++)
+	{
+		for (int row = 0; row < rows; row++)
+		{
+			double x = grid.x[c], y = grid.y[(firstCol + c) & 1][row];
+			svgPrintf(grid.background, "M%.1f %.1fL%.1f %.1f %.1f %.1f %.1f %.1f %.1f %.1f %.1f %.1fZ",
+				x - r, y, x - r / 2, y - h / 2, x + r / 2, y - h / 2, x + r, y, x + r / 2, y + h / 2, x - r / 2, y + h / 2);
+		}
+	}
+	svgPrintf(grid.background, "\"/>\n");
+
+	for (int c = 0; c < cols; c++)
+		for (int row = 0; row < rows; row++)
+			svgPrintf(grid.background, "<text class=\"hex\" x=\"%.1f\" y=\"%.1f\">%02d%02d</text>\n",
+				grid.x[c], grid.y[(firstCol + c) & 1][row] - h / 2 + 8, firstCol + c, firstRow + row);
+}
+
+/* DRAW ONE MAP OF A SECTOR */
+void
+writeSvgMap(int item, void *arg)
+{
+	static const char *header =
+		"<style>\n"
+		".grid{fill:none;stroke:#888;stroke-width:1}\n"
+		"text{font-family:sans-serif;text-anchor:middle;fill:#000}\n"
+		".hex{font-size:7px;fill:#888}.port{font-size:9px;font-weight:bold}\n"
+		".name{font-size:8px}.uwp{font-size:7px}\n"
+		".wet{fill:#28c}.dry{fill:#fff;stroke:#000}\n"
+		".amber{fill:none;stroke:#fb0;stroke-width:2}.red{fill:none;stroke:#d00;stroke-width:2}\n"
+		"</style>\n"
+		"<defs>\n"
+		"<path id=\"naval\" d=\"M0 -4L1.2 -1.2 4 -1.2 1.8 0.6 2.4 4 0 2 -2.4 4 -1.8 0.6 -4 -1.2 -1.2 -1.2Z\"/>\n"
+		"<path id=\"scout\" d=\"M0 -3.5L3.5 3 -3.5 3Z\"/>\n"
+		"<path id=\"military\" d=\"M-3 -3h6v6h-6Z\"/>\n"
+		"<circle id=\"gas\" r=\"2.5\"/>\n"
+		"<g id=\"belt\"><circle cx=\"-3\" cy=\"1\" r=\"1.2\"/><circle cx=\"0\" cy=\"-2\" r=\"1.2\"/><circle cx=\"3\" cy=\"1.5\" r=\"1.2\"/></g>\n"
+		"</defs>\n";
+
+	svgWork &work = *(svgWork *)arg;
+	const sectorData &sec = regionSectors[work.maps[item].first];
+	int which = work.maps[item].second;
+	const svgGrid &grid = work.grids[which];
+	vector<string> chunks(1);
+	string &svg = chunks[0];
+
+	svg.reserve(grid.background.size() + 4096 + sec.count * 512);
+
+	svgPrintf(svg, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+	svgPrintf(svg, "<svg xmlns=\"http://www.w3.org/2000/svg\" xmlns:xlink=\"http://www.w3.org/1999/xlink\" "
+		"width=\"%.0f\" height=\"%.0f\" viewBox=\"0 0 %.0f %.0f\">\n", grid.width, grid.height, grid.width, grid.height);
+	svg += header;
+	if (which == 0)
+		svg += "<title>" + xmlText(sec.name) + "</title>\n";
+	else
+		svg += "<title>" + xmlText(sec.name) + " subsector " + char('A' + which - 1) + "</title>\n";
+	svg += grid.background;
+
+	for (int i = sec.first; i < sec.first + sec.count; i++)
+	{
+		const generatedSystem &s = regionSys[i];
+		int c = s.hex / 100 - grid.firstCol;
+		int row = s.hex % 100 - grid.firstRow;
+
+		if (c >= 0 && c < grid.cols && row >= 0 && row < grid.rows)
+			drawSvgWorld(svg, grid, s, which != 0);
+	}
+	svg += "</svg>\n";
+
+	string path = sectorFilePath(sec, (which == 0 ? string(".svg") : string("_") + char('A' + which - 1) + ".svg"));
+	if (!writeChunks(path, chunks))
+		work.failed++;
+}
+
+/* DRAW ONE WORLD IN ITS HEX */
+/*
+	The starport above the world, bases to its left, a gas giant to its
+	right, and its name below, in capitals for a population in the
+	billions. Water worlds are filled, asteroid belts are a scatter of
+	rocks. Amber and red zones ring the hex.
+*/
+void
+drawSvgWorld(string &svg, const svgGrid &grid, const generatedSystem &s, bool uwp)
+{
+	const double r = SVG_HEX_RADIUS;
+	int c = s.hex / 100 - grid.firstCol;
+	double x = grid.x[c];
+	double y = grid.y[(s.hex / 100) & 1][s.hex % 100 - grid.firstRow];
+
+	if (s.zone == 'A' || s.zone == 'R')
+		svgPrintf(svg, "<circle class=\"%s\" cx=\"%.1f\" cy=\"%.1f\" r=\"%.1f\"/>\n", (s.zone == 'A' ? "amber" : "red"), x, y, r * 0.62);
+
+	if (s.UWP[1] == '0')
+		svgPrintf(svg, "<use xlink:href=\"#belt\" x=\"%.1f\" y=\"%.1f\"/>\n", x, y);
+	else
+		svgPrintf(svg, "<circle class=\"%s\" cx=\"%.1f\" cy=\"%.1f\" r=\"5\"/>\n", (hexValue(s.UWP[3]) > 0 ? "wet" : "dry"), x, y);
+
+	svgPrintf(svg, "<text class=\"port\" x=\"%.1f\" y=\"%.1f\">%c</text>\n", x, y - 8, s.UWP[0]);
+
+	if (strchr("NABD", s.base) != NULL)
+		svgPrintf(svg, "<use xlink:href=\"#naval\" x=\"%.1f\" y=\"%.1f\"/>\n", x - r * 0.45, y - r * 0.3);
+	if (strchr("SABW", s.base) != NULL)
+		svgPrintf(svg, "<use xlink:href=\"#scout\" x=\"%.1f\" y=\"%.1f\"/>\n", x - r * 0.45, y + r * 0.05);
+	if (s.base == 'M')
+		svgPrintf(svg, "<use xlink:href=\"#military\" x=\"%.1f\" y=\"%.1f\"/>\n", x - r * 0.45, y - r * 0.3);
+	if (s.PBG % 10 > 0)
+		svgPrintf(svg, "<use xlink:href=\"#gas\" x=\"%.1f\" y=\"%.1f\"/>\n", x + r * 0.45, y - r * 0.3);
+
+	if (s.name != "Unnamed"){
+		string name = xmlText(s.name);
+		if (hexValue(s.UWP[4]) >= 9)
+			transform(name.begin(), name.end(), name.begin(), ::toupper);
+		svgPrintf(svg, "<text class=\"name\" x=\"%.1f\" y=\"%.1f\">%s</text>\n", x, y + 14, name.c_str());
+	}
+	if (uwp)
+		svgPrintf(svg, "<text class=\"uwp\" x=\"%.1f\" y=\"%.1f\">%s</text>\n", x, y + 22, s.UWP.c_str());
+}
+
+/* APPEND FORMATTED TEXT TO AN SVG FILE BEING WRITTEN */
+void
+svgPrintf(string &svg, const char *format, ...)
+{
+	char buffer[512];
+	va_list args;
+
+	va_start(args, format);
+	int length = vsnprintf(buffer, sizeof(buffer), format, args);
+	va_end(args);
+
+	if (length < 0)
+		return;
+	if (length < (int)sizeof(buffer)){
+		svg.append(buffer, length);
+		return;
+	}
+
+	/* Too long for the buffer, print it again in place */
+	size_t end = svg.size();
+	svg.resize(end + length + 1);
+	va_start(args, format);
+	vsnprintf(&svg[end], length + 1, format, args);
+	va_end(args);
+	svg.resize(end + length);
+}
+
+/* ESCAPE TEXT FOR AN XML FILE */
+string
+xmlText(const string &text)
+{
+	string out;
+
+	for (size_t i = 0; i < text.size(); i++)
+	{
+		switch (text[i])
+		{
+			case '&': out += "&amp;"; break;
+			case '<': out += "&lt;"; break;
+			case '>': out += "&gt;"; break;
+			case '"': out += "&quot;"; break;
+			default: out += text[i];
+		}
+	}
+	return out;
+}
+
+/* PATH FOR ANOTHER FILE OF A SECTOR, NEXT TO ITS SECTOR FILE */
+string
+sectorFilePath(const sectorData &sec, const string &ext)
+{
+	/* With the sector files on standard output, the rest go in the current directory */
+	if (sec.outputPath == "-")
+		return sec.name + ext;
+
+	string path = sec.outputPath;
+	if (path.size() > 3 && path.compare(path.size() - 3, 3, ".gz") == 0)
+		path.erase(path.size() - 3);
+
+	size_t dot = path.rfind('.');
+	size_t slash = path.rfind('/');
+	if (dot == string::npos || (slash != string::npos && dot < slash))
+		return path + ext;
+	return path.substr(0, dot) + ext;
+}
+
+/* DRAW ASCII SUBSECTOR MAPS OF EACH SECTOR */
+/*
+	The hexes of every subsector have the same outlines, so they are
+	drawn once, and each sector copies them into one block holding all
+	16 of its subsectors before its worlds are put in. The block is
+	then written to sectorName.map in one go, subsector A to P, or just
+	the subsector given by -L.
+
+	  __________
+	 /0101 N G A\     hex number, base, gas giant, zone
+	/ A788899-C  \    UWP
+	\   Regina   /    name, in capitals for a population in the billions
+	 \__________/
+*/
+void
+writeAsciiMaps()
+{
+	asciiMapWork work;
+
+	work.only = -1;
+	if (options.subsecLetter.size() == 1 && toupper(options.subsecLetter[0]) >= 'A' && toupper(options.subsecLetter[0]) <= 'P')
+		work.only = toupper(options.subsecLetter[0]) - 'A';
+
+	work.blank.assign(MAP_WIDTH * MAP_HEIGHT, ' ');
+	for (int c = 0; c < SUBSECTOR_COLS; c++)
+	{
+		for (int row = 0; row < SUBSECTOR_ROWS; row++)
+		{
+			/* The first column of a subsector is odd, and odd columns sit higher */
+			int x0 = c * MAP_PITCH;
+			int y0 = row * 2 * MAP_SLANT + ((c & 1) ? MAP_SLANT : 0);
+			char *grid = &work.blank[0];
+
+			for (int i = 0; i < MAP_TOP; i++)
+			{
+				grid[y0 * MAP_WIDTH + x0 + MAP_SLANT + i] = '_';
+				grid[(y0 + 2 * MAP_SLANT) * MAP_WIDTH + x0 + MAP_SLANT + i] = '_';
+			}
+			for (int k = 1; k <= MAP_SLANT; k++)
+			{
+				grid[(y0 + k) * MAP_WIDTH + x0 + MAP_SLANT - k] = '/';
+				grid[(y0 + k) * MAP_WIDTH + x0 + MAP_SLANT + MAP_TOP + k - 1] = '\\';
+				grid[(y0 + MAP_SLANT + k) * MAP_WIDTH + x0 + k - 1] = '\\';
+				grid[(y0 + MAP_SLANT + k) * MAP_WIDTH + x0 + 2 * MAP_SLANT + MAP_TOP - k] = '/';
+			}
+		}
+	}
+
+	work.failed = 0;
+	parallelFor(regionSectors.size(), writeAsciiMap, &work);
+
+	*report << "Subsector maps: " << (regionSectors.size() - work.failed) * (work.only >= 0 ? 1 : 16) << "\n";
+}
+
+/* DRAW THE SUBSECTOR MAPS OF ONE SECTOR */
+void
+writeAsciiMap(int item, void *arg)
+{
+	asciiMapWork &work = *(asciiMapWork *)arg;
+	const sectorData &sec = regionSectors[item];
+	const int size = MAP_WIDTH * MAP_HEIGHT;
+	vector<char> grids(16 * size);
+
+	for (int sub = 0; sub < 16; sub++)
+	{
+		char *grid = &grids[sub * size];
+
+		memcpy(grid, work.blank.data(), size);
+		for (int c = 0; c < SUBSECTOR_COLS; c++)
+		{
+			for (int row = 0; row < SUBSECTOR_ROWS; row++)
+			{
+				char number[8];
+				snprintf(number, sizeof(number), "%02d%02d", (sub % 4) * SUBSECTOR_COLS + c + 1, (sub / 4) * SUBSECTOR_ROWS + row + 1);
+				putMapText(grid, c * MAP_PITCH + MAP_SLANT, row * 2 * MAP_SLANT + ((c & 1) ? MAP_SLANT : 0) + 1, number);
+			}
+		}
+	}
+
+	for (int i = sec.first; i < sec.first + sec.count; i++)
+	{
+		const generatedSystem &s = regionSys[i];
+		int sub = ((s.hex % 100 - 1) / SUBSECTOR_ROWS) * 4 + (s.hex / 100 - 1) / SUBSECTOR_COLS;
+
+		if (sub >= 0 && sub < 16)
+			drawAsciiWorld(&grids[sub * size], s);
+	}
+
+	/* All the subsectors into one buffer, without the spaces at the ends of lines */
+	vector<string> chunks(1);
+	string &out = chunks[0];
+	out.reserve(16 * (size + MAP_HEIGHT + 32));
+	for (int sub = 0; sub < 16; sub++)
+	{
+		if (work.only >= 0 && work.only != sub)
+			continue;
+
+		out += "#Subsector: ";
+		out += char('A' + sub);
+		out += "\n";
+		for (int y = 0; y < MAP_HEIGHT; y++)
+		{
+			const char *line = &grids[sub * size + y * MAP_WIDTH];
+			int length = MAP_WIDTH;
+			while (length > 0 && line[length - 1] == ' ')
+				length--;
+			out.append(line, length);
+			out += '\n';
+		}
+		out += '\n';
+	}
+
+	if (!writeChunks(sectorFilePath(sec, ".map"), chunks))
+		work.failed++;
+}
+
+/* PUT ONE WORLD IN ITS HEX OF A SUBSECTOR MAP */
+void
+drawAsciiWorld(char *grid, const generatedSystem &s)
+{
+	int c = (s.hex / 100 - 1) % SUBSECTOR_COLS;
+	int row = (s.hex % 100 - 1) % SUBSECTOR_ROWS;
+	int x0 = c * MAP_PITCH;
+	int y0 = row * 2 * MAP_SLANT + ((c & 1) ? MAP_SLANT : 0);
+	const int inside = MAP_TOP + 2 * MAP_SLANT - 2;
+
+	/* After the hex number: base, gas giant and zone */
+	grid[(y0 + 1) * MAP_WIDTH + x0 + MAP_SLANT + 5] = s.base;
+	if (s.PBG % 10 > 0)
+		grid[(y0 + 1) * MAP_WIDTH + x0 + MAP_SLANT + 7] = 'G';
+	if (s.zone == 'A' || s.zone == 'R')
+		grid[(y0 + 1) * MAP_WIDTH + x0 + MAP_SLANT + 9] = s.zone;
+
+	putMapText(grid, x0 + 1 + (inside - (int)s.UWP.size()) / 2, y0 + 2, s.UWP);
+
+	if (s.name != "Unnamed"){
+		string name = s.name.substr(0, inside - 2);
+		if (hexValue(s.UWP[4]) >= 9)
+			transform(name.begin(), name.end(), name.begin(), ::toupper);
+		putMapText(grid, x0 + 1 + (inside - (int)name.size()) / 2, y0 + 3, name);
+	}
+}
+
+/* PUT TEXT ON A SUBSECTOR MAP */
+void
+putMapText(char *grid, int x, int y, const string &text)
+{
+	memcpy(grid + y * MAP_WIDTH + x, text.data(), text.size());
+}
+
+/* DRAW THE HEATMAPS OF THE REGION ASKED FOR */
+void
+writeHeatmaps()
+{
+	static const char *kinds[HEAT_KINDS] = {"density", "population", "tl"};
+	string kind;
+	istringstream list(options.heatmap);
+
+	if ((int)regionHex.size() != options.regionCols * SECTOR_COLS * options.regionRows * SECTOR_ROWS)
+		buildRegionHex();
+
+	while (getline (list, kind, ','))
+		for (int k = 0; k < HEAT_KINDS; k++)
+			if (kind == kinds[k])
+				writeHeatmap(k);
+}
+
+/* DRAW ONE HEATMAP OF THE REGION */
+/*
+	Each pixel covers --heatmapCell hexes across and down, coloured by
+	the share of its hexes with a world, or the mean population or tech
+	level digit of its worlds; black where there are none. The image is
+	cut into strips of rows, drawn across the threads. Strips are
+	written in order as they are finished, and a thread that gets too
+	far ahead of the file waits, so only a few strips are ever held,
+	however large the region. For PNG each strip is deflated on its own
+	thread as part of one zlib stream, its checksum joined to the rest
+	with adler32_combine(), and written as its own IDAT chunk.
+*/
+bool
+writeHeatmap(int kind)
+{
+	static const char *names[HEAT_KINDS] = {"_density", "_population", "_tl"};
+	/* Dark blue through green and yellow to red */
+	static const unsigned char stops[5][3] = {{20, 20, 70}, {40, 70, 180}, {40, 170, 110}, {240, 210, 40}, {220, 40, 30}};
+	heatmapWork work;
+
+	work.kind = kind;
+	work.png = !options.ppm;
+	work.cell = options.heatmapCell;
+	work.width = (options.regionCols * SECTOR_COLS + work.cell - 1) / work.cell;
+	work.height = (options.regionRows * SECTOR_ROWS + work.cell - 1) / work.cell;
+	work.stripRows = max(1, HEAT_STRIP_PIXELS / work.width);
+	work.numStrips = (work.height + work.stripRows - 1) / work.stripRows;
+	work.window = 2 * max(1, options.threads);
+	work.strips.resize(work.numStrips);
+	work.checks.resize(work.numStrips);
+	work.ready.assign(work.numStrips, 0);
+	work.written = 0;
+	work.adler = adler32(0, Z_NULL, 0);
+	work.ok = true;
+
+	for (int v = 0; v < 256; v++)
+	{
+		int stop = min(v * 4 / 256, 3);
+		int along = v * 4 - stop * 256;
+		for (int c = 0; c < 3; c++)
+			work.palette[v][c] = stops[stop][c] + (stops[stop + 1][c] - stops[stop][c]) * along / 256;
+	}
+
+	work.path = regionFilePath(string(names[kind]) + (work.png ? ".png" : ".ppm"));
+	string temp = work.path + ".tmp";
+	work.fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (work.fd < 0){
+		cerr << "Unable to write " << work.path << ": " << strerror(errno) << "\n";
+		return false;
+	}
+
+	/* The header, then the strips as they come */
+	vector<string> header(1);
+	if (work.png){
+		string ihdr;
+		header[0] = "\x89PNG\r\n\x1a\n";
+		putPngInt(ihdr, work.width);
+		putPngInt(ihdr, work.height);
+		ihdr += string("\x08\x02\x00\x00\x00", 5);	/* 8 bit RGB, no interlace */
+		appendPngChunk(header[0], "IHDR", ihdr);
+	}else{
+		ostringstream ppm;
+		ppm << "P6\n" << work.width << " " << work.height << "\n255\n";
+		header[0] = ppm.str();
+	}
+	work.ok = writeChunksTo(work.fd, work.path, header);
+
+	if (work.ok)
+		parallelFor(work.numStrips, drawHeatmapStrip, &work);
+
+	if (work.ok && work.png){
+		vector<string> end(1);
+		appendPngChunk(end[0], "IEND", "");
+		work.ok = writeChunksTo(work.fd, work.path, end);
+	}
+
+	if (close(work.fd) != 0)
+		work.ok = false;
+	if (work.ok && rename(temp.c_str(), work.path.c_str()) != 0){
+		cerr << "Unable to write " << work.path << ": " << strerror(errno) << "\n";
+		work.ok = false;
+	}
+	if (!work.ok){
+		unlink(temp.c_str());
+		return false;
+	}
+
+	*report << "Heatmap: " << work.width << "x" << work.height << ", file: " << work.path << "\n";
+	return true;
+}
+
+/* DRAW ONE STRIP OF A HEATMAP, THEN WRITE WHATEVER STRIPS ARE NEXT IN THE FILE */
+void
+drawHeatmapStrip(int strip, void *arg)
+{
+	heatmapWork &work = *(heatmapWork *)arg;
+	int firstRow = strip * work.stripRows;
+	int lastRow = min(firstRow + work.stripRows, work.height);
+	int rowBytes = (work.png ? 1 : 0) + 3 * work.width;
+	string rows;
+
+	/* Strips are taken in order, so the one the file is waiting for is never held up here */
+	{
+		unique_lock<mutex> hold(work.lock);
+		while (work.ok && strip >= work.written + work.window)
+			work.changed.wait(hold);
+		if (!work.ok)
+			return;
+	}
+
+	rows.resize((size_t)rowBytes * (lastRow - firstRow));
+	unsigned char *p = (unsigned char *)&rows[0];
+	for (int py = firstRow; py < lastRow; py++)
+	{
+		if (work.png)
+			*p++ = 0;	/* No filter */
+		for (int px = 0; px < work.width; px++)
+		{
+			int value = heatmapValue(work.kind, px, py, work.cell);
+			for (int c = 0; c < 3; c++)
+				*p++ = (value < 0 ? 0 : work.palette[value][c]);
+		}
+	}
+
+	string out;
+	if (work.png){
+		z_stream z;
+		bool last = (strip == work.numStrips - 1);
+
+		work.checks[strip] = adler32(adler32(0, Z_NULL, 0), (const Bytef *)rows.data(), rows.size());
+
+		memset(&z, 0, sizeof(z));
+		deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+		out.resize(deflateBound(&z, rows.size()) + 16);
+		if (strip == 0){
+			/* The zlib header starts the stream */
+			out[0] = 0x78;
+			out[1] = (char)0x9c;
+			z.next_out = (Bytef *)&out[2];
+			z.avail_out = out.size() - 2;
+		}else{
+			z.next_out = (Bytef *)&out[0];
+			z.avail_out = out.size();
+		}
+		z.next_in = (Bytef *)rows.data();
+		z.avail_in = rows.size();
+		/* Every strip but the last ends on a byte boundary, ready for the next */
+		deflate(&z, last ? Z_FINISH : Z_SYNC_FLUSH);
+		out.resize(out.size() - z.avail_out);
+		deflateEnd(&z);
+	}else{
+		out.swap(rows);
+	}
+
+	lock_guard<mutex> hold(work.lock);
+	work.strips[strip].swap(out);
+	work.ready[strip] = 1;
+	writeHeatmapStrips(work);
+	work.changed.notify_all();
+}
+
+/* WRITE THE STRIPS THAT ARE NEXT IN THE FILE, CALLED WITH THE HEATMAP LOCKED */
+void
+writeHeatmapStrips(heatmapWork &work)
+{
+	while (work.ok && work.written < work.numStrips && work.ready[work.written])
+	{
+		int strip = work.written;
+		vector<string> chunk(1);
+
+		if (work.png){
+			int rowBytes = 1 + 3 * work.width;
+			int rows = min(work.stripRows, work.height - strip * work.stripRows);
+
+			work.adler = adler32_combine(work.adler, work.checks[strip], (z_off_t)rowBytes * rows);
+			if (strip == work.numStrips - 1)
+				putPngInt(work.strips[strip], work.adler);
+			appendPngChunk(chunk[0], "IDAT", work.strips[strip]);
+		}else{
+			chunk[0].swap(work.strips[strip]);
+		}
+		string().swap(work.strips[strip]);
+
+		work.ok = writeChunksTo(work.fd, work.path, chunk);
+		work.written++;
+	}
+}
+
+/* COLOUR OF ONE HEATMAP PIXEL, 0 TO 255, OR -1 IF IT HAS NO WORLDS */
+int
+heatmapValue(int kind, int px, int py, int cell)
+{
+	int width = options.regionCols * SECTOR_COLS;
+	int height = options.regionRows * SECTOR_ROWS;
+	int x0 = px * cell, x1 = min(x0 + cell, width);
+	int y0 = py * cell, y1 = min(y0 + cell, height);
+	int worlds = 0, total = 0;
+
+	for (int y = y0; y < y1; y++)
+	{
+		for (int x = x0; x < x1; x++)
+		{
+			int i = regionHex[y * width + x];
+			if (i < 0)
+				continue;
+			worlds++;
+			if (kind == HEAT_POPULATION)
+				total += hexValue(regionSys[i].UWP[4]);
+			else if (kind == HEAT_TECH)
+				total += hexValue(regionSys[i].UWP[8]);
+		}
+	}
+
+	if (kind == HEAT_DENSITY)
+		return worlds * 255 / ((x1 - x0) * (y1 - y0));
+	if (worlds == 0)
+		return -1;
+	/* Population runs to A, tech level to F */
+	return min(255, total * 255 / (worlds * (kind == HEAT_POPULATION ? 10 : 15)));
+}
+
+/* ADD A CHUNK TO A PNG FILE BEING WRITTEN */
+void
+appendPngChunk(string &out, const char *type, const string &data)
+{
+	unsigned long crc = crc32(0, Z_NULL, 0);
+
+	putPngInt(out, data.size());
+	out.append(type, 4);
+	out += data;
+	crc = crc32(crc, (const Bytef *)type, 4);
+	crc = crc32(crc, (const Bytef *)data.data(), data.size());
+	putPngInt(out, crc);
+}
+
+/* ADD A 4 BYTE BIG-ENDIAN NUMBER, AS PNG HAS THEM */
+void
+putPngInt(string &out, unsigned long value)
+{
+	for (int shift = 24; shift >= 0; shift -= 8)
+		out += (char)((value >> shift) & 0xff);
+}
+
+/* START THE CHECKPOINT OF A REGION RUN, OR PICK UP AN EARLIER ONE */
+/*
+	A region run keeps sectorName.ckpt next to its sector files, listing
+	the sectors whose files are complete. Every hex is rolled from the
+	seed and its own position, so the seed is all the generator state
+	there is to keep. With --resume the sectors listed are not written
+	again, and not generated at all unless a later pass needs them.
+*/
+void
+startCheckpoint()
+{
+	if ((options.regionCols == 1 && options.regionRows == 1) || options.outputPath == "-" || options.pack){
+		if (options.resume){
+			cerr << "Only a region written to sector files has a checkpoint to resume from\n";
+			exit(1);
+		}
+		return;
+	}
+
+	checkpoint.path = options.outputPath + options.sectorName + ".ckpt";
+	checkpoint.runKey = runKey();
+	checkpoint.lastWrite = time(NULL);
+
+	if (!options.resume)
+		return;
+
+	ifstream inputFile(checkpoint.path.c_str());
+	string line, key;
+	unsigned long long seed = options.seed;
+
+	if (!inputFile || !getline (inputFile, line) || line != CHECKPOINT_VERSION){
+		cerr << "No checkpoint to resume from: " << checkpoint.path << "\n";
+		exit(1);
+	}
+
+	while (getline (inputFile, line))
+	{
+		istringstream fields(line);
+		string field;
+		int secX, secY;
+
+		fields >> field;
+		if (field == "seed")
+			fields >> seed;
+		else if (field == "run")
+			fields >> key;
+		else if (field == "done" && fields >> secX >> secY)
+			checkpoint.done.insert(make_pair(secX, secY));
+	}
+
+	if (key != checkpoint.runKey){
+		cerr << "The checkpoint is of a run with other options: " << checkpoint.path << "\n";
+		exit(1);
+	}
+
+	if (options.seedGiven && seed != options.seed){
+		cerr << "The checkpoint is of a run with seed " << seed << ", not " << options.seed << ": " <<
+			checkpoint.path << "\n";
+		exit(1);
+	}
+	options.seed = seed;
+
+	*report << "Resuming: " << checkpoint.done.size() << " of " << options.regionCols * options.regionRows <<
+		" sectors done\n";
+}
+
+/* HASH OF THE OPTIONS THE SECTOR FILES OF A RUN DEPEND ON, BAR THE SEED */
+string
+runKey()
+{
+	ostringstream inputs;
+	char key[17];
+
+	inputs << options.regionCols << "x" << options.regionRows << "\n" << options.sectorName << "\n" <<
+		density << " " << maturity << "\n" << options.allegience << "\n" << options.subsecLetter << "\n" <<
+		options.namesFilePath << "\n" << options.nameCorpusPath << "\n" << options.polities << "\n" <<
+		options.constraints << "\n" << options.outputFormat << " " << options.compress << "\n" <<
+		options.years << " " << options.yearStep << "\n";
+	inputs.write((const char *)&rules, sizeof(rules));
+
+	snprintf(key, sizeof(key), "%016llx", hashText(0xcbf29ce484222325ULL, inputs.str()));
+	return key;
+}
+
+/* HAS THE FILE OF A SECTOR BEEN WRITTEN BY THIS RUN OR THE ONE IT RESUMES */
+bool
+sectorDone(int secX, int secY)
+{
+	lock_guard<mutex> hold(checkpoint.lock);
+	return (checkpoint.done.count(make_pair(secX, secY)) != 0);
+}
+
+/* NOTE THE FILE OF A SECTOR IS WRITTEN, CHECKPOINTING NOW AND THEN */
+void
+markSectorDone(int secX, int secY)
+{
+	lock_guard<mutex> hold(checkpoint.lock);
+
+	if (checkpoint.path.empty())
+		return;
+
+	checkpoint.done.insert(make_pair(secX, secY));
+	if (time(NULL) - checkpoint.lastWrite >= options.checkpointSeconds)
+		writeCheckpoint();
+}
+
+/* WRITE THE CHECKPOINT, CALLED WITH THE CHECKPOINT LOCKED */
+bool
+writeCheckpoint()
+{
+	ostringstream out;
+	vector<string> chunks;
+	string temp = checkpoint.path + ".tmp";
+
+	out << CHECKPOINT_VERSION << "\n";
+	out << "seed " << options.seed << "\n";
+	out << "run " << checkpoint.runKey << "\n";
+	for (set<pair<int, int> >::const_iterator i = checkpoint.done.begin(); i != checkpoint.done.end(); i++)
+		out << "done " << i->first << " " << i->second << "\n";
+	chunks.push_back(out.str());
+
+	checkpoint.lastWrite = time(NULL);
+
+	/* Renamed into place, so a crash leaves the old checkpoint or the new one */
+	if (!writeChunks(temp, chunks) || rename(temp.c_str(), checkpoint.path.c_str()) != 0){
+		unlink(temp.c_str());
+		return false;
+	}
+	return true;
+}
+
+/* DROP THE CHECKPOINT OF A RUN THAT WROTE EVERY SECTOR, OR KEEP WHERE IT GOT TO */
+void
+finishCheckpoint()
+{
+	lock_guard<mutex> hold(checkpoint.lock);
+
+	if (checkpoint.path.empty())
+		return;
+
+	if ((int)checkpoint.done.size() == options.regionCols * options.regionRows)
+		unlink(checkpoint.path.c_str());
+	else
+		writeCheckpoint();
+}
+
+/* SERVE SECTORS OF AN ENDLESS GALAXY, ONE REQUEST PER LINE OF INPUT */
+/*
+	Each line of standard input is "x y" for a whole sector or "x y XXYY"
+	for one system, at any sector coordinates. A sector is generated the
+	first time it is asked for, the same way a region run would generate
+	a sector at that position, and kept in the galaxy cache. After each
+	request the eight sectors around it are queued for the prefetch
+	thread, so moving across the map finds its next sector ready.
+*/
+void
+runGalaxy()
+{
+	string line;
+
+	startGalaxyCache((size_t)options.cacheMB << 20);
+
+	while (getline (cin, line))
+	{
+		int secX, secY;
+		string hexNum;
+		istringstream request(line);
+
+		if (!(request >> secX >> secY)){
+			if (line.find_first_not_of(" \t\r") != string::npos)
+				cout << "#Error: expected \"x y [XXYY]\"\n" << flush;
+			continue;
+		}
+		request >> hexNum;
+
+		shared_ptr<const galaxySector> sector = getGalaxySector(secX, secY);
+
+		if (hexNum.empty()){
+			cout << "#Sector: " << secX << " " << secY << "\n";
+			cout << formatVersion(options.outputFormat);
+			for (size_t i = 0; i < sector->systems.size(); i++)
+			{
+				writeSystemLine(cout, options.outputFormat, sector->systems[i]);
+				cout << "\n";
+			}
+			cout << "#End\n" << flush;
+		}else{
+			int hex = atoi(hexNum.c_str());
+			size_t i;
+			for (i = 0; i < sector->systems.size() && sector->systems[i].hex != hex; i++)
+				;
+			if (i == sector->systems.size()){
+				cout << "#None\n" << flush;
+			}else{
+				writeSystemLine(cout, options.outputFormat, sector->systems[i]);
+				cout << "\n" << flush;
+			}
+		}
+
+		prefetchGalaxySectors(secX, secY);
+	}
+
+	stopGalaxyCache();
+}
+
+/* START THE GALAXY CACHE AND ITS PREFETCH THREAD */
+void
+startGalaxyCache(size_t budget)
+{
+	galaxy.budget = budget;
+	galaxy.used = 0;
+	galaxy.stop = false;
+	jobSettings settings;
+	saveJobSettings(settings);
+	galaxy.worker = thread(galaxyPrefetchWorker, settings);
+}
+
+/* STOP THE PREFETCH THREAD */
+void
+stopGalaxyCache()
+{
+	{
+		lock_guard<mutex> hold(galaxy.lock);
+		galaxy.stop = true;
+		galaxy.prefetch.clear();
+	}
+	galaxy.wake.notify_all();
+	galaxy.worker.join();
+}
+
+/* GET A SECTOR OF THE GALAXY, GENERATING IT IF IT IS NOT CACHED */
+shared_ptr<const galaxySector>
+getGalaxySector(int secX, int secY)
+{
+	long long key = galaxyKey(secX, secY);
+	unique_lock<mutex> hold(galaxy.lock);
+
+	for (;;)
+	{
+		map<long long, list<shared_ptr<const galaxySector> >::iterator>::iterator found = galaxy.index.find(key);
+
+		if (found != galaxy.index.end()){
+			/* Most recently used goes to the front */
+			galaxy.lru.splice(galaxy.lru.begin(), galaxy.lru, found->second);
+			return *found->second;
+		}
+
+		/* The prefetch thread is already on it, wait for it */
+		if (galaxy.pending.count(key) == 0)
+			break;
+		galaxy.ready.wait(hold);
+	}
+
+	galaxy.pending.insert(key);
+	hold.unlock();
+
+	shared_ptr<const galaxySector> sector = buildGalaxySector(secX, secY);
+
+	hold.lock();
+	insertGalaxySector(key, sector);
+	return sector;
+}
+
+/* QUEUE THE SECTORS AROUND A SECTOR FOR THE PREFETCH THREAD */
+void
+prefetchGalaxySectors(int secX, int secY)
+{
+	{
+		lock_guard<mutex> hold(galaxy.lock);
+
+		/* Only the neighbours of the latest request are worth having */
+		galaxy.prefetch.clear();
+		for (int dy = -1; dy <= 1; dy++)
+		{
+			for (int dx = -1; dx <= 1; dx++)
+			{
+				long long key = galaxyKey(secX + dx, secY + dy);
+				if ((dx != 0 || dy != 0) && galaxy.index.count(key) == 0 && galaxy.pending.count(key) == 0)
+					galaxy.prefetch.push_back(key);
+			}
+		}
+	}
+	galaxy.wake.notify_one();
+}
+
+/* GENERATE QUEUED SECTORS IN THE BACKGROUND */
+void
+galaxyPrefetchWorker(jobSettings settings)
+{
+	loadJobSettings(settings);
+
+	unique_lock<mutex> hold(galaxy.lock);
+
+	for (;;)
+	{
+		while (!galaxy.stop && galaxy.prefetch.empty())
+			galaxy.wake.wait(hold);
+		if (galaxy.stop)
+			return;
+
+		long long key = galaxy.prefetch.front();
+		galaxy.prefetch.pop_front();
+
+		if (galaxy.index.count(key) != 0 || galaxy.pending.count(key) != 0)
+			continue;
+
+		galaxy.pending.insert(key);
+		hold.unlock();
+
+		shared_ptr<const galaxySector> sector = buildGalaxySector((int)(key >> 32), (int)(key & 0xffffffff));
+
+		hold.lock();
+		insertGalaxySector(key, sector);
+	}
+}
+
+/* GENERATE ONE SECTOR OF THE GALAXY */
+shared_ptr<const galaxySector>
+buildGalaxySector(int secX, int secY)
+{
+	shared_ptr<galaxySector> sector(new galaxySector);
+	stringstream name;
+
+	name << options.sectorName << "_" << secX << "_" << secY;
+
+	sector->secX = secX;
+	sector->secY = secY;
+	generateSectorSystems(secX, secY, name.str(), sector->systems);
+
+	/* Names are kept apart within the sector only, so the sector has the
+	   same names whenever it is generated, whatever came before it */
+	unordered_set<string> used;
+	for (size_t i = 0; i < sector->systems.size(); i++)
+		used.insert(sector->systems[i].name);
+
+	/* Rough memory use, for the cache budget */
+	sector->bytes = sizeof(galaxySector);
+	for (size_t i = 0; i < sector->systems.size(); i++)
+	{
+		generatedSystem &s = sector->systems[i];
+
+		if (!options.nameCorpusPath.empty() && s.name == "Unnamed"){
+			seedHex(secX, secY, s.hex, SEED_NAME);
+			s.name = generateName(nameWidth(options.outputFormat), used);
+		}
+
+		sector->bytes += sizeof(generatedSystem) + s.name.capacity() + s.UWP.capacity() +
+			s.codes.capacity() + s.allegiance.capacity();
+	}
+
+	return sector;
+}
+
+/* ADD A GENERATED SECTOR TO THE CACHE, CALLED WITH THE CACHE LOCKED */
+void
+insertGalaxySector(long long key, shared_ptr<const galaxySector> sector)
+{
+	galaxy.lru.push_front(sector);
+	galaxy.index[key] = galaxy.lru.begin();
+	galaxy.used += sector->bytes;
+	galaxy.pending.erase(key);
+
+	/* Drop the least recently used sectors until back within the budget.
+	   Anyone still holding one keeps it until they let it go. */
+	while (galaxy.used > galaxy.budget && galaxy.lru.size() > 1)
+	{
+		shared_ptr<const galaxySector> oldest = galaxy.lru.back();
+		galaxy.used -= oldest->bytes;
+		galaxy.index.erase(galaxyKey(oldest->secX, oldest->secY));
+		galaxy.lru.pop_back();
+	}
+
+	galaxy.ready.notify_all();
+}
+
+/* CACHE KEY OF A SECTOR POSITION */
+long long
+galaxyKey(int secX, int secY)
+{
+	return ((long long)secX << 32) | (unsigned)secY;
+}
+
+/* PLACE EVERY SYSTEM OF THE REGION ON THE REGION HEX GRID */
+void
+buildRegionHex()
+{
+	int width = options.regionCols * SECTOR_COLS;
+	int height = options.regionRows * SECTOR_ROWS;
+
+	regionHex.assign(width * height, -1);
+
+	for (size_t i = 0; i < regionSys.size(); i++)
+		regionHex[regionSys[i].regionY * width + regionSys[i].regionX] = i;
+}
+
+/* COUNT OR FILL IN THE JUMP ROUTES OF ONE SECTOR */
+void
+buildJumpGraphTile(int tile, void *arg)
+{
+	jumpGraphBuild *build = (jumpGraphBuild *)arg;
+	jumpGraph *graph = build->graph;
+	const sectorData &sec = regionSectors[tile];
+
+	for (int i = sec.first; i < sec.first + sec.count; i++)
+	{
+		int x = regionSys[i].regionX;
+		int y = regionSys[i].regionY;
+		int odd = x & 1;
+		int routes = 0;
+		int next = (build->fill ? graph->start[i] : 0);
+
+		for (size_t k = 0; k < build->dx[odd].size(); k++)
+		{
+			int nx = x + build->dx[odd][k];
+			int ny = y + build->dy[odd][k];
+
+			if (nx < 0 || ny < 0 || nx >= build->width || ny >= build->height)
+				continue;
+
+			int n = regionHex[ny * build->width + nx];
+			if (n < 0)
+				continue;
+
+			if (build->fill){
+				graph->dest[next] = n;
+				graph->dist[next] = build->dist[odd][k];
+				next++;
+			}
+			routes++;
+		}
+
+		if (!build->fill)
+			graph->start[i + 1] = routes;
+	}
+}
+
+/* BUILD THE GRAPH OF JUMP ROUTES BETWEEN SYSTEMS OF THE REGION */
+void
+buildJumpGraph(jumpGraph &graph, int jump)
+{
+	jumpGraphBuild build;
+	int n = regionSys.size();
+
+	if ((int)regionHex.size() != options.regionCols * SECTOR_COLS * options.regionRows * SECTOR_ROWS)
+		buildRegionHex();
+
+	jumpOffsets(jump, build.dx, build.dy, build.dist);
+
+	build.graph = &graph;
+	build.width = options.regionCols * SECTOR_COLS;
+	build.height = options.regionRows * SECTOR_ROWS;
+
+	graph.jump = jump;
+	graph.start.assign(n + 1, 0);
+
+	/* Count the routes of each system, then fill them in once the
+	   offsets into the route list are known */
+	build.fill = false;
+	parallelFor(regionSectors.size(), buildJumpGraphTile, &build);
+
+	for (int i = 0; i < n; i++)
+		graph.start[i + 1] += graph.start[i];
+
+	graph.dest.resize(graph.start[n]);
+	graph.dist.resize(graph.start[n]);
+
+	build.fill = true;
+	parallelFor(regionSectors.size(), buildJumpGraphTile, &build);
+}
+
+/* LIST THE HEX OFFSETS WITHIN JUMP RANGE */
+/*
+	Columns alternate up and down, so even and odd columns have their
+	own lists: dx, dy and the distance in parsecs of each offset.
+*/
+void
+jumpOffsets(int jump, vector<int> dx[2], vector<int> dy[2], vector<int> dist[2])
+{
+	for (int odd = 0; odd < 2; odd++)
+	{
+		for (int x = -jump; x <= jump; x++)
+		{
+			for (int y = -jump - 1; y <= jump + 1; y++)
+			{
+				int d = hexDistance(odd, 0, odd + x, y);
+				if (d == 0 || d > jump)
+					continue;
+				dx[odd].push_back(x);
+				dy[odd].push_back(y);
+				dist[odd].push_back(d);
+			}
+		}
+	}
+}
+
+/* GROW POLITIES OUTWARD FROM THEIR CAPITALS */
+/*
+	Every capital starts a multi-source flood over the jump-2 graph. A
+	system is claimed by the polity that reaches it for the lowest
+	growth cost: each jump costs twice its length plus a point for every
+	four population digits of the system entered, and smaller capitals
+	start with a handicap of twice their missing population. Growth
+	stops at POLITY_REACH, leaving the rest of the region non-aligned.
+
+	The flood runs in rounds, one sector per work item. Within a round a
+	sector runs Dijkstra over its own systems, seeded from its
+	neighbours' labels of the previous round, so no sector reads
+	anything another is writing. Rounds repeat until no label changes,
+	which gives the same result as a single flood over the region.
+*/
+void
+generateAllegiances()
+{
+	polityGrowth grow;
+	vector<string> codes;
+	vector<pair<int, int> > candidates;
+	int n = regionSys.size();
+	int rounds = 0;
+	bool changed;
+
+	buildJumpGraph(grow.graph, POLITY_JUMP);
+
+	grow.label.assign(n, NO_LABEL);
+	grow.entryCost.resize(n);
+	for (int i = 0; i < n; i++)
+		grow.entryCost[i] = hexValue(regionSys[i].UWP[4]) / 4;
+
+	/* Capitals given by the names file, every system sharing a code is a seed */
+	for (int i = 0; i < n; i++)
+	{
+		if (!regionSys[i].canon)
+			continue;
+
+		int p = find(codes.begin(), codes.end(), regionSys[i].allegiance) - codes.begin();
+		if (p == (int)codes.size()){
+			if (p == MAX_POLITIES)
+				continue;
+			codes.push_back(regionSys[i].allegiance);
+		}
+		grow.label[i] = polityLabel(i, p);
+	}
+
+	/* Random capitals among the most populous remaining systems */
+	seedHex(0, 0, 0, SEED_POLITY);
+	for (int i = 0; i < n; i++)
+	{
+		if (!regionSys[i].canon)
+			candidates.push_back(make_pair(hexValue(regionSys[i].UWP[4]) * 32768 + (int)(nextRandom() % 32768), i));
+	}
+	sort(candidates.rbegin(), candidates.rend());
+
+	int code = 0;
+	for (int k = 0; k < options.polities && k < (int)candidates.size() &&
+			(int)codes.size() < MAX_POLITIES; k++)
+	{
+		string newCode;
+		do {
+			newCode = string(1, 'A' + (code / 26) % 26) + (char)('a' + code % 26);
+			code++;
+		} while (find(codes.begin(), codes.end(), newCode) != codes.end());
+
+		grow.label[candidates[k].second] = polityLabel(candidates[k].second, codes.size());
+		codes.push_back(newCode);
+	}
+
+	/* Flood until every sector is stable */
+	grow.changed.resize(regionSectors.size());
+	do {
+		grow.prev = grow.label;
+		fill(grow.changed.begin(), grow.changed.end(), 0);
+
+		parallelFor(regionSectors.size(), growPolityTile, &grow);
+
+		changed = (find(grow.changed.begin(), grow.changed.end(), 1) != grow.changed.end());
+		rounds++;
+	} while (changed);
+
+	/* Systems the names file gave an allegiance keep it, even those
+	   past MAX_POLITIES that could not grow a polity */
+	for (int i = 0; i < n; i++)
+	{
+		if (regionSys[i].canon)
+			continue;
+		if (grow.label[i] == NO_LABEL)
+			regionSys[i].allegiance = "Na";
+		else
+			regionSys[i].allegiance = codes[grow.label[i] % MAX_POLITIES];
+	}
+
+	*report << "# of Polities: " << codes.size() << " (" << rounds << " rounds)\n";
+}
+
+/* GROWTH LABEL OF A CAPITAL: ITS HANDICAP AND POLITY NUMBER */
+int
+polityLabel(int capital, int polity)
+{
+	return (2 * (10 - hexValue(regionSys[capital].UWP[4]))) * MAX_POLITIES + polity;
+}
+
+/* RUN ONE ROUND OF POLITY GROWTH OVER ONE SECTOR */
+void
+growPolityTile(int tile, void *arg)
+{
+	polityGrowth *grow = (polityGrowth *)arg;
+	const jumpGraph &graph = grow->graph;
+	const sectorData &sec = regionSectors[tile];
+	int first = sec.first;
+	int last = sec.first + sec.count;
+	priority_queue<pair<int, int>, vector<pair<int, int> >, greater<pair<int, int> > > open;
+
+	/* Seed from the last round's labels, including those of systems just
+	   across the sector border */
+	for (int v = first; v < last; v++)
+	{
+		int best = grow->prev[v];
+
+		/* The names file has the last word on a system's allegiance */
+		for (int e = graph.start[v]; e < graph.start[v + 1] && !regionSys[v].canon; e++)
+		{
+			int u = graph.dest[e];
+			if ((u >= first && u < last) || grow->prev[u] == NO_LABEL)
+				continue;
+
+			int cand = grow->prev[u] + (2 * graph.dist[e] + grow->entryCost[v]) * MAX_POLITIES;
+			if (cand < best && cand / MAX_POLITIES <= POLITY_REACH)
+				best = cand;
+		}
+
+		grow->label[v] = best;
+		if (best != NO_LABEL)
+			open.push(make_pair(best, v));
+	}
+
+	while (!open.empty())
+	{
+		int l = open.top().first;
+		int v = open.top().second;
+		open.pop();
+
+		if (l != grow->label[v])
+			continue;
+
+		for (int e = graph.start[v]; e < graph.start[v + 1]; e++)
+		{
+			int u = graph.dest[e];
+			if (u < first || u >= last || regionSys[u].canon)
+				continue;
+
+			int cand = l + (2 * graph.dist[e] + grow->entryCost[u]) * MAX_POLITIES;
+			if (cand < grow->label[u] && cand / MAX_POLITIES <= POLITY_REACH){
+				grow->label[u] = cand;
+				open.push(make_pair(cand, u));
+			}
+		}
+	}
+
+	for (int v = first; v < last; v++)
+	{
+		if (grow->label[v] != grow->prev[v]){
+			grow->changed[tile] = 1;
+			break;
+		}
+	}
+}
+
+/* RUN THE REGION FORWARD IN TIME */
+/*
+	Every --yearStep years, each world may grow or lose population,
+	learn technology from richer neighbours within jump-2 that have a
+	starport to ship it through, have its starport built up or left to
+	decay, and gain or lose a travel zone. Each step reads the worlds as
+	they were at its start and writes them as they are at its end, so
+	the worlds of a step can be worked on in any order, in slices
+	across the threads, and still give the same answer. The dice of each
+	world and step come from the seed, the hex and the step, so the
+	result does not depend on the number of threads either. Trade codes
+	are worked out again at the end.
+*/
+void
+evolveRegion()
+{
+	evolveWork work;
+	int n = regionSys.size();
+	int changed = 0;
+
+	buildJumpGraph(work.graph, EVOLVE_JUMP);
+
+	work.state[0].resize(n);
+	work.state[1].resize(n);
+	for (int i = 0; i < n; i++)
+	{
+		const string &uwp = regionSys[i].UWP;
+		evolveWorld &w = work.state[0][i];
+
+		w.port = uwp[0];
+		w.pop = hexValue(uwp[4]);
+		w.gov = hexValue(uwp[5]);
+		w.law = hexValue(uwp[6]);
+		w.tl = hexValue(uwp[8]);
+		w.zone = regionSys[i].zone;
+	}
+
+	work.read = 0;
+	for (int year = 0, step = 0; year < options.years; year += options.yearStep, step++)
+	{
+		work.step = step;
+		work.years = min(options.yearStep, options.years - year);
+		parallelFor((n + EVOLVE_SLICE - 1) / EVOLVE_SLICE, evolveSlice, &work);
+		work.read ^= 1;
+	}
+
+	for (int i = 0; i < n; i++)
+	{
+		generatedSystem &s = regionSys[i];
+		const evolveWorld &w = work.state[work.read][i];
+		string uwp = s.UWP;
+
+		uwp[0] = w.port;
+		uwp[4] = hexChar(w.pop);
+		uwp[5] = hexChar(w.gov);
+		uwp[6] = hexChar(w.law);
+		uwp[8] = hexChar(w.tl);
+		if (uwp != s.UWP || w.zone != s.zone)
+			changed++;
+		s.UWP = uwp;
+		s.zone = w.zone;
+
+		int codes = tradeBits(hexValue(uwp[1]), hexValue(uwp[2]), hexValue(uwp[3]), w.pop, w.gov, w.law);
+		s.codes = "";
+		for (int c = 0; c < NUM_TRADE_CODES; c++)
+			if (codes & (1 << c))
+				s.codes = s.codes + tradeCodeNames[c] + " ";
+	}
+
+	*report << "Evolution: " << options.years << " years, " << changed << " of " << n << " worlds changed\n";
+}
+
+/* RUN ONE SLICE OF THE WORLDS THROUGH ONE STEP */
+void
+evolveSlice(int slice, void *arg)
+{
+	static const char ports[] = "XEDCBA";
+	/* Population and tech level a starport needs to be built up to each class */
+	static const int portPop[6] = {0, 1, 3, 5, 6, 7};
+	static const int portTL[6] = {0, 0, 0, 5, 8, 10};
+
+	evolveWork &work = *(evolveWork *)arg;
+	const vector<evolveWorld> &was = work.state[work.read];
+	vector<evolveWorld> &now = work.state[work.read ^ 1];
+	int first = slice * EVOLVE_SLICE;
+	int last = min(first + EVOLVE_SLICE, (int)was.size());
+
+	for (int i = first; i < last; i++)
+	{
+		const generatedSystem &s = regionSys[i];
+		evolveWorld w = was[i];
+		/* A class a ruleset adds beyond X to A is left as it is, and counts as an E starport */
+		const char *known = (w.port != '\0' ? strchr(ports, w.port) : NULL);
+		int port = (known != NULL ? known - ports : 1);
+		int bestTL = w.tl;
+		bool settled = false;
+
+		seedHex(s.regionX / SECTOR_COLS, s.regionY / SECTOR_ROWS, s.hex, SEED_EVOLVE);
+		rngState = mixBits(rngState ^ (unsigned)work.step);
+
+		/* What the neighbours had at the start of the step */
+		for (int r = work.graph.start[i]; r < work.graph.start[i + 1]; r++)
+		{
+			const evolveWorld &near = was[work.graph.dest[r]];
+			if ((near.port == 'A' || near.port == 'B') && near.tl > bestTL)
+				bestTL = near.tl;
+			if (near.pop >= 6)
+				settled = true;
+		}
+
+		/* Population: technology and a working starport help it grow */
+		if (w.pop == 0){
+			if (settled && port > 0 && evolveChance(5, work.years))
+				w.pop = 1;
+		}else if (w.pop < 10 && evolveChance(4 + w.tl * 0.5, work.years)){
+			w.pop++;
+		}else if (evolveChance((w.zone == 'R' ? 12 : 2) + (w.tl < 5 && w.pop >= 8 ? 6 : 0), work.years)){
+			w.pop--;
+			if (w.pop == 0)
+				w.gov = w.law = 0;
+		}
+
+		/* Technology: learnt through a neighbour's A or B starport, or found at home */
+		if (w.pop > 0 && port > 0 && bestTL > w.tl && evolveChance(5 * (bestTL - w.tl) + (port >= 4 ? 10 : 0), work.years))
+			w.tl++;
+		else if (w.pop >= 5 && w.tl < 16 && evolveChance(3, work.years))
+			w.tl++;
+		else if (w.pop == 0 && w.tl > 0 && evolveChance(20, work.years))
+			w.tl--;
+
+		/* Starport: built up a class at a time as the world can support it, left to decay when abandoned */
+		if (known == NULL)
+			;
+		else if (port < 5 && w.pop >= portPop[port + 1] && w.tl >= portTL[port + 1] && evolveChance(20, work.years))
+			port++;
+		else if (w.pop == 0 && port > 0 && evolveChance(30, work.years))
+			port--;
+
+		/* Zones: a red zone lasts while there is no starport, amber zones come and go */
+		if (port == 0)
+			w.zone = 'R';
+		else if (w.zone == 'R' && evolveChance(25, work.years))
+			w.zone = 'A';
+		else if (w.zone == 'A' && evolveChance(30, work.years))
+			w.zone = ' ';
+		else if (w.zone == ' ' && evolveChance(3 + (w.law >= 10 ? 10 : 0), work.years))
+			w.zone = 'A';
+
+		if (known != NULL)
+			w.port = ports[port];
+		now[i] = w;
+	}
+}
+
+/* ROLL FOR SOMETHING WITH A GIVEN PERCENT CHANCE PER DECADE, OVER years */
+bool
+evolveChance(double perDecade, int years)
+{
+	double chance = 1.0 - pow(1.0 - min(perDecade, 100.0) / 100.0, years / 10.0);
+
+	return ((nextRandom() >> 11) * (1.0 / 9007199254740992.0) < chance);
+}
+
+/* PLAN A ROUTE THROUGH THE WAYPOINTS GIVEN ON THE COMMAND LINE */
+void
+planRoutes()
+{
+	routeSearch search;
+	vector<int> waypoints;
+	string hex;
+	string list = options.route;
+
+	replace(list.begin(), list.end(), ',', ' ');
+	istringstream hexes(list);
+
+	while (hexes >> hex)
+	{
+		int i = findSystem(hex);
+		if (i < 0){
+			cerr << "Route: no system at " << hex << "\n";
+			return;
+		}
+		waypoints.push_back(i);
+	}
+
+	if (waypoints.size() < 2){
+		cerr << "Route: needs a start and a destination hex\n";
+		return;
+	}
+
+	initRouteSearch(search, options.jump);
+
+	*report << "Route, jump-" << options.jump << ":\n";
+
+	for (size_t w = 1; w < waypoints.size(); w++)
+	{
+		vector<int> path;
+		int parsecs = 0;
+
+		if (findRoute(search, waypoints[w - 1], waypoints[w], path) < 0){
+			*report << "  No route from " << systemLabel(waypoints[w - 1]) << " to " <<
+				systemLabel(waypoints[w]) << "\n";
+			continue;
+		}
+
+		for (size_t k = 0; k < path.size(); k++)
+		{
+			const generatedSystem &s = regionSys[path[k]];
+
+			if (k > 0)
+				parsecs += hexDistance(regionSys[path[k - 1]].regionX, regionSys[path[k - 1]].regionY,
+					s.regionX, s.regionY);
+
+			*report << "  " << setw(18) << setiosflags(ios::left) << setfill(' ') << systemLabel(path[k]) << " ";
+			*report << setw(14) << s.name << " " << s.UWP;
+			if (k > 0 && k + 1 < path.size())
+				*report << (search.refuel[path[k]] ? "  refuel" : "  no fuel");
+			*report << resetiosflags(ios::left) << "\n";
+		}
+		*report << "  " << path.size() - 1 << " jumps, " << parsecs << " parsecs\n";
+	}
+}
+
+/* SET UP THE SEARCH BUFFERS FOR ROUTES AT A GIVEN JUMP RATING */
+void
+initRouteSearch(routeSearch &search, int jump)
+{
+	int n = regionSys.size();
+
+	buildJumpGraph(search.graph, jump);
+
+	/* Ships refuel from a starport that sells fuel, by skimming a gas
+	   giant, or from surface water */
+	search.refuel.resize(n);
+	search.axialQ.resize(n);
+	search.axialR.resize(n);
+	for (int i = 0; i < n; i++)
+	{
+		const generatedSystem &s = regionSys[i];
+		search.refuel[i] = (s.UWP[0] <= 'D' || s.PBG % 10 > 0 || hexValue(s.UWP[3]) > 0);
+
+		/* Axial hex coordinates, so the heuristic is a few subtractions */
+		search.axialQ[i] = s.regionX;
+		search.axialR[i] = s.regionY - (s.regionX - (s.regionX & 1)) / 2;
+	}
+
+	/* One state for each system and amount of fuel left, in parsecs */
+	search.cost.assign(n * (jump + 1), 0);
+	search.from.assign(n * (jump + 1), -1);
+	search.visited.assign(n * (jump + 1), 0);
+	search.searchNum = 0;
+	search.open.clear();
+}
+
+/* FIND THE ROUTE WITH FEWEST JUMPS, THEN FEWEST PARSECS, BETWEEN TWO SYSTEMS */
+/*
+	A* over (system, fuel left) states. The tanks hold fuel for one jump
+	at the full rating; a jump of n parsecs burns n, and the tanks are
+	filled wherever fuel is available. Costs are jumps in the high word
+	and parsecs in the low word, with the heuristic the hex distance to
+	the goal in both. Buffers are stamped with the search number instead
+	of being cleared, so each query only touches the states it reaches.
+	Returns the number of jumps and the systems along the route, or -1.
+*/
+int
+findRoute(routeSearch &search, int start, int goal, vector<int> &path)
+{
+	const jumpGraph &graph = search.graph;
+	int jump = graph.jump;
+	int states = jump + 1;
+
+	path.clear();
+
+	if (++search.searchNum == 0){
+		fill(search.visited.begin(), search.visited.end(), 0);
+		search.searchNum = 1;
+	}
+
+	search.open.clear();
+
+	int first = start * states + jump;
+	search.visited[first] = search.searchNum;
+	search.cost[first] = 0;
+	search.from[first] = -1;
+	search.open.push_back(make_pair(-routeHeuristic(search, start, goal), first));
+
+	while (!search.open.empty())
+	{
+		pop_heap(search.open.begin(), search.open.end());
+		long long f = -search.open.back().first;
+		int state = search.open.back().second;
+		search.open.pop_back();
+
+		int v = state / states;
+		int fuel = state % states;
+		long long g = search.cost[state];
+
+		/* Skip stale heap entries */
+		if (f != g + routeHeuristic(search, v, goal))
+			continue;
+
+		if (v == goal){
+			for (; state >= 0; state = search.from[state])
+				path.push_back(state / states);
+			reverse(path.begin(), path.end());
+			return path.size() - 1;
+		}
+
+		for (int e = graph.start[v]; e < graph.start[v + 1]; e++)
+		{
+			int d = graph.dist[e];
+			if (d > fuel)
+				continue;
+
+			int u = graph.dest[e];
+			int next = u * states + (search.refuel[u] ? jump : fuel - d);
+			long long cost = g + (1LL << 32) + d;
+
+			if (search.visited[next] == search.searchNum && search.cost[next] <= cost)
+				continue;
+
+			search.visited[next] = search.searchNum;
+			search.cost[next] = cost;
+			search.from[next] = state;
+			search.open.push_back(make_pair(-(cost + routeHeuristic(search, u, goal)), next));
+			push_heap(search.open.begin(), search.open.end());
+		}
+	}
+	return(-1);
+}
+
+/* LOWER BOUND ON THE JUMPS AND PARSECS LEFT TO THE GOAL */
+long long
+routeHeuristic(const routeSearch &search, int from, int goal)
+{
+	int dq = search.axialQ[from] - search.axialQ[goal];
+	int dr = search.axialR[from] - search.axialR[goal];
+	int d = (abs(dq) + abs(dr) + abs(dq + dr)) / 2;
+
+	return ((long long)((d + search.graph.jump - 1) / search.graph.jump) << 32) + d;
+}
+
+/* FIND THE SYSTEM AT A HEX GIVEN AS [sectorName/]XXYY */
+int
+findSystem(const string &hex)
+{
+	int secIndex = 0;
+	string hexNum = hex;
+	size_t slash = hex.rfind('/');
+
+	if (slash != string::npos){
+		string secName = hex.substr(0, slash);
+		for (secIndex = 0; secIndex < (int)regionSectors.size(); secIndex++){
+			if (regionSectors[secIndex].name == secName)
+				break;
+		}
+		if (secIndex == (int)regionSectors.size())
+			return(-1);
+		hexNum = hex.substr(slash + 1);
+	}
+
+	if (regionSectors.empty() || hexNum.size() != 4 ||
+	    hexNum.find_first_not_of("0123456789") != string::npos)
+		return(-1);
+
+	int x = atoi(hexNum.substr(0, 2).c_str());
+	int y = atoi(hexNum.substr(2, 2).c_str());
+	if (x < 1 || x > SECTOR_COLS || y < 1 || y > SECTOR_ROWS)
+		return(-1);
+
+	if ((int)regionHex.size() != options.regionCols * SECTOR_COLS * options.regionRows * SECTOR_ROWS)
+		buildRegionHex();
+
+	int rx = regionSectors[secIndex].secX * SECTOR_COLS + x - 1;
+	int ry = regionSectors[secIndex].secY * SECTOR_ROWS + y - 1;
+
+	return regionHex[ry * options.regionCols * SECTOR_COLS + rx];
+}
+
+/* HEX OF A SYSTEM, QUALIFIED WITH ITS SECTOR WHEN GENERATING A REGION */
+string
+systemLabel(int i)
+{
+	stringstream label;
+	const generatedSystem &s = regionSys[i];
+
+	if (regionSectors.size() > 1)
+		label << options.sectorName << "_" << s.regionX / SECTOR_COLS << "_" << s.regionY / SECTOR_ROWS << "/";
+	label << setw(4) << setfill('0') << s.hex;
+
+	return label.str();
+}
+
+/* WORK OUT TRADE BETWEEN THE SYSTEMS OF THE REGION */
+/*
+	After the World and Bilateral Trade Numbers of GURPS Far Trader,
+	kept in half steps so everything stays in integers:
+
+	WTN = population/2, +TL DM (0-1: -.5, 6-8: +.5, 9-11: +1, 12-14:
+	      +1.5, 15+: +2), +starport DM (A: +1, B: +.5, E: -.5, X: -1)
+	BTN = WTN + WTN of the partner, +.5 for Ag trading with Na or In
+	      and for In trading with Ni, -.5 across a polity border,
+	      -distance DM (1: 0, 2: .5, 3-5: 1, 6-9: 1.5, 10+: 2), and no
+	      more than the smaller WTN + 5.
+
+	Only pairs within the trade jump range are considered, found from
+	the jump graph one sector at a time, so the work grows with the
+	number of systems rather than the number of pairs in the region.
+	A BTN of 12 or more is a major route, 10 or more a main route.
+	Trade volume is taken as 10^(BTN/2) thousand credits a year.
+*/
+void
+generateTrade()
+{
+	tradeWork work;
+	int n = regionSys.size();
+	int major = 0;
+
+	buildJumpGraph(work.graph, options.tradeJump);
+
+	work.wtn.resize(n);
+	work.mask.resize(n);
+	for (int i = 0; i < n; i++)
+	{
+		const generatedSystem &s = regionSys[i];
+		int tl = hexValue(s.UWP[8]);
+		int wtn = hexValue(s.UWP[4]);
+
+		wtn += ((tl < 2) ? -1 : ((tl < 6) ? 0 : ((tl < 9) ? 1 : ((tl < 12) ? 2 : ((tl < 15) ? 3 : 4)))));
+		wtn += DM(s.UWP[0] == 'A', 2) + DM(s.UWP[0] == 'B', 1) +
+			DM(s.UWP[0] == 'E', -1) + DM(s.UWP[0] == 'X', -2);
+
+		work.wtn[i] = max(wtn, 0);
+		work.mask[i] = tradeMask(s.codes);
+	}
+
+	work.routes.resize(regionSectors.size());
+	work.volume.assign(n, 0.0);
+
+	parallelFor(regionSectors.size(), generateTradeTile, &work);
+
+	/* Gather the routes in sector order and total each system's trade */
+	vector<tradeRoute> routes;
+	for (size_t t = 0; t < work.routes.size(); t++)
+		routes.insert(routes.end(), work.routes[t].begin(), work.routes[t].end());
+
+	for (size_t r = 0; r < routes.size(); r++)
+	{
+		double volume = 1000.0 * pow(10.0, routes[r].btn / 4.0);
+		work.volume[routes[r].from] += volume;
+		work.volume[routes[r].to] += volume;
+		if (routes[r].btn >= 24)
+			major++;
+	}
+
+	stable_sort(routes.begin(), routes.end(), tradeRouteOrder);
+	writeTradeFile(routes, work.volume);
+
+	*report << "# of Trade routes: " << routes.size() << " (" << major << " major)\n";
+}
+
+/* FIND THE MAIN AND MAJOR TRADE ROUTES STARTING IN ONE SECTOR */
+void
+generateTradeTile(int tile, void *arg)
+{
+	tradeWork *work = (tradeWork *)arg;
+	const jumpGraph &graph = work->graph;
+	const sectorData &sec = regionSectors[tile];
+	vector<tradeRoute> &routes = work->routes[tile];
+
+	for (int a = sec.first; a < sec.first + sec.count; a++)
+	{
+		for (int e = graph.start[a]; e < graph.start[a + 1]; e++)
+		{
+			int b = graph.dest[e];
+			int d = graph.dist[e];
+
+			/* Count each pair once, from its lower numbered system */
+			if (b < a)
+				continue;
+
+			int btn = work->wtn[a] + work->wtn[b];
+			int ma = work->mask[a];
+			int mb = work->mask[b];
+
+			btn += DM(((ma & TC_AG) && (mb & (TC_NA | TC_IN))) || ((mb & TC_AG) && (ma & (TC_NA | TC_IN))), 1);
+			btn += DM(((ma & TC_IN) && (mb & TC_NI)) || ((mb & TC_IN) && (ma & TC_NI)), 1);
+			btn += DM(regionSys[a].allegiance != regionSys[b].allegiance, -1);
+			btn -= ((d < 2) ? 0 : ((d < 3) ? 1 : ((d < 6) ? 2 : ((d < 10) ? 3 : 4))));
+			btn = min(btn, min(work->wtn[a], work->wtn[b]) + 10);
+
+			if (btn >= 20){
+				tradeRoute route;
+				route.from = a;
+				route.to = b;
+				route.dist = d;
+				route.btn = btn;
+				routes.push_back(route);
+			}
+		}
+	}
+}
+
+/* ORDER TRADE ROUTES BY TRADE NUMBER, BUSIEST FIRST */
+bool
+tradeRouteOrder(const tradeRoute &a, const tradeRoute &b)
+{
+	return (a.btn > b.btn);
+}
+
+/* WRITE THE TRADE ROUTES FILE */
+void
+writeTradeFile(const vector<tradeRoute> &routes, const vector<double> &volume)
+{
+	string outFile = regionFilePath(".trade");
+	*report << "Trade file: " << outFile << "\n";
+
+	ofstream out(outFile.c_str());
+
+	out << "#Trade: jump-" << options.tradeJump << "\n";
+	out << "#From              To                 Pc  BTN  Route\n";
+
+	for (size_t r = 0; r < routes.size(); r++)
+	{
+		out << setw(18) << setiosflags(ios::left) << setfill(' ') << systemLabel(routes[r].from) << " ";
+		out << setw(18) << systemLabel(routes[r].to) << " ";
+		out << setw(2) << resetiosflags(ios::left) << routes[r].dist << " ";
+		out << setw(4) << fixed << setprecision(1) << routes[r].btn / 2.0 << "  ";
+		out << ((routes[r].btn >= 24) ? "Major" : "Main") << "\n";
+	}
+
+	/* Annual trade through each system on those routes, in MCr */
+	out << "#System             MCr/year\n";
+	for (size_t i = 0; i < volume.size(); i++)
+	{
+		if (volume[i] == 0.0)
+			continue;
+		out << setw(18) << setiosflags(ios::left) << systemLabel(i) << " ";
+		out << setw(10) << resetiosflags(ios::left) << fixed << setprecision(0) << volume[i] / 1.0e6 << "\n";
+	}
+	out.close();
+}
+
+/* PATH FOR A FILE COVERING THE WHOLE RUN, NEXT TO THE SECTOR FILES */
+string
+regionFilePath(const string &ext)
+{
+	/* With the sector files on standard output, the rest go in the current directory */
+	if (options.outputPath == "-")
+		return options.sectorName + ext;
+
+	if (regionSectors.size() > 1)
+		return options.outputPath + options.sectorName + ext;
+
+	size_t dot = options.outputPath.rfind('.');
+	size_t slash = options.outputPath.rfind('/');
+	if (dot == string::npos || (slash != string::npos && dot < slash))
+		return options.outputPath + ext;
+	return options.outputPath.substr(0, dot) + ext;
+}
+
+/* LINK THE IMPORTANT SYSTEMS OF THE REGION WITH X-BOAT ROUTES */
+/*
+	Systems with an A or B starport or a population of 9+ are linked by
+	the minimum spanning forest of their jump-4 connections, shortest
+	jumps first. The connections come from the jump graph, so only pairs
+	within jump range are ever looked at. The forest is grown with
+	Boruvka's method: every round each network picks its shortest link
+	to another network, in parallel over slices of the edge list, and
+	the picks are joined. Ties go to the lower edge number, so the
+	result does not depend on the number of threads.
+*/
+void
+generateXboatRoutes()
+{
+	xboatWork work;
+	jumpGraph graph;
+	int n = regionSys.size();
+	int rounds = 0;
+	bool joined = true;
+	vector<tradeRoute> routes;
+
+	buildJumpGraph(graph, XBOAT_JUMP);
+
+	/* Collect links between important systems one sector at a time */
+	work.graph = &graph;
+	work.important.resize(n);
+	for (int i = 0; i < n; i++)
+		work.important[i] = (regionSys[i].UWP[0] <= 'B' || hexValue(regionSys[i].UWP[4]) >= 9);
+
+	work.tileEdges.resize(regionSectors.size());
+	parallelFor(regionSectors.size(), collectXboatEdges, &work);
+
+	for (size_t t = 0; t < work.tileEdges.size(); t++)
+		work.edges.insert(work.edges.end(), work.tileEdges[t].begin(), work.tileEdges[t].end());
+	work.tileEdges.clear();
+
+	work.parent.resize(n);
+	work.comp.resize(n);
+	for (int i = 0; i < n; i++)
+		work.parent[i] = i;
+
+	work.cheapest = new atomic<long long>[n];
+	work.numSlices = min((int)work.edges.size(), options.threads * 8);
+
+	while (joined && work.numSlices > 0)
+	{
+		joined = false;
+
+		for (int i = 0; i < n; i++){
+			work.comp[i] = findNetwork(work.parent, i);
+			work.cheapest[i] = NO_EDGE;
+		}
+
+		parallelFor(work.numSlices, findCheapestXboatEdges, &work);
+
+		for (int i = 0; i < n; i++)
+		{
+			if (work.comp[i] != i || work.cheapest[i] == NO_EDGE)
+				continue;
+
+			const tradeRoute &edge = work.edges[work.cheapest[i] & 0xffffffffLL];
+			int a = findNetwork(work.parent, edge.from);
+			int b = findNetwork(work.parent, edge.to);
+
+			if (a != b){
+				work.parent[max(a, b)] = min(a, b);
+				routes.push_back(edge);
+				joined = true;
+			}
+		}
+		rounds++;
+	}
+
+	delete [] work.cheapest;
+
+	sort(routes.begin(), routes.end(), xboatRouteOrder);
+	writeXboatFile(routes);
+
+	*report << "# of X-boat routes: " << routes.size() << " (" << rounds << " rounds)\n";
+}
+
+/* COLLECT THE LINKS BETWEEN IMPORTANT SYSTEMS STARTING IN ONE SECTOR */
+void
+collectXboatEdges(int tile, void *arg)
+{
+	xboatWork *work = (xboatWork *)arg;
+	const jumpGraph &graph = *work->graph;
+	const sectorData &sec = regionSectors[tile];
+
+	for (int a = sec.first; a < sec.first + sec.count; a++)
+	{
+		if (!work->important[a])
+			continue;
+
+		for (int e = graph.start[a]; e < graph.start[a + 1]; e++)
+		{
+			int b = graph.dest[e];
+			if (b < a || !work->important[b])
+				continue;
+
+			tradeRoute edge;
+			edge.from = a;
+			edge.to = b;
+			edge.dist = graph.dist[e];
+			edge.btn = 0;
+			work->tileEdges[tile].push_back(edge);
+		}
+	}
+}
+
+/* FIND EACH NETWORK'S SHORTEST LINK WITHIN ONE SLICE OF THE EDGE LIST */
+void
+findCheapestXboatEdges(int slice, void *arg)
+{
+	xboatWork *work = (xboatWork *)arg;
+	long long numEdges = work->edges.size();
+	long long first = numEdges * slice / work->numSlices;
+	long long last = numEdges * (slice + 1) / work->numSlices;
+
+	for (long long e = first; e < last; e++)
+	{
+		const tradeRoute &edge = work->edges[e];
+		int a = work->comp[edge.from];
+		int b = work->comp[edge.to];
+
+		if (a == b)
+			continue;
+
+		/* Shorter jumps first, then lower edge numbers */
+		long long key = ((long long)edge.dist << 32) | e;
+
+		for (int end = 0; end < 2; end++)
+		{
+			atomic<long long> &best = work->cheapest[end ? b : a];
+			long long current = best.load();
+			while (key < current && !best.compare_exchange_weak(current, key))
+				;
+		}
+	}
+}
+
+/* FIND THE NETWORK A SYSTEM BELONGS TO */
+int
+findNetwork(vector<int> &parent, int i)
+{
+	while (parent[i] != i)
+	{
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+	return i;
+}
+
+/* ORDER X-BOAT ROUTES BY THE SYSTEMS THEY LINK */
+bool
+xboatRouteOrder(const tradeRoute &a, const tradeRoute &b)
+{
+	return (a.from < b.from || (a.from == b.from && a.to < b.to));
+}
+
+/* WRITE THE X-BOAT ROUTES FILE */
+void
+writeXboatFile(const vector<tradeRoute> &routes)
+{
+	string outFile = regionFilePath(".routes");
+	*report << "Routes file: " << outFile << "\n";
+
+	ofstream out(outFile.c_str());
+
+	out << "#Routes: xboat jump-" << XBOAT_JUMP << "\n";
+	out << "#Start             End                Pc\n";
+
+	for (size_t r = 0; r < routes.size(); r++)
+	{
+		out << setw(18) << setiosflags(ios::left) << setfill(' ') << systemLabel(routes[r].from) << " ";
+		out << setw(18) << systemLabel(routes[r].to) << " ";
+		out << setw(2) << resetiosflags(ios::left) << routes[r].dist << "\n";
+	}
+	out.close();
+}
+
+/* ANSWER A QUERY OVER THE WORLDS OF THE REGION */
+/*
+	A query is a list of terms joined by ',', as parseWorldTerm() reads
+	them, plus jumpN(query) for worlds within N parsecs of a world that
+	matches the inner query. So "Ri,base=ABDN,jump2(port=A)" finds rich
+	worlds with a naval base within jump-2 of an A starport. The worlds
+	are copied into one column per field, and each term is a scan of its
+	column into a bitmask, 64 worlds to a word, across all the threads.
+	The matching worlds are written in the output format chosen.
+*/
+void
+runQuery()
+{
+	worldQuery query;
+	worldColumns cols;
+
+	if (!parseQuery(options.query, query)){
+		cerr << "Bad query: " << options.query << "\n";
+		return;
+	}
+
+	buildWorldColumns(cols);
+
+	vector<unsigned long long> match;
+	scanQuery(cols, query, match);
+
+	writeQueryFile(match, regionRow, NULL);
+}
+
+/* PARSE A QUERY, SPLITTING TERMS ON THE COMMAS OUTSIDE BRACKETS */
+bool
+parseQuery(const string &text, worldQuery &query)
+{
+	size_t start = 0;
+	int depth = 0;
+
+	clearWorldFilter(query.is);
+
+	for (size_t i = 0; i <= text.size(); i++)
+	{
+		if (i < text.size() && text[i] == '(')
+			depth++;
+		if (i < text.size() && text[i] == ')' && --depth < 0)
+			return false;
+		if (i < text.size() && (text[i] != ',' || depth > 0))
+			continue;
+
+		string term = text.substr(start, i - start);
+		start = i + 1;
+
+		term.erase(0, term.find_first_not_of(" "));
+		size_t open = term.find('(');
+
+		if (term.compare(0, 4, "jump") == 0 && open != string::npos){
+			/* jumpN(query) */
+			size_t close = term.rfind(')');
+			int jump = atoi(term.substr(4, open - 4).c_str());
+			worldQuery near;
+
+			if (jump < 1 || jump > 6 || close == string::npos || term.find_first_not_of(" ", close + 1) != string::npos ||
+			    !parseQuery(term.substr(open + 1, close - open - 1), near))
+				return false;
+			query.nearJump.push_back(jump);
+			query.near.push_back(near);
+		}else if (!parseWorldTerm(term, query.is)){
+			return false;
+		}
+	}
+	return (depth == 0);
+}
+
+/* COPY THE WORLDS OF THE REGION INTO COLUMNS */
+void
+buildWorldColumns(worldColumns &cols)
+{
+	cols.count = regionSys.size();
+	cols.archive = NULL;
+
+	for (int d = 0; d < FILTER_DIGITS; d++)
+		cols.digit[d].resize(cols.count);
+	cols.port.resize(cols.count);
+	cols.base.resize(cols.count);
+	cols.zone.resize(cols.count);
+	cols.codes.resize(cols.count);
+	cols.x.resize(cols.count);
+	cols.y.resize(cols.count);
+
+	parallelFor(regionSectors.size(), buildWorldColumnsTile, &cols);
+}
+
+/* COPY THE WORLDS OF ONE SECTOR INTO COLUMNS */
+void
+buildWorldColumnsTile(int tile, void *arg)
+{
+	worldColumns &cols = *(worldColumns *)arg;
+	const sectorData &sec = regionSectors[tile];
+
+	for (int i = sec.first; i < sec.first + sec.count; i++)
+	{
+		const generatedSystem &s = regionSys[i];
+
+		/* UWP is "A123456-7" */
+		cols.port[i] = s.UWP[0];
+		for (int d = 0; d < 6; d++)
+			cols.digit[d][i] = hexValue(s.UWP[d + 1]);
+		cols.digit[6][i] = hexValue(s.UWP[8]);
+		cols.digit[FILTER_BELTS][i] = (s.PBG / 10) % 10;
+		cols.digit[FILTER_BELTS + 1][i] = s.PBG % 10;
+		cols.base[i] = s.base;
+		cols.zone[i] = s.zone;
+		cols.codes[i] = tradeMask(s.codes);
+		cols.x[i] = s.regionX;
+		cols.y[i] = s.regionY;
+	}
+}
+
+/* FIND THE WORLDS THAT MATCH A QUERY, AS A BITMASK */
+void
+scanQuery(const worldColumns &cols, const worldQuery &query, vector<unsigned long long> &match)
+{
+	queryScan scan;
+
+	scan.cols = &cols;
+	scan.query = &query;
+	scan.match = &match;
+
+	/* Any letter matches an empty list */
+	for (int c = 0; c < 256; c++)
+	{
+		scan.ports[c] = allows(query.is.ports, c);
+		scan.bases[c] = allows(query.is.bases, c);
+		scan.zones[c] = allows(query.is.zones, c);
+	}
+
+	/* Worlds near a match of each inner query, marked on the region hex grid */
+	int width = options.regionCols * SECTOR_COLS;
+	scan.near.resize(query.near.size());
+	scan.nearHex.resize(query.near.size());
+	for (size_t n = 0; n < query.near.size(); n++)
+	{
+		scanQuery(cols, query.near[n], scan.near[n]);
+
+		scan.nearHex[n].assign(width * options.regionRows * SECTOR_ROWS, 0);
+		for (size_t w = 0; w < scan.near[n].size(); w++)
+		{
+			for (unsigned long long bits = scan.near[n][w]; bits != 0; bits &= bits - 1)
+			{
+				int j = w * 64 + __builtin_ctzll(bits);
+				scan.nearHex[n][cols.y[j] * width + cols.x[j]] = 1;
+			}
+		}
+	}
+
+	match.assign((cols.count + 63) / 64, ~0ULL);
+	if (cols.count % 64 != 0)
+		match.back() = (1ULL << (cols.count % 64)) - 1;
+
+	/* Blocks of an archive the statistics rule out are never scanned */
+	if (cols.archive != NULL){
+		for (int b = 0; b < cols.archive->numBlocks; b++)
+		{
+			if (!archiveBlockMatches(*cols.archive, query.is, b))
+				fill(match.begin() + b * (ARCHIVE_BLOCK / 64),
+					match.begin() + min((b + 1) * (ARCHIVE_BLOCK / 64), (int)match.size()), 0ULL);
+		}
+	}
+
+	parallelFor((match.size() + QUERY_SLICE - 1) / QUERY_SLICE, scanQueryTile, &scan);
+}
+
+/* SCAN ONE SLICE OF THE COLUMNS */
+void
+scanQueryTile(int slice, void *arg)
+{
+	queryScan &scan = *(queryScan *)arg;
+	const worldColumns &cols = *scan.cols;
+	const worldFilter &is = scan.query->is;
+	unsigned long long *match = scan.match->data();
+	int firstWord = slice * QUERY_SLICE;
+	int lastWord = min(firstWord + QUERY_SLICE, (int)scan.match->size());
+
+	/* One column at a time, skipping the terms that allow anything */
+	for (int d = 0; d < FILTER_DIGITS; d++)
+	{
+		if (is.low[d] > 0 || is.high[d] < filterDigitMax[d])
+			scanRange(cols.digit[d].data(), cols.count, is.low[d], is.high[d], match, firstWord, lastWord);
+	}
+	if (!is.ports.empty())
+		scanLetters(cols.port.data(), cols.count, scan.ports, match, firstWord, lastWord);
+	if (!is.bases.empty())
+		scanLetters(cols.base.data(), cols.count, scan.bases, match, firstWord, lastWord);
+	if (!is.zones.empty())
+		scanLetters(cols.zone.data(), cols.count, scan.zones, match, firstWord, lastWord);
+	if (is.needCodes != 0 || is.banCodes != 0)
+		scanCodes(cols.codes.data(), cols.count, is.needCodes, is.banCodes, match, firstWord, lastWord);
+
+	/* Then the few worlds left are checked for neighbours */
+	for (size_t n = 0; n < scan.near.size(); n++)
+		scanNear(cols, scan.query->nearJump[n], scan.nearHex[n], match, firstWord, lastWord);
+}
+
+/* KEEP THE WORLDS WITH A COLUMN VALUE FROM low TO high */
+void
+scanRange(const unsigned char *col, int count, int low, int high, unsigned long long *match, int firstWord, int lastWord)
+{
+	unsigned char span = high - low;
+
+	for (int w = firstWord; w < lastWord; w++)
+	{
+		const unsigned char *v = col + w * 64;
+		int n = min(64, count - w * 64);
+		unsigned long long bits = 0;
+
+		if (match[w] == 0)
+			continue;
+		for (int b = 0; b < n; b++)
+			bits |= (unsigned long long)((unsigned char)(v[b] - low) <= span) << b;
+		match[w] &= bits;
+	}
+}
+
+/* KEEP THE WORLDS WITH A COLUMN LETTER IN THE ALLOWED TABLE */
+void
+scanLetters(const unsigned char *col, int count, const bool allowed[256], unsigned long long *match, int firstWord, int lastWord)
+{
+	for (int w = firstWord; w < lastWord; w++)
+	{
+		const unsigned char *v = col + w * 64;
+		int n = min(64, count - w * 64);
+		unsigned long long bits = 0;
+
+		if (match[w] == 0)
+			continue;
+		for (int b = 0; b < n; b++)
+			bits |= (unsigned long long)allowed[v[b]] << b;
+		match[w] &= bits;
+	}
+}
+
+/* KEEP THE WORLDS WITH ALL THE need TRADE CODES AND NONE OF THE ban ONES */
+void
+scanCodes(const unsigned short *col, int count, int need, int ban, unsigned long long *match, int firstWord, int lastWord)
+{
+	for (int w = firstWord; w < lastWord; w++)
+	{
+		const unsigned short *v = col + w * 64;
+		int n = min(64, count - w * 64);
+		unsigned long long bits = 0;
+
+		if (match[w] == 0)
+			continue;
+		for (int b = 0; b < n; b++)
+			bits |= (unsigned long long)((v[b] & (need | ban)) == need) << b;
+		match[w] &= bits;
+	}
+}
+
+/* KEEP THE WORLDS WITHIN jump PARSECS OF A HEX MARKED IN nearHex */
+void
+scanNear(const worldColumns &cols, int jump, const vector<char> &nearHex, unsigned long long *match, int firstWord, int lastWord)
+{
+	vector<int> dx[2], dy[2], dist[2];
+	int width = options.regionCols * SECTOR_COLS;
+	int height = options.regionRows * SECTOR_ROWS;
+
+	jumpOffsets(jump, dx, dy, dist);
+
+	for (int w = firstWord; w < lastWord; w++)
+	{
+		unsigned long long bits = match[w];
+
+		while (bits != 0)
+		{
+			int b = __builtin_ctzll(bits);
+			int i = w * 64 + b;
+			int odd = cols.x[i] & 1;
+			bool found = false;
+
+			bits &= bits - 1;
+			for (size_t k = 0; k < dx[odd].size() && !found; k++)
+			{
+				int x = cols.x[i] + dx[odd][k];
+				int y = cols.y[i] + dy[odd][k];
+				if (x < 0 || x >= width || y < 0 || y >= height)
+					continue;
+
+				found = nearHex[y * width + x];
+			}
+			if (!found)
+				match[w] &= ~(1ULL << b);
+		}
+	}
+}
+
+/* WRITE THE WORLDS A QUERY FOUND, FETCHING EACH BY ITS INDEX */
+void
+writeQueryFile(const vector<unsigned long long> &match, const generatedSystem &(*fetch)(int i, void *arg), void *arg)
+{
+	string outFile = regionFilePath(".query");
+	int found = 0;
+	int lastSecX = -1, lastSecY = -1;
+
+	ofstream out(outFile.c_str());
+
+	out << formatVersion(options.outputFormat);
+	out << "#Query: " << options.query << "\n";
+
+	for (size_t w = 0; w < match.size(); w++)
+	{
+		for (unsigned long long bits = match[w]; bits != 0; bits &= bits - 1)
+		{
+			const generatedSystem &s = fetch(w * 64 + __builtin_ctzll(bits), arg);
+			int secX = s.regionX / SECTOR_COLS, secY = s.regionY / SECTOR_ROWS;
+
+			/* Hexes are numbered within their sector */
+			if (options.regionCols * options.regionRows > 1 && (secX != lastSecX || secY != lastSecY))
+				out << "#Sector: " << options.sectorName << "_" << secX << "_" << secY << "\n";
+			lastSecX = secX;
+			lastSecY = secY;
+
+			writeSystemLine(out, options.outputFormat, s);
+			out << "\n";
+			found++;
+		}
+	}
+	out.close();
+
+	*report << "Query: " << found << " worlds, file: " << outFile << "\n";
+}
+
+/* FETCH ONE WORLD OF THE REGION */
+const generatedSystem &
+regionRow(int i, void *)
+{
+	return regionSys[i];
+}
+
+/* WRITE THE REGION AS A COLUMNAR ARCHIVE */
+/*
+	The worlds are cut into blocks of ARCHIVE_BLOCK, and each column is
+	written as its blocks one after another, so a scan reads only the
+	columns it needs. Trade codes and allegiances are numbered from a
+	dictionary, and bases and zones, mostly blank, are stored as runs.
+	A directory at the end of the file gives the place, size and the
+	smallest and largest value of every block of every column, which
+	lets a scan skip the blocks that cannot match.
+*/
+void
+writeArchive()
+{
+	archiveIndex arc;
+	map<string, int> dictIndex[2];
+	string outFile = regionFilePath(".gsa");
+
+	*report << "Archive file: " << outFile << "\n";
+
+	arc.count = regionSys.size();
+	arc.numBlocks = (arc.count + ARCHIVE_BLOCK - 1) / ARCHIVE_BLOCK;
+	arc.regionCols = options.regionCols;
+	arc.regionRows = options.regionRows;
+	arc.sectorName = options.sectorName;
+
+	/* Number the trade codes and allegiances in the order first seen */
+	for (size_t i = 0; i < regionSys.size(); i++)
+	{
+		const string *text[2] = {&regionSys[i].codes, &regionSys[i].allegiance};
+		for (int d = 0; d < 2; d++)
+		{
+			if (dictIndex[d].insert(make_pair(*text[d], (int)arc.dict[d].size())).second)
+				arc.dict[d].push_back(*text[d]);
+		}
+	}
+	if (arc.dict[0].size() > 65536 || arc.dict[1].size() > 65536){
+		cerr << "Too many different trade codes or allegiances to archive\n";
+		return;
+	}
+
+	ofstream out(outFile.c_str(), ios::binary);
+	out.write(ARCHIVE_MAGIC, 8);
+
+	for (int col = 0; col < ARC_COLUMNS; col++)
+	{
+		arc.offset[col].resize(arc.numBlocks);
+		arc.length[col].resize(arc.numBlocks);
+		arc.low[col].resize(arc.numBlocks);
+		arc.high[col].resize(arc.numBlocks);
+
+		for (int b = 0; b < arc.numBlocks; b++)
+		{
+			int first = b * ARCHIVE_BLOCK;
+			int last = min(first + ARCHIVE_BLOCK, (int)arc.count);
+			vector<int> values(last - first);
+			string bytes;
+
+			for (int i = first; i < last; i++)
+			{
+				const generatedSystem &s = regionSys[i];
+				switch(col){
+				case ARC_NAME:
+					break;
+				case ARC_HEX:
+					values[i - first] = s.hex;
+					break;
+				case ARC_X:
+					values[i - first] = s.regionX;
+					break;
+				case ARC_Y:
+					values[i - first] = s.regionY;
+					break;
+				case ARC_PORT:
+					values[i - first] = (unsigned char)s.UWP[0];
+					break;
+				case ARC_MUL:
+					values[i - first] = s.PBG / 100;
+					break;
+				case ARC_BASE:
+					values[i - first] = (unsigned char)s.base;
+					break;
+				case ARC_ZONE:
+					values[i - first] = (unsigned char)s.zone;
+					break;
+				case ARC_CODES:
+					values[i - first] = dictIndex[0][s.codes];
+					break;
+				case ARC_ALLEGIANCE:
+					values[i - first] = dictIndex[1][s.allegiance];
+					break;
+				default:
+					/* UWP digits, then belts and gas giants */
+					if (col - ARC_DIGIT < 6)
+						values[i - first] = hexValue(s.UWP[col - ARC_DIGIT + 1]);
+					else if (col - ARC_DIGIT == 6)
+						values[i - first] = hexValue(s.UWP[8]);
+					else if (col - ARC_DIGIT == FILTER_BELTS)
+						values[i - first] = (s.PBG / 10) % 10;
+					else
+						values[i - first] = s.PBG % 10;
+					break;
+				}
+			}
+
+			/* Block statistics; for trade codes, the bits every world
+			   has and the bits any world has */
+			int low = INT_MAX, high = INT_MIN;
+			if (col == ARC_CODES){
+				low = 0xffff;
+				high = 0;
+			}
+			for (size_t k = 0; k < values.size(); k++)
+			{
+				if (col == ARC_CODES){
+					int mask = tradeMask(arc.dict[0][values[k]]);
+					low &= mask;
+					high |= mask;
+				}else{
+					low = min(low, values[k]);
+					high = max(high, values[k]);
+				}
+			}
+
+			if (col == ARC_NAME){
+				for (int i = first; i < last; i++)
+				{
+					string name = regionSys[i].name.substr(0, 255);
+					bytes += (char)name.size();
+					bytes += name;
+				}
+			}else if (archiveEncoding[col] == ARC_RLE){
+				for (size_t k = 0; k < values.size(); )
+				{
+					size_t run = 1;
+					while (k + run < values.size() && values[k + run] == values[k] && run < 65536)
+						run++;
+					putArchiveInt(bytes, run - 1, 2);
+					putArchiveInt(bytes, values[k], 1);
+					k += run;
+				}
+			}else{
+				for (size_t k = 0; k < values.size(); k++)
+					putArchiveInt(bytes, values[k], archiveEncoding[col]);
+			}
+
+			arc.offset[col][b] = out.tellp();
+			arc.length[col][b] = bytes.size();
+			arc.low[col][b] = low;
+			arc.high[col][b] = high;
+			out.write(bytes.data(), bytes.size());
+		}
+	}
+
+	/* The directory, then where to find it */
+	string dir;
+	long long dirOffset = out.tellp();
+
+	putArchiveInt(dir, ARCHIVE_BLOCK, 4);
+	putArchiveInt(dir, arc.count, 8);
+	putArchiveInt(dir, arc.regionCols, 4);
+	putArchiveInt(dir, arc.regionRows, 4);
+	putArchiveInt(dir, arc.sectorName.size(), 4);
+	dir += arc.sectorName;
+	for (int d = 0; d < 2; d++)
+	{
+		putArchiveInt(dir, arc.dict[d].size(), 4);
+		for (size_t k = 0; k < arc.dict[d].size(); k++)
+		{
+			putArchiveInt(dir, arc.dict[d][k].size(), 4);
+			dir += arc.dict[d][k];
+		}
+	}
+	putArchiveInt(dir, ARC_COLUMNS, 4);
+	for (int col = 0; col < ARC_COLUMNS; col++)
+	{
+		putArchiveInt(dir, archiveEncoding[col], 1);
+		for (int b = 0; b < arc.numBlocks; b++)
+		{
+			putArchiveInt(dir, arc.offset[col][b], 8);
+			putArchiveInt(dir, arc.length[col][b], 4);
+			putArchiveInt(dir, arc.low[col][b], 4);
+			putArchiveInt(dir, arc.high[col][b], 4);
+		}
+	}
+	putArchiveInt(dir, dirOffset, 8);
+	dir.append(ARCHIVE_MAGIC, 8);
+
+	out.write(dir.data(), dir.size());
+	out.close();
+}
+
+/* OPEN AN ARCHIVE AND READ ITS DIRECTORY */
+bool
+openArchive(const string &path, archiveIndex &arc)
+{
+	char magic[8];
+
+	arc.in.open(path.c_str(), ios::binary);
+	if (!arc.in)
+		return false;
+
+	arc.in.seekg(0, ios::end);
+	long long end = arc.in.tellg();
+	if (end < 24)
+		return false;
+	string tail = readArchiveBytes(arc, end - 16, 16);
+	const char *p = tail.data();
+	long long dirOffset = getArchiveInt(p, 8);
+	memcpy(magic, p, 8);
+
+	if (tail.size() != 16 || memcmp(magic, ARCHIVE_MAGIC, 8) != 0 || dirOffset < 8 || dirOffset > end - 16)
+		return false;
+
+	string dir = readArchiveBytes(arc, dirOffset, end - 16 - dirOffset);
+	p = dir.data();
+	const char *dirEnd = p + dir.size();
+
+	int blockSize = getArchiveInt(p, 4);
+	arc.count = getArchiveInt(p, 8);
+	arc.regionCols = getArchiveInt(p, 4);
+	arc.regionRows = getArchiveInt(p, 4);
+	int size = getArchiveInt(p, 4);
+	if (blockSize != ARCHIVE_BLOCK || arc.count < 0 || size < 0 || size > dirEnd - p)
+		return false;
+	arc.sectorName.assign(p, size);
+	p += size;
+	arc.numBlocks = (arc.count + ARCHIVE_BLOCK - 1) / ARCHIVE_BLOCK;
+
+	for (int d = 0; d < 2; d++)
+	{
+		if (dirEnd - p < 4)
+			return false;
+		size = getArchiveInt(p, 4);
+		arc.dict[d].resize(limit(size, 0, 65536));
+		for (size_t k = 0; k < arc.dict[d].size(); k++)
+		{
+			if (dirEnd - p < 4 || (size = getArchiveInt(p, 4)) < 0 || size > dirEnd - p)
+				return false;
+			arc.dict[d][k].assign(p, size);
+			p += size;
+		}
+	}
+	if (dirEnd - p < 4)
+		return false;
+
+	if (getArchiveInt(p, 4) != ARC_COLUMNS || dirEnd - p != (long long)ARC_COLUMNS * (1 + 20 * arc.numBlocks))
+		return false;
+
+	for (int col = 0; col < ARC_COLUMNS; col++)
+	{
+		if (getArchiveInt(p, 1) != archiveEncoding[col])
+			return false;
+
+		arc.offset[col].resize(arc.numBlocks);
+		arc.length[col].resize(arc.numBlocks);
+		arc.low[col].resize(arc.numBlocks);
+		arc.high[col].resize(arc.numBlocks);
+		for (int b = 0; b < arc.numBlocks; b++)
+		{
+			arc.offset[col][b] = getArchiveInt(p, 8);
+			arc.length[col][b] = getArchiveInt(p, 4);
+			arc.low[col][b] = (int)getArchiveInt(p, 4);
+			arc.high[col][b] = (int)getArchiveInt(p, 4);
+		}
+	}
+	return true;
+}
+
+/* READ ONE BLOCK OF ONE COLUMN OF AN ARCHIVE */
+void
+readArchiveColumn(archiveIndex &arc, int col, int block, vector<int> &values, vector<string> *names)
+{
+	int count = min((long long)ARCHIVE_BLOCK, arc.count - (long long)block * ARCHIVE_BLOCK);
+	string bytes = readArchiveBytes(arc, arc.offset[col][block], arc.length[col][block]);
+	const char *p = bytes.data();
+	const char *end = p + bytes.size();
+
+	if (col == ARC_NAME){
+		names->resize(count);
+		for (int k = 0; k < count && p < end; k++)
+		{
+			int size = (unsigned char)*p++;
+			(*names)[k].assign(p, min(size, (int)(end - p)));
+			p += size;
+		}
+		return;
+	}
+
+	values.assign(count, 0);
+	if (archiveEncoding[col] == ARC_RLE){
+		for (int k = 0; k < count && end - p >= 3; )
+		{
+			int run = getArchiveInt(p, 2) + 1;
+			int value = getArchiveInt(p, 1);
+			for (; run > 0 && k < count; run--)
+				values[k++] = value;
+		}
+	}else{
+		int width = archiveEncoding[col];
+		for (int k = 0; k < count && end - p >= width; k++)
+			values[k] = (int)getArchiveInt(p, width);
+	}
+}
+
+/* READ ALL THE WORLDS OF ONE BLOCK OF AN ARCHIVE */
+void
+readArchiveRows(archiveIndex &arc, int block, vector<generatedSystem> &rows)
+{
+	vector<int> values[ARC_COLUMNS];
+	vector<string> names;
+
+	for (int col = 0; col < ARC_COLUMNS; col++)
+		readArchiveColumn(arc, col, block, values[col], &names);
+
+	rows.resize(names.size());
+	for (size_t k = 0; k < rows.size(); k++)
+	{
+		generatedSystem &s = rows[k];
+		int codes = min(values[ARC_CODES][k], (int)arc.dict[0].size() - 1);
+		int ali = min(values[ARC_ALLEGIANCE][k], (int)arc.dict[1].size() - 1);
+
+		s.name = names[k];
+		s.hex = values[ARC_HEX][k];
+		s.UWP = (char)values[ARC_PORT][k];
+		for (int d = 0; d < 6; d++)
+			s.UWP += hexChar(values[ARC_DIGIT + d][k]);
+		s.UWP += "-";
+		s.UWP += hexChar(values[ARC_DIGIT + 6][k]);
+		s.base = (char)values[ARC_BASE][k];
+		s.codes = ((codes < 0) ? "" : arc.dict[0][codes]);
+		s.PBG = values[ARC_MUL][k] * 100 + values[ARC_DIGIT + FILTER_BELTS][k] * 10 + values[ARC_DIGIT + FILTER_BELTS + 1][k];
+		s.allegiance = ((ali < 0) ? "" : arc.dict[1][ali]);
+		s.zone = (char)values[ARC_ZONE][k];
+		s.stellar = s.satellite = s.gasGiant = "";
+		s.regionX = values[ARC_X][k];
+		s.regionY = values[ARC_Y][k];
+		s.canon = false;
+	}
+}
+
+/* ANSWER A QUERY FROM AN ARCHIVE, READING ONLY THE COLUMNS AND BLOCKS IT NEEDS */
+void
+scanArchive()
+{
+	archiveIndex arc;
+	worldQuery query;
+	worldColumns cols;
+
+	if (!openArchive(options.scanPath, arc)){
+		cerr << "Not an archive: " << options.scanPath << "\n";
+		return;
+	}
+
+	/* Labels and jump ranges are those of the archived region */
+	options.regionCols = arc.regionCols;
+	options.regionRows = arc.regionRows;
+	options.sectorName = arc.sectorName;
+
+	if (options.query.empty()){
+		cout << "Archive: " << arc.count << " worlds in " << arc.numBlocks << " blocks, " <<
+			options.regionCols << "x" << options.regionRows << " sectors named " << arc.sectorName << "\n";
+		return;
+	}
+
+	if (!parseQuery(options.query, query)){
+		cerr << "Bad query: " << options.query << "\n";
+		return;
+	}
+
+	/* Mark the blocks of each column some part of the query could match */
+	vector<vector<char> > blocks(ARC_COLUMNS, vector<char>(arc.numBlocks, 0));
+	markArchiveBlocks(arc, query, false, blocks);
+
+	cols.count = arc.count;
+	cols.archive = &arc;
+	for (int col = 0; col < ARC_COLUMNS; col++)
+	{
+		vector<int> values;
+
+		if (find(blocks[col].begin(), blocks[col].end(), 1) == blocks[col].end())
+			continue;
+
+		switch(col){
+		case ARC_PORT:
+			cols.port.resize(cols.count);
+			break;
+		case ARC_BASE:
+			cols.base.resize(cols.count);
+			break;
+		case ARC_ZONE:
+			cols.zone.resize(cols.count);
+			break;
+		case ARC_CODES:
+			cols.codes.resize(cols.count);
+			break;
+		case ARC_X:
+			cols.x.resize(cols.count);
+			break;
+		case ARC_Y:
+			cols.y.resize(cols.count);
+			break;
+		default:
+			cols.digit[col - ARC_DIGIT].resize(cols.count);
+			break;
+		}
+
+		for (int b = 0; b < arc.numBlocks; b++)
+		{
+			if (!blocks[col][b])
+				continue;
+
+			readArchiveColumn(arc, col, b, values, NULL);
+			for (size_t k = 0; k < values.size(); k++)
+			{
+				int i = b * ARCHIVE_BLOCK + k;
+				switch(col){
+				case ARC_PORT:
+					cols.port[i] = values[k];
+					break;
+				case ARC_BASE:
+					cols.base[i] = values[k];
+					break;
+				case ARC_ZONE:
+					cols.zone[i] = values[k];
+					break;
+				case ARC_CODES:
+					cols.codes[i] = ((values[k] < (int)arc.dict[0].size()) ? tradeMask(arc.dict[0][values[k]]) : 0);
+					break;
+				case ARC_X:
+					cols.x[i] = values[k];
+					break;
+				case ARC_Y:
+					cols.y[i] = values[k];
+					break;
+				default:
+					cols.digit[col - ARC_DIGIT][i] = values[k];
+					break;
 				}
-				break;
 			}
 		}
 	}
-	cout << "# of Systems: " << secDataLine << "\n";
+
+	vector<unsigned long long> match;
+	scanQuery(cols, query, match);
+
+	/* Only the blocks with a match are read in full */
+	archiveRows rows;
+	rows.arc = &arc;
+	rows.block = -1;
+	writeQueryFile(match, archiveRow, &rows);
 }
 
-/* GENERATE A SYSTEM */
+/* MARK THE COLUMN BLOCKS A QUERY NEEDS READ, SKIPPING BLOCKS IT CANNOT MATCH */
 void
-generateSystem(int x, int y, string ali, string hexName)
+markArchiveBlocks(const archiveIndex &arc, const worldQuery &query, bool placed, vector<vector<char> > &blocks)
 {
-	static int giants[] = {1, 1, 2, 2, 3, 3, 4, 4, 4, 5, 5};
-    static int belts[] = {1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 3};
-	string tra;
-    char cla, bas, zon;
-    int siz, atm, hyd, pop, gov, law, tl, gas, pla, mul;
-    bool sco, nav, dep, mil, way;
+	const worldFilter &is = query.is;
+	bool near = (placed || !query.near.empty());
 
-    /* Starport class */
-	int roll = D2 - 2;
+	for (int b = 0; b < arc.numBlocks; b++)
+	{
+		if (!archiveBlockMatches(arc, is, b))
+			continue;
 
-	switch(maturity){
-	case 1:
-		cla = *("AABBCCCDEEX" + roll); /* backwater */
-		break;
-	case 2:
-		cla = *("AAABBCCDEEX" + roll); /* frontier (standard) */
-		break;
-	case 3:
-		cla = *("AAABBCCDEEE" + roll); /* mature */
-		break;
-	case 4:
-		cla = *("AAAABBCCDEX" + roll); /* cluster */
-		break;
-	default:
-		cla = *("AAABBCCDEEE" + roll); /* Default is mature */
-		break;
+		for (int d = 0; d < FILTER_DIGITS; d++)
+			if (is.low[d] > 0 || is.high[d] < filterDigitMax[d])
+				blocks[ARC_DIGIT + d][b] = 1;
+		if (!is.ports.empty())
+			blocks[ARC_PORT][b] = 1;
+		if (!is.bases.empty())
+			blocks[ARC_BASE][b] = 1;
+		if (!is.zones.empty())
+			blocks[ARC_ZONE][b] = 1;
+		if (is.needCodes != 0 || is.banCodes != 0)
+			blocks[ARC_CODES][b] = 1;
+		if (near){
+			blocks[ARC_X][b] = 1;
+			blocks[ARC_Y][b] = 1;
+		}
 	}
 
-    /* Physical characteristics */
-    siz = D2 - 2;
-    atm = ((siz == 0) ? 0 : (D2 - 7 + siz));
-    atm = limit(atm, 0, 15);
-    hyd = D2 - 7 + siz + DM(atm < 2 || atm > 9, -4);
-    hyd = ((siz < 2) ? 0 : hyd);
-    hyd = limit(hyd, 0, 10);
-
-    /* Demographics */
-    pop = D2 - 2;
-    gov = D2 - 7 + pop;
-    gov = limit(gov, 0, 15);
-    law = D2 - 7 + gov;
-    law = limit(law, 0, 20);
-
-    /* Technological Level */
-    tl = D1 + DM(cla == 'A', 6) + DM(cla == 'B', 4) + DM(cla == 'C', 2) +
-        DM(cla == 'X', -4);
-    tl = tl + DM(siz < 5, 1) + DM(siz < 2, 1);
-    tl = tl + DM(atm < 4, 1) + DM(atm > 9 && atm < 15, 1);
-    tl = tl + DM(hyd == 8, 1) + DM(hyd == 9, 2);
-    tl = tl + DM(pop > 0 && pop < 6, 1) + DM(pop == 9, 2) +
-        DM(pop == 10, 4);
-    tl = tl + DM(gov == 0 || gov == 5, 1) + DM(gov == 13, -2);
-    tl = limit(tl, 0, 16);
+	for (size_t n = 0; n < query.near.size(); n++)
+		markArchiveBlocks(arc, query.near[n], true, blocks);
+}
 
-    /* System characteristics (PBG) */
-    mul = diceRoll(5) + ((D1 > 3) ? -1 : 4);/* population multiplier */
-    pla = ((D2 < 8) ? 0 : belts[D2 - 2]);	/* planetoid belts */
-    gas = ((D2 < 5) ? 0 : giants[D2 - 2]);	/* gas giants */
+/* CHECK THE BLOCK STATISTICS TO SEE IF ANY WORLD OF A BLOCK COULD MATCH */
+bool
+archiveBlockMatches(const archiveIndex &arc, const worldFilter &is, int block)
+{
+	const string *letters[3] = {&is.ports, &is.bases, &is.zones};
+	const int letterCols[3] = {ARC_PORT, ARC_BASE, ARC_ZONE};
 
-    /* Travel advisories */
-	zon = ((cla == 'X') ? 'R' : ((D2 > 11) ? 'A' : ' '));
+	for (int d = 0; d < FILTER_DIGITS; d++)
+	{
+		if (is.low[d] > arc.high[ARC_DIGIT + d][block] || is.high[d] < arc.low[ARC_DIGIT + d][block])
+			return false;
+	}
 
-    /* Bases */
-    nav = (cla < 'C' && D2 > 7);
-    sco = (cla < 'E' && (D2 + DM(cla == 'A', -3) + DM(cla == 'B', -2) + DM(cla == 'C', -1)) > 6) ;
-    mil = (cla < 'D' && (D2 + DM(pop > 8, -1) + DM((atm > 1 && atm < 6 && hyd < 4), -20)) > 11);
-    dep = (cla < 'B' && gov > 9);
-    way = (cla < 'B' && (hyd > 4));
-    bas = (nav && sco ? 'A' : (nav && way ? 'B' : (way ? 'W' : (dep && nav ? 'D' : (nav ? 'N' : (sco ? 'S' : (mil ? 'M' : ' ')))))));
+	for (int l = 0; l < 3; l++)
+	{
+		bool any = letters[l]->empty();
+		for (int c = arc.low[letterCols[l]][block]; c <= arc.high[letterCols[l]][block] && !any; c++)
+			any = allows(*letters[l], c);
+		if (!any)
+			return false;
+	}
+
+	/* Every world has the low bits, some world has the high bits */
+	return ((is.needCodes & ~arc.high[ARC_CODES][block]) == 0 && (is.banCodes & arc.low[ARC_CODES][block]) == 0);
+}
+
+/* FETCH ONE WORLD OF AN ARCHIVE, READING ITS BLOCK IF NEED BE */
+const generatedSystem &
+archiveRow(int i, void *arg)
+{
+	archiveRows &rows = *(archiveRows *)arg;
+
+	if (i / ARCHIVE_BLOCK != rows.block){
+		rows.block = i / ARCHIVE_BLOCK;
+		readArchiveRows(*rows.arc, rows.block, rows.rows);
+	}
+	return rows.rows[i % ARCHIVE_BLOCK];
+}
+
+/* READ BYTES FROM AN ARCHIVE */
+string
+readArchiveBytes(archiveIndex &arc, long long offset, long long length)
+{
+	string bytes(max(length, 0LL), '\0');
+
+	arc.in.clear();
+	arc.in.seekg(offset);
+	arc.in.read(&bytes[0], bytes.size());
+	bytes.resize(arc.in.gcount());
+	return bytes;
+}
+
+/* APPEND A LITTLE-ENDIAN INTEGER OF size BYTES */
+void
+putArchiveInt(string &bytes, long long value, int size)
+{
+	for (int k = 0; k < size; k++)
+		bytes += (char)((value >> (8 * k)) & 0xff);
+}
+
+/* TAKE A LITTLE-ENDIAN INTEGER OF size BYTES, 4 BYTE ONES BEING SIGNED */
+long long
+getArchiveInt(const char *&p, int size)
+{
+	unsigned long long value = 0;
+
+	for (int k = 0; k < size; k++)
+		value |= (unsigned long long)(unsigned char)p[k] << (8 * k);
+	p += size;
+
+	if (size == 4 && (value & 0x80000000ULL))
+		value |= ~0ULL << 32;
+	return (long long)value;
+}
+
+
+/* CONVERT AN INT TO ITS HEX CHARACTER EQUIVALENT */
+char
+hexChar(int i)
+{
+    if (i < 0 || i > 34)
+        return '?';
+    else
+        return *("0123456789ABCDEFGHJKLMNPQRSTUVWXYZ" + i);
+}
+
+/* CONVERT A HEX CHARACTER BACK TO ITS INT VALUE */
+int
+hexValue(char c)
+{
+    const char *digits = "0123456789ABCDEFGHJKLMNPQRSTUVWXYZ";
+    const char *p = strchr(digits, c);
+
+    if (c == '\0' || p == NULL)
+        return -1;
+    else
+        return (int)(p - digits);
+}
+
+
+/* WORK OUT THE TRADE CLASSIFICATION BITS OF A UWP */
+int
+tradeBits(int siz, int atm, int hyd, int pop, int gov, int law)
+{
+    int codes = 0;
 
-    /* Trade classifications */
-    //tra = '\0';
     if (pop > 8)
-        tra = tra + "Hi ";        /* High Population */
+        codes |= TC_HI;        /* High Population */
     if (pop < 4)
-        tra = tra + "Lo ";        /* Low Population */
+        codes |= TC_LO;        /* Low Population */
     if (pop == 0 && gov == 0 && law == 0)
-        tra = tra + "Ba ";        /* Barren */
+        codes |= TC_BA;        /* Barren */
     if (atm > 3 && atm < 10 && hyd > 3 && hyd < 9 && pop > 4 && pop < 8)
-        tra = tra + "Ag ";        /* Agricultural */
+        codes |= TC_AG;        /* Agricultural */
     if (atm < 4 && hyd < 4 && pop > 5)
-        tra = tra + "Na ";        /* Non-Agricultural */
+        codes |= TC_NA;        /* Non-Agricultural */
     if (((atm > 1 && atm < 5) || atm == 7 || atm == 9) && pop > 8)
-        tra = tra + "In ";        /* Industrial */
+        codes |= TC_IN;        /* Industrial */
     if (pop < 7)
-        tra = tra + "Ni ";        /* Non-Industrial */
+        codes |= TC_NI;        /* Non-Industrial */
     if ((atm == 6 || atm == 8) && pop > 5 && pop < 9 && gov > 3 && gov < 10)
-        tra = tra + "Ri ";        /* Rich */
+        codes |= TC_RI;        /* Rich */
     if (atm > 1 && atm < 6 && hyd < 4)
-        tra = tra + "Po ";        /* Poor */
+        codes |= TC_PO;        /* Poor */
     if (hyd == 0 && atm > 1)
-        tra = tra + "De ";        /* Desert World */
+        codes |= TC_DE;        /* Desert World */
     if (hyd == 10)
-        tra = tra + "Wa ";        /* Water World */
+        codes |= TC_WA;        /* Water World */
     if (siz == 0 && atm == 0 && hyd == 0)
-        tra = tra + "As ";        /* Asteroid Belt */
+        codes |= TC_AS;        /* Asteroid Belt */
     else if (atm == 0)
-        tra = tra + "Va ";        /* Vaccuum World */
+        codes |= TC_VA;        /* Vaccuum World */
     if (siz > 9 && atm > 0)
-        tra = tra + "Fl ";        /* Fluid */
+        codes |= TC_FL;        /* Fluid */
     if (atm < 2 && hyd > 0)
-        tra = tra + "Ic ";        /* Ice-Capped */
-
-    /* Store the system */
-	sys[sdn].name = hexName;
-	sys[sdn].hex = (x*100) + y;
-
-	sys[sdn].UWP = sys[sdn].UWP + cla;
-	sys[sdn].UWP = sys[sdn].UWP + hexChar(siz);
-	sys[sdn].UWP = sys[sdn].UWP + hexChar(atm);
-	sys[sdn].UWP = sys[sdn].UWP + hexChar(hyd);
-	sys[sdn].UWP = sys[sdn].UWP + hexChar(pop);
-	sys[sdn].UWP = sys[sdn].UWP + hexChar(gov);
-	sys[sdn].UWP = sys[sdn].UWP + hexChar(law);
-	sys[sdn].UWP = sys[sdn].UWP + "-";
-	sys[sdn].UWP = sys[sdn].UWP + hexChar(tl);
-
-	sys[sdn].base = bas;
-	sys[sdn].codes = tra;
-	sys[sdn].PBG = (mul*100) + (pla*10) + gas;
-	sys[sdn].allegiance = ali;
-	sys[sdn].zone = zon;
-
-	sys[sdn].stellar = "";
-	sys[sdn].satellite = "";
-	sys[sdn].gasGiant = "";
-
-	sdn++;
-
+        codes |= TC_IC;        /* Ice-Capped */
+    return codes;
 }
 
-/* WRITE THE SECTOR FILE */
-void
-writeSectorFile(int outFormat)
+/* WORK OUT THE BASE CODE FROM THE BASES PRESENT */
+char
+baseCode(bool nav, bool sco, bool mil, bool dep, bool way)
 {
-	/* This function writes all the sector data to the file format specified */
-	int line = 1;
-	stringstream outFileCat;
+    return (nav && sco ? 'A' : (nav && way ? 'B' : (way ? 'W' : (dep && nav ? 'D' : (nav ? 'N' : (sco ? 'S' : (mil ? 'M' : ' ')))))));
+}
 
-	/* Create output file */
-	outFileCat << options.outputPath;
-	string outFile = outFileCat.str();
-	cout << "Output file: " << outFile << "\n";
+/* CONVERT A TRADE CLASSIFICATION STRING TO ITS TC_ BITS */
+int
+tradeMask(const string &codes)
+{
+    int mask = 0;
+    string code;
+    istringstream list(codes);
 
-	ofstream out(outFile.c_str(),ios::ate);
+    while (list >> code)
+    {
+        for (int i = 0; i < NUM_TRADE_CODES; i++)
+        {
+            if (code == tradeCodeNames[i]){
+                mask |= (1 << i);
+                break;
+            }
+        }
+    }
+    return mask;
+}
 
-	switch(outFormat){
-	case 1:
-		/* .sec v1.0: Original Standard UPP Format */
-		/* ----+----1----+----2----+----3----+----4----+----5----+----6----+----7----+----8 */
-		/* 0101 FAFAAZS-L b Ag Hi In Ri Wa Im z g r r                                       */
-		out << "#Version: 1.0\n";
 
-		while(line < secDataLine){
-			out << setw(4) << resetiosflags(ios::left) << setfill('0') << sys[line].hex << " ";
-			out << setw(9) << setiosflags(ios::left) << sys[line].UWP << "  ";
-			out << setw(1) << sys[line].base << " ";
-			out << setw(14) << setfill(' ') << sys[line].codes << " ";
-			out << setw(2) << sys[line].allegiance << " ";
-			out << setw(1) << sys[line].zone << " ";
-			out << setw(1) << resetiosflags(ios::left) << setfill('0') << sys[line].PBG % 1 << " ";
+/* DISTANCE IN PARSECS BETWEEN TWO HEXES OF THE REGION */
+int
+hexDistance(int x1, int y1, int x2, int y2)
+{
+    /* Odd columns sit half a hex lower; convert to axial coordinates */
+    int r1 = y1 - (x1 - (x1 & 1)) / 2;
+    int r2 = y2 - (x2 - (x2 & 1)) / 2;
+    int dq = x1 - x2;
+    int dr = r1 - r2;
 
-			if ((line + 1) < secDataLine){
-				 out << "\n";
-			}
+    return (abs(dq) + abs(dr) + abs(dq + dr)) / 2;
+}
 
-			line++;
-		}
-		out.close();
-		break;
-	case 2:
-		/* .sec v2.0: New Standard UWP Format (GEnie)  */
-		/* ----+----1----+----2----+----3----+----4----+----5----+----6----+----7----+----8 */
-		/* systemname123 0101 FAFAAZS-L  b Ag Hi In Ri Wa  z  pbg Im stellardata12345       */
-		out << "#Version: 2.0\n";
 
-		while(line < secDataLine){
-			out << setw(13) << setiosflags(ios::left) << setfill(' ') << sys[line].name << " ";
-			out << setw(4) << resetiosflags(ios::left) << setfill('0') << sys[line].hex << " ";
-			out << setw(9) << setiosflags(ios::left) << sys[line].UWP << "  ";
-			out << setw(1) << sys[line].base << " ";
-			out << setw(14) << setfill(' ') << sys[line].codes << "  ";
-			out << setw(1) << sys[line].zone << "  ";
-			out << setw(3) << resetiosflags(ios::left) << setfill('0') << sys[line].PBG << " ";
-			out << setw(2) << sys[line].allegiance;
-			out << setw(16) << setiosflags(ios::left) << setfill(' ') << sys[line].stellar;
+/* RUN A WORK FUNCTION FOR EVERY ITEM ACROSS THE WORKER THREADS */
+void
+parallelFor(int numItems, void (*work)(int item, void *arg), void *arg)
+{
+    atomic<int> next(0);
+    int numThreads = min(options.threads, numItems);
+    vector<thread> workers;
+    jobSettings settings;
 
-			if ((line + 1) < secDataLine){
-				 out << "\n";
-			}
+    if (numThreads > 1)
+        saveJobSettings(settings);
+    for (int i = 1; i < numThreads; i++)
+        workers.push_back(thread(parallelThread, settings, &next, numItems, work, arg));
 
-			line++;
-		}
-		out.close();
-		break;
-	case 3:
-		/* .sec v2.1: Heaven & Earth/Galactic .sec*/
-		/* ----+----1----+----2----+----3----+----4----+----5----+----6----+----7----+----8 */
-		/* systemnamehere0101 FAFAAZS-L  b Ag Hi In Ri Wa  z  pbg Im stellardata12345       */
-		out << "#Version: 2.1\n";
+    parallelWorker(&next, numItems, work, arg);
 
-		while(line < secDataLine){
-			out << setw(14) << setiosflags(ios::left) << setfill(' ') << sys[line].name;
-			out << setw(4) << resetiosflags(ios::left) << setfill('0') << sys[line].hex << " ";
-			out << setw(9) << setiosflags(ios::left) << sys[line].UWP << "  ";
-			out << setw(1) << sys[line].base << " ";
-			out << setw(14) << setfill(' ') << sys[line].codes << "  ";
-			out << setw(1) << sys[line].zone << "  ";
-			out << setw(3) << resetiosflags(ios::left) << setfill('0') << sys[line].PBG << " ";
-			out << setw(2) << sys[line].allegiance;
-			out << setw(16) << setiosflags(ios::left) << setfill(' ') << sys[line].stellar;
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+}
 
-			if ((line + 1) < secDataLine){
-				 out << "\n";
-			}
 
-			line++;
-		}
-		out.close();
-		break;
-	case 4:
-		/* .sec v2.2: Heaven & Earth .hes*/
-		/* ----+----1----+----2----+----3----+----4----+----5----+----6----+----7----+----8----+ */
-		/* 0101  systemnamehere  FAFAAZS-L  Ag Hi In Ri   pbg  b  Im  z  s  stellardatagoeshere1 */
-		out << "#Version: 2.2\n";
+/* TAKE WORK ITEMS UNTIL THERE ARE NONE LEFT */
+void
+parallelWorker(atomic<int> *next, int numItems, void (*work)(int item, void *arg), void *arg)
+{
+    int item;
 
-		while(line < secDataLine){
-			out << setw(4) << resetiosflags(ios::left) << setfill('0') << sys[line].hex << "  ";
-			out << setw(14) << setiosflags(ios::left) << setfill(' ') << sys[line].name << "  ";
-			out << setw(9) << setiosflags(ios::left) << sys[line].UWP << "  ";
-			out << setw(12) << setfill(' ') << sys[line].codes << "  ";
-			out << setw(3) << resetiosflags(ios::left) << setfill('0') << sys[line].PBG << "  ";
-			out << setw(1) << sys[line].base << "  ";
-			out << setw(2) << sys[line].allegiance << "  ";
-			out << setw(1) << sys[line].zone << "     ";
-			out << setw(20) << setiosflags(ios::left) << setfill(' ') << sys[line].stellar;
+    while ((item = (*next)++) < numItems)
+        work(item, arg);
+}
 
-			if ((line + 1) < secDataLine){
-				 out << "\n";
-			}
 
-			line++;
-		}
-		out.close();
-		break;
-	case 5:
-		/* .sec v2.3: gensec/mapsub v2) */
-		/* ----+----1----+----2----+----3----+----4----+----5----+----6----+----7----+----8 */
-		/* systemnamegoeshere 0101 FAFAAZS-L b Ag Hi In Ri Wa  pbg Im z                     */
-		out << "#Version: 2.3\n";
+/* A WORKER THREAD OF parallelFor(), WITH THE SETTINGS OF THE THREAD THAT STARTED IT */
+void
+parallelThread(jobSettings settings, atomic<int> *next, int numItems, void (*work)(int item, void *arg), void *arg)
+{
+    loadJobSettings(settings);
+    parallelWorker(next, numItems, work, arg);
+}
 
-		while(line < secDataLine){
-			out << setw(18) << setiosflags(ios::left) << setfill(' ') << sys[line].name << " ";
-			out << setw(4) << resetiosflags(ios::left) << setfill('0') << sys[line].hex << " ";
-			out << setw(9) << setiosflags(ios::left) << sys[line].UWP << " ";
-			out << setw(1) << sys[line].base << " ";
-			out << setw(15) << setfill(' ') << sys[line].codes << " ";
-			out << setw(3) << resetiosflags(ios::left) << setfill('0') << sys[line].PBG << " ";
-			out << setw(2) << sys[line].allegiance << " ";
-			out << setw(1) << sys[line].zone;
 
-			if ((line + 1) < secDataLine){
-				 out << "\n";
-			}
+/* COPY THIS THREAD'S JOB SETTINGS, TO HAND TO ANOTHER THREAD */
+void
+saveJobSettings(jobSettings &settings)
+{
+    settings.options = options;
+    settings.density = density;
+    settings.maturity = maturity;
+    settings.report = report;
+}
 
-			line++;
-		}
-		out.close();
-		break;
-	case 6:
-		/* .sec v2.5: travellermap.com */
-		/* ----+----1----+----2----+----3----+----4----+----5----+----6----+----7----+----8 */
-		/* systemnameis25characters1 0101 FAFAAZS-L b Ag Hi In Ri Wa            z pbg Im    */
-		out << "#Version: 2.5\n";
 
-		while(line < secDataLine){
-			out << setw(25) << setiosflags(ios::left) << setfill(' ') << sys[line].name << " ";
-			out << setw(4) << resetiosflags(ios::left) << setfill('0') << sys[line].hex << " ";
-			out << setw(9) << setiosflags(ios::left) << sys[line].UWP << " ";
-			out << setw(1) << sys[line].base << " ";
-			out << setw(25) << setfill(' ') << sys[line].codes << " ";
-			out << setw(1) << sys[line].zone << " ";
-			out << setw(3) << resetiosflags(ios::left) << setfill('0') << sys[line].PBG << " ";
-			out << setw(2) << sys[line].allegiance;
+/* TAKE ON THE JOB SETTINGS OF ANOTHER THREAD */
+void
+loadJobSettings(const jobSettings &settings)
+{
+    options = settings.options;
+    density = settings.density;
+    maturity = settings.maturity;
+    report = settings.report;
+}
 
-			if ((line + 1) < secDataLine){
-				 out << "\n";
-			}
 
-			line++;
-		}
-		out.close();
-		break;
-	//case 7:
-		/* .sec v3.0: Sector XML */
-		/* Not Yet Implemented */
-        //cout << "XML format not yet implemented" << "\n";
-		//break;
-	default:
-		/* default is set to 6 */
-        /* .sec v2.5: travellermap.com */
-		/* ----+----1----+----2----+----3----+----4----+----5----+----6----+----7----+----8 */
-		/* systemnameis25characters1 0101 FAFAAZS-L b Ag Hi In Ri Wa            z pbg Im    */
-		out << "#Version: 2.5\n";
+/* SEED THE DICE FOR ONE STREAM OF ONE HEX */
+void
+seedHex(int secX, int secY, int hex, int stream)
+{
+    unsigned long long h = mixBits(options.seed);
 
-		while(line < secDataLine){
-			out << setw(25) << setiosflags(ios::left) << setfill(' ') << sys[line].name << " ";
-			out << setw(4) << resetiosflags(ios::left) << setfill('0') << sys[line].hex << " ";
-			out << setw(9) << setiosflags(ios::left) << sys[line].UWP << " ";
-			out << setw(1) << sys[line].base << " ";
-			out << setw(25) << setfill(' ') << sys[line].codes << " ";
-			out << setw(1) << sys[line].zone << " ";
-			out << setw(3) << resetiosflags(ios::left) << setfill('0') << sys[line].PBG << " ";
-			out << setw(2) << sys[line].allegiance;
+    h = mixBits(h ^ (unsigned)secX);
+    h = mixBits(h ^ ((unsigned long long)(unsigned)secY << 32));
+    h = mixBits(h ^ (unsigned)(hex * 16 + stream));
+    rngState = h;
+}
 
-			if ((line + 1) < secDataLine){
-				 out << "\n";
-			}
 
-			line++;
-		}
-		out.close();
-		break;
-	}
+/* SCRAMBLE THE BITS OF A 64-BIT NUMBER (SPLITMIX64 FINALISER) */
+unsigned long long
+mixBits(unsigned long long z)
+{
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
 }
 
-/* CONVERT AN INT TO ITS HEX CHARACTER EQUIVALENT */
-char
-hexChar(int i)
+
+/* NEXT NUMBER FROM THE CURRENT RANDOM STREAM (SPLITMIX64) */
+unsigned long long
+nextRandom()
 {
-    if (i < 0 || i > 34)
-        return '?';
-    else
-        return *("0123456789ABCDEFGHJKLMNPQRSTUVWXYZ" + i);
+    rngState += 0x9e3779b97f4a7c15ULL;
+    return mixBits(rngState);
 }
 
 
@@ -776,7 +7740,7 @@ int
 diceRoll(int numSides)
 {
 	int rollResult;
-	rollResult = rand() % numSides + 1;
+	rollResult = nextRandom() % numSides + 1;
     return (rollResult);
 }
 
@@ -794,3 +7758,24 @@ nDiceRoll(int numDice, int numSides)
         return nDiceRoll(numDice - 1, numSides) + diceRoll(numSides);
     }
 }
+
+/* ODDS OF ROLLING OVER n ON 2D */
+double
+twoDiceOver(int n)
+{
+    int ways = 0;
+
+    for (int roll = max(n + 1, 2); roll <= 12; roll++)
+        ways += 6 - abs(roll - 7);
+    return ways / 36.0;
+}
+
+/* DRAW AN INDEX IN PROPORTION TO THE ODDS IN A RUNNING TOTAL */
+int
+sampleIndex(const vector<double> &cumulative)
+{
+    double r = (nextRandom() >> 11) * (1.0 / 9007199254740992.0) * cumulative.back();
+    int i = upper_bound(cumulative.begin(), cumulative.end(), r) - cumulative.begin();
+
+    return min(i, (int)cumulative.size() - 1);
+}